@@ -7,6 +7,12 @@ class AnalysisOptions final {
  public:
   bool wholeModuleCheck = false;
 
+  /// The number of threads that lex the input files; 0 uses every core.
+  unsigned numLexThreads = 0;
+
+  /// Whether to sample the memory of the ASTContext arenas after each phase.
+  bool sampleASTMemory = false;
+
  public:
 };
 }  // namespace analysis
@@ -44,6 +44,8 @@ class alignas(8) InputFile final {
  public:
   bool Init();
   static InputFile *Create(Compiler &compiler);
+
+  SrcID GetSrcID() const { return sid; }
 };
 
 class OutputFile final {};
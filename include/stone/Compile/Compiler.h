@@ -12,6 +12,7 @@ namespace stone {
 class CompilePipeline;
 
 namespace analysis {
+class LexedFile;
 
 struct CompileInputProfile final {};
 struct CompileOutputProfile final {};
@@ -38,6 +39,9 @@ class Compiler final : public Session {
   /// Current inputs in the system
   std::vector<InputFile *> inputs;
 
+  /// The tokens of each input, in the order of inputs.
+  std::vector<std::shared_ptr<LexedFile>> lexedInputs;
+
   /*
           /// Identifies the set of input buffers in the SrcMgr that are
     /// considered main source files.
@@ -57,6 +61,7 @@ class Compiler final : public Session {
 
  public:
   Compiler(CompilePipeline *pipeline = nullptr);
+  ~Compiler();
 
   /// Parse the given list of strings into an InputArgList.
   bool Build(llvm::ArrayRef<const char *> args) override;
@@ -88,6 +93,7 @@ class Compiler final : public Session {
   // TranslateInputArgs(const llvm::opt::InputArgList &args) override const;
   //
  private:
+  void Lex();
   void Parse();
   void Parse(bool check);
 
@@ -96,7 +102,11 @@ class Compiler final : public Session {
   void CheckSourceUnit();
   void CheckModule();
 
-  void BuildInputs();
+  /// Sample the ASTContext memory after \p phase if asked to.
+  void SampleASTMemory(llvm::StringRef phase);
+
+  void BuildInputs(const llvm::opt::DerivedArgList &args);
+  void BuildOptions(const llvm::opt::DerivedArgList &args);
 
  public:
   void *Allocate(size_t size, unsigned align) const {
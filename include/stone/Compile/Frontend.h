@@ -1,6 +1,9 @@
 #ifndef STONE_COMPILE_FRONTEND_H
 #define STONE_COMPILE_FRONTEND_H
 
+#include <memory>
+#include <vector>
+
 #include "llvm/ADT/ArrayRef.h"
 
 namespace llvm {
@@ -16,6 +19,8 @@ namespace stone {
 class Context;
 class CompilePipeline;
 class GenOptions;
+class SrcID;
+class SrcMgr;
 
 namespace syntax {
 class Module;
@@ -24,6 +29,16 @@ class ASTContext;
 
 namespace analysis {
 class Analysis;
+class LexedFile;
+
+/// Lex each of \p srcIDs into a LexedFile, running up to \p numThreads
+/// lexers at once; 0 uses one thread per core. The result is in the order of
+/// \p srcIDs. Files whose contents the SrcMgr shares are lexed once and
+/// share one LexedFile.
+std::vector<std::shared_ptr<LexedFile>> Lex(llvm::ArrayRef<SrcID> srcIDs,
+                                            SrcMgr &sm,
+                                            const stone::Context &ctx,
+                                            unsigned numThreads = 0);
 
 /// Parse a source file
 int Parse(Analysis &analysis, CompilePipeline *pipeline = nullptr);
@@ -11,12 +11,16 @@ namespace stone {
 
 class SrcID;
 class SrcMgr;
-class Token;
 class LangOptions;
 class CompilePipeline;
 
+namespace syntax {
+class ASTContext;
+}  // namespace syntax
+
 namespace analysis {
 class Token;
+class TokenBuffer;
 
 enum class TriviaRetentionMode {
   Without,
@@ -28,6 +32,61 @@ enum class TriviaRetentionMode {
 /// the encoding is invalid.
 uint32_t ValidateUTF8CharAndAdvance(const char *&startOfByte, const char *end);
 
+/// Return true if the code point \p c may start an identifier.
+bool IsValidIdentifierStartCodePoint(uint32_t c);
+
+/// Return true if the code point \p c may continue an identifier.
+bool IsValidIdentifierContinuationCodePoint(uint32_t c);
+
+/// Return the value of the string literal \p tok: the text between its
+/// quotes with escapes decoded and, for a multiline literal, the indentation
+/// of the closing quotes removed from every line. A single-line literal
+/// without escapes is returned as a reference into the source buffer; other
+/// literals are decoded into \p ac.
+StringRef GetStringLiteralValue(const Token &tok, syntax::ASTContext &ac);
+
+/// Return the keyword token kind spelled by \p text, or tk::identifier if
+/// \p text is not a keyword that is enabled (TOKON) in TokenKind.def.
+tk GetKeywordKind(StringRef text);
+
+/// A change to a source buffer: \p removedLength bytes at \p offset were
+/// replaced with \p insertedText.
+struct TextEdit {
+  unsigned offset;
+  unsigned removedLength;
+  StringRef insertedText;
+};
+
+/// Lex \p srcID, whose text is the text of \p oldTokens with \p edit applied,
+/// into \p tokens. Tokens before the edit are copied, lexing restarts a
+/// couple of tokens before the edit and stops as soon as a token after the
+/// edit lines up with one in \p oldTokens; the tokens after it are copied
+/// with their offsets shifted. Return the number of tokens that were lexed.
+unsigned Relex(const TokenBuffer &oldTokens, const TextEdit &edit,
+               const SrcID srcID, SrcMgr &sm, const Context &ctx,
+               TokenBuffer &tokens);
+
+/// A position of a Lexer that Lexer::RestoreState() can return to, e.g. when
+/// the parser gives up on a speculative parse.
+///
+/// Taking and restoring a state are O(1): the state holds the lexer's
+/// position and next token, and only where the next token's leading trivia
+/// starts. The trivia is lexed again from there if it is asked for.
+class LexerState final {
+  friend class Lexer;
+
+  const char *curPtr = nullptr;
+  const char *triviaStart = nullptr;
+  Token nextToken;
+  uint64_t nextIntegerValue = 0;
+  bool hasNextIntegerValue = false;
+
+ public:
+  LexerState() = default;
+
+  bool IsValid() const { return curPtr != nullptr; }
+};
+
 class Lexer final {
   const SrcID srcID;
   SrcMgr &sm;
@@ -72,6 +131,17 @@ class Lexer final {
   /// `TriviaRetentionMode::With`.
   Trivia trailingTrivia;
 
+  /// Where the leading trivia of nextToken starts.
+  const char *nextTokenTriviaStart = nullptr;
+
+  /// True if leadingTrivia and trailingTrivia do not belong to nextToken
+  /// because a state was restored.
+  bool triviaIsStale = false;
+
+  /// The value of nextToken if it is an integer literal that fits in 64 bits.
+  uint64_t nextIntegerValue = 0;
+  bool hasNextIntegerValue = false;
+
  public:
   // Making this public for now
   TriviaRetentionMode triviaRetention;
@@ -83,10 +153,16 @@ class Lexer final {
 
  private:
   void Lex();
-  void LexTrivia(Trivia trivia, bool isTrailing);
-  void LexIdentifier();
-  void LexNumber();
-  void LexStrLiteral();
+  void LexTrivia(Trivia &trivia, bool isTrailing);
+  void RelexTrivia();
+  bool SkipBlockComment();
+  void LexIdentifier(const char *tokStart);
+  void LexNumber(const char *tokStart);
+  void LexRadixNumber(const char *tokStart, unsigned radix);
+  void LexHexNumber(const char *tokStart);
+  void LexInvalidNumber(const char *tokStart);
+  void CreateIntegerToken(const char *tokStart, uint64_t value, bool overflow);
+  void LexStrLiteral(const char *tokStart, unsigned customDelimiterLen = 0);
   void LexChar();
 
   void Diagnose();
@@ -96,7 +172,15 @@ class Lexer final {
 
  public:
   Lexer(const SrcID srcID, SrcMgr &sm, const Context &ctx,
-        CompilePipeline *pipeline = nullptr);
+        CompilePipeline *pipeline = nullptr,
+        TriviaRetentionMode triviaRetention = TriviaRetentionMode::Without);
+
+  /// Create a lexer for the bytes [startOffset, endOffset) of the buffer.
+  /// \p startOffset must not be inside a token or a comment.
+  Lexer(const SrcID srcID, SrcMgr &sm, const Context &ctx,
+        unsigned startOffset, unsigned endOffset,
+        CompilePipeline *pipeline = nullptr,
+        TriviaRetentionMode triviaRetention = TriviaRetentionMode::Without);
 
  public:
   void Lex(Token &result) {
@@ -106,6 +190,7 @@ class Lexer final {
   void Lex(Token &result, Trivia &leading, Trivia &trailing) {
     result = nextToken;
     if (triviaRetention == TriviaRetentionMode::With) {
+      if (triviaIsStale) RelexTrivia();
       leading = {leadingTrivia};
       trailing = {trailingTrivia};
     }
@@ -115,6 +200,39 @@ class Lexer final {
   }
   Token &Peek() { return nextToken; }
 
+  /// Return the current position, so that the tokens from here on can be
+  /// lexed again after RestoreState().
+  LexerState GetState() const {
+    LexerState state;
+    state.curPtr = curPtr;
+    state.triviaStart = nextTokenTriviaStart;
+    state.nextToken = nextToken;
+    state.nextIntegerValue = nextIntegerValue;
+    state.hasNextIntegerValue = hasNextIntegerValue;
+    return state;
+  }
+
+  /// Return to \p state, which must have come from this lexer.
+  void RestoreState(const LexerState &state) {
+    assert(state.IsValid() && "restoring an invalid lexer state");
+    assert(state.curPtr >= bufferStart && state.curPtr <= bufferEnd &&
+           "lexer state from another buffer");
+    curPtr = state.curPtr;
+    nextTokenTriviaStart = state.triviaStart;
+    nextToken = state.nextToken;
+    nextIntegerValue = state.nextIntegerValue;
+    hasNextIntegerValue = state.hasNextIntegerValue;
+    triviaIsStale = true;
+  }
+
+  /// Lex the rest of the buffer into \p tokens, up to and including tk::eof.
+  /// Trivia is not kept.
+  void Lex(TokenBuffer &tokens);
+
+  /// Append Peek(), and its value if it is an integer literal, to \p tokens
+  /// and move to the next token.
+  void PushNextToken(TokenBuffer &tokens);
+
   SrcID GetSrcID() { return srcID; }
 };
 }  // namespace analysis
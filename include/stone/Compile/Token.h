@@ -24,11 +24,18 @@ class Token final {
   /// Length of custom delimiter of "raw" string literals
   unsigned customDelimiterLen : 8;
 
-  // Padding bits == 32 - 11;
+  /// Whether a string literal contains escape sequences.
+  unsigned hasEscapes : 1;
+
+  // Padding bits == 32 - 12;
 
   /// The length of the comment that precedes the token.
   unsigned commentLength;
 
+  /// For identifiers and keywords, IdentifierTable::HashName() of the text,
+  /// which the lexer computes while scanning it.
+  unsigned identifierHash;
+
   /// text - The actual string covered by the token in the source buffer.
   StringRef text;
 
@@ -45,7 +52,9 @@ class Token final {
         escapedIdentifier(false),
         multilineString(false),
         customDelimiterLen(0),
+        hasEscapes(false),
         commentLength(commentLength),
+        identifierHash(0),
         text(text) {}
 
   Token() : Token(tk::MAX, {}, 0) {}
@@ -156,14 +165,25 @@ class Token final {
   bool IsMultilineString() const { return multilineString; }
   /// Count of extending escaping '#'.
   unsigned GetCustomDelimiterLen() const { return customDelimiterLen; }
+  /// True if the string literal contains escape sequences, so its value is
+  /// not simply the text between the quotes.
+  bool HasEscapes() const { return hasEscapes; }
   /// Set characteristics of string literal token.
-  void setStringLiteral(bool isMultilineString, unsigned customDelimiterLen) {
+  void setStringLiteral(bool isMultilineString, unsigned customDelimiterLen,
+                        bool hasEscapes = false) {
     assert(kind == tk::string_literal);
     this->multilineString = isMultilineString;
     this->customDelimiterLen = customDelimiterLen;
+    this->hasEscapes = hasEscapes;
   }
   unsigned GetLength() const { return text.size(); }
 
+  /// Return the hash of the identifier or keyword text, which can be passed
+  /// to IdentifierTable::Get() instead of hashing the text again, or 0 for
+  /// other tokens.
+  unsigned GetIdentifierHash() const { return identifierHash; }
+  void SetIdentifierHash(unsigned hash) { identifierHash = hash; }
+
   bool HasComment() const { return commentLength != 0; }
 
   /*
@@ -210,9 +230,11 @@ class Token final {
     kind = K;
     text = T;
     this->commentLength = commentLength;
+    identifierHash = 0;
     escapedIdentifier = false;
     this->multilineString = false;
     this->customDelimiterLen = 0;
+    this->hasEscapes = false;
     assert(this->customDelimiterLen == customDelimiterLen &&
            "custom string delimiter length > 255");
   }
@@ -0,0 +1,226 @@
+#ifndef STONE_COMPILE_TOKENBUFFER_H
+#define STONE_COMPILE_TOKENBUFFER_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Allocator.h"
+#include "stone/Compile/Token.h"
+
+namespace stone {
+namespace analysis {
+
+/// Every token of a source buffer, stored as parallel arrays so that a
+/// token costs fourteen bytes: a kind byte, a flags byte, 32-bit offset and
+/// length into the buffer and, for an identifier or keyword, the hash that
+/// the lexer computed while scanning the name.
+/// The parser refers to tokens by index, which makes lookahead and
+/// backtracking an index computation instead of relexing.
+///
+/// The arrays are split into fixed-size chunks allocated from an arena, so
+/// appending never moves or copies tokens that are already stored.
+///
+/// Integer literals that fit in 64 bits also have their value, which the
+/// lexer computes while scanning the digits, in a side table keyed by token
+/// index.
+class TokenBuffer final {
+ public:
+  /// Bits of the per-token flags byte.
+  enum Flags : uint8_t {
+    AtStartOfLine = 1 << 0,
+    EscapedIdentifier = 1 << 1,
+    MultilineString = 1 << 2,
+    HasEscapes = 1 << 3,
+  };
+
+ private:
+  static constexpr unsigned ChunkShift = 12;
+  static constexpr unsigned ChunkSize = 1u << ChunkShift;
+  static constexpr unsigned ChunkMask = ChunkSize - 1;
+
+  static_assert(unsigned(tk::MAX) <= UINT8_MAX,
+                "token kinds no longer fit in a byte");
+
+  struct Chunk {
+    uint8_t kinds[ChunkSize];
+    uint8_t flags[ChunkSize];
+    uint32_t offsets[ChunkSize];
+    uint32_t lengths[ChunkSize];
+    uint32_t hashes[ChunkSize];
+  };
+
+  /// The buffer that the offsets are relative to.
+  StringRef buffer;
+  llvm::BumpPtrAllocator &alloc;
+  llvm::SmallVector<Chunk *, 8> chunks;
+  unsigned numTokens = 0;
+
+  /// (token index, value) for integer literals, in index order.
+  std::vector<std::pair<unsigned, uint64_t>> integerValues;
+
+  const Chunk &GetChunk(unsigned index) const {
+    assert(index < numTokens && "token index out of range");
+    return *chunks[index >> ChunkShift];
+  }
+
+ public:
+  /// Create an empty token buffer for tokens of \p buffer. The token arrays
+  /// are allocated from \p alloc and live as long as it does.
+  TokenBuffer(StringRef buffer, llvm::BumpPtrAllocator &alloc)
+      : buffer(buffer), alloc(alloc) {}
+
+  TokenBuffer(const TokenBuffer &) = delete;
+  void operator=(const TokenBuffer &) = delete;
+
+  /// Append \p tok, whose text must point into the buffer.
+  void Push(const Token &tok) {
+    StringRef text = tok.GetRawText();
+    assert(text.begin() >= buffer.begin() && text.end() <= buffer.end() &&
+           "token text is not in the buffer");
+    Push(tok.GetKind(), text.begin() - buffer.begin(), text.size(),
+         ComputeFlags(tok), tok.GetIdentifierHash());
+  }
+
+  /// Append a token given by its fields, e.g. one copied from another buffer.
+  void Push(tk kind, unsigned offset, unsigned length, uint8_t flags,
+            unsigned identifierHash = 0);
+
+  /// Append the token at \p index of \p other, and its integer value, moved
+  /// \p delta bytes.
+  void PushCopy(const TokenBuffer &other, unsigned index, int64_t delta = 0) {
+    Push(other.GetKind(index), other.GetOffset(index) + delta,
+         other.GetLength(index), other.GetFlags(index),
+         other.GetIdentifierHash(index));
+    if (other.Is(index, tk::integer_literal)) {
+      if (auto value = other.GetIntegerValue(index))
+        SetIntegerValue(numTokens - 1, *value);
+    }
+  }
+
+  /// Record \p value as the value of the integer literal at \p index. Values
+  /// are recorded in index order.
+  void SetIntegerValue(unsigned index, uint64_t value) {
+    assert(Is(index, tk::integer_literal) && "not an integer literal");
+    assert((integerValues.empty() || integerValues.back().first < index) &&
+           "integer values recorded out of order");
+    integerValues.emplace_back(index, value);
+  }
+
+  /// Return the value of the integer literal at \p index, or None if it does
+  /// not fit in 64 bits.
+  llvm::Optional<uint64_t> GetIntegerValue(unsigned index) const;
+
+  /// Return the flags byte that Push() stores for \p tok.
+  static uint8_t ComputeFlags(const Token &tok) {
+    uint8_t flags = 0;
+    if (tok.IsAtStartOfLine()) flags |= AtStartOfLine;
+    if (tok.IsEscapedIdentifier()) flags |= EscapedIdentifier;
+    if (tok.IsMultilineString()) flags |= MultilineString;
+    if (tok.HasEscapes()) flags |= HasEscapes;
+    return flags;
+  }
+
+  /// Return the number of tokens, including the trailing tk::eof once the
+  /// buffer has been lexed.
+  unsigned size() const { return numTokens; }
+  bool empty() const { return numTokens == 0; }
+
+  StringRef GetBuffer() const { return buffer; }
+
+  tk GetKind(unsigned index) const {
+    return tk(GetChunk(index).kinds[index & ChunkMask]);
+  }
+  bool Is(unsigned index, tk kind) const { return GetKind(index) == kind; }
+
+  uint8_t GetFlags(unsigned index) const {
+    return GetChunk(index).flags[index & ChunkMask];
+  }
+  bool IsAtStartOfLine(unsigned index) const {
+    return GetFlags(index) & AtStartOfLine;
+  }
+
+  /// Return the offset of the token's first character in the buffer.
+  unsigned GetOffset(unsigned index) const {
+    return GetChunk(index).offsets[index & ChunkMask];
+  }
+  unsigned GetLength(unsigned index) const {
+    return GetChunk(index).lengths[index & ChunkMask];
+  }
+
+  /// Return the hash of an identifier or keyword, or 0 for any other token;
+  /// see Token::GetIdentifierHash().
+  unsigned GetIdentifierHash(unsigned index) const {
+    return GetChunk(index).hashes[index & ChunkMask];
+  }
+
+  /// Return the raw text of the token, including the backticks of an escaped
+  /// identifier.
+  StringRef GetRawText(unsigned index) const {
+    const Chunk &chunk = GetChunk(index);
+    return StringRef(buffer.data() + chunk.offsets[index & ChunkMask],
+                     chunk.lengths[index & ChunkMask]);
+  }
+
+  /// Return the index of the first token at or after \p from that starts at
+  /// or after \p offset, or size() if there is none.
+  unsigned LowerBound(unsigned offset, unsigned from = 0) const;
+
+  /// Rebuild the Token at \p index.
+  Token GetToken(unsigned index) const;
+};
+
+/// The tokens of one source file together with the arena that holds them,
+/// so that files lexed on different threads never share an allocator.
+class LexedFile final {
+  llvm::BumpPtrAllocator alloc;
+
+ public:
+  TokenBuffer tokens;
+
+ public:
+  explicit LexedFile(StringRef buffer) : tokens(buffer, alloc) {}
+};
+
+/// A position in a lexed TokenBuffer. Copying a cursor is how the parser
+/// saves a position to backtrack to.
+class TokenCursor final {
+  const TokenBuffer *tokens;
+  unsigned index = 0;
+
+ public:
+  /// \p tokens must end with tk::eof.
+  explicit TokenCursor(const TokenBuffer &tokens) : tokens(&tokens) {
+    assert(!tokens.empty() && tokens.Is(tokens.size() - 1, tk::eof) &&
+           "token buffer has not been lexed to the end");
+  }
+
+  unsigned GetIndex() const { return index; }
+  void SetIndex(unsigned i) {
+    assert(i < tokens->size() && "token index out of range");
+    index = i;
+  }
+
+  /// Return the index of the token \p n tokens ahead, stopping at tk::eof.
+  unsigned GetLookaheadIndex(unsigned n = 0) const {
+    unsigned last = tokens->size() - 1;
+    return n < last - index ? index + n : last;
+  }
+
+  tk GetKind(unsigned n = 0) const {
+    return tokens->GetKind(GetLookaheadIndex(n));
+  }
+  bool Is(tk kind) const { return GetKind() == kind; }
+  Token Peek(unsigned n = 0) const {
+    return tokens->GetToken(GetLookaheadIndex(n));
+  }
+
+  /// Move to the next token; the cursor stays on tk::eof once it reaches it.
+  void Consume() { index = GetLookaheadIndex(1); }
+};
+
+}  // namespace analysis
+}  // namespace stone
+#endif
@@ -7,7 +7,28 @@
 
 namespace stone {
 namespace analysis {
-enum class TriviaKind { GarbageText };
+enum class TriviaKind {
+  /// A run of ' ' characters.
+  Space,
+  /// A run of '\t' characters.
+  Tab,
+  /// A run of '\v' characters.
+  VerticalTab,
+  /// A run of '\f' characters.
+  Formfeed,
+  /// A run of '\n' characters.
+  Newline,
+  /// A run of '\r' characters.
+  CarriageReturn,
+  /// A run of "\r\n" sequences.
+  CarriageReturnLineFeed,
+  /// A '//' comment, not including the line break.
+  LineComment,
+  /// A '/* */' comment, including nested comments.
+  BlockComment,
+  /// Bytes that are not part of any token, such as a BOM or a stray NUL.
+  GarbageText,
+};
 
 class TriviaPiece final {
   TriviaKind kind;
@@ -0,0 +1,114 @@
+#ifndef STONE_COMPILE_UNICODECHARSET_H
+#define STONE_COMPILE_UNICODECHARSET_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace stone {
+namespace unicode {
+
+/// An inclusive range of code points.
+struct UnicodeCharRange {
+  uint32_t lower;
+  uint32_t upper;
+};
+
+/// A set of code points, stored as a sorted array of disjoint, non-adjacent
+/// ranges. The ranges are not copied; they are expected to be a static table.
+///
+/// Code points in the Basic Multilingual Plane are answered by a two-level
+/// lookup that is built from the ranges at compile time: each 256 code point
+/// block is either entirely outside the set, entirely inside it, or has a
+/// 256-bit bitmap. Everything else is a binary search over the ranges.
+class UnicodeCharSet final {
+  static constexpr unsigned NumBMPBlocks = 0x10000 >> 8;
+  static constexpr unsigned MaxBitmaps = 32;
+
+  /// Block kinds; any other value is the index of the block's bitmap.
+  enum : uint8_t {
+    BlockOutside = 0xFF,
+    BlockInside = 0xFE,
+    /// The block is mixed but all bitmaps are in use.
+    BlockSearch = 0xFD,
+  };
+
+  const UnicodeCharRange *ranges;
+  size_t numRanges;
+  uint8_t blocks[NumBMPBlocks];
+  uint64_t bitmaps[MaxBitmaps][4];
+
+  /// Return true if \p c is in one of the ranges.
+  ///
+  /// The search narrows the window to the last range whose lower bound is
+  /// not above \p c. Each step is a compare and a conditional move rather
+  /// than a branch, so the number of steps only depends on the table size.
+  bool Search(uint32_t c) const {
+    const UnicodeCharRange *base = ranges;
+    size_t n = numRanges;
+    if (n == 0) return false;
+    while (n > 1) {
+      size_t half = n / 2;
+      base = base[half].lower <= c ? base + half : base;
+      n -= half;
+    }
+    return base->lower <= c && c <= base->upper;
+  }
+
+ public:
+  template <size_t N>
+  constexpr UnicodeCharSet(const UnicodeCharRange (&ranges)[N])
+      : ranges(ranges), numRanges(N), blocks(), bitmaps() {
+    unsigned numBitmaps = 0;
+    for (unsigned block = 0; block != NumBMPBlocks; ++block) {
+      uint32_t lower = block << 8;
+      uint32_t upper = lower + 0xFF;
+      uint32_t covered = 0;
+      for (const auto &range : ranges) {
+        if (range.upper >= lower && range.lower <= upper)
+          covered += (range.upper < upper ? range.upper : upper) -
+                     (range.lower > lower ? range.lower : lower) + 1;
+      }
+      if (covered == 0) {
+        blocks[block] = BlockOutside;
+      } else if (covered == 0x100) {
+        blocks[block] = BlockInside;
+      } else if (numBitmaps == MaxBitmaps) {
+        blocks[block] = BlockSearch;
+      } else {
+        blocks[block] = numBitmaps;
+        for (const auto &range : ranges) {
+          uint32_t c = range.lower > lower ? range.lower : lower;
+          for (; c <= range.upper && c <= upper; ++c)
+            bitmaps[numBitmaps][(c >> 6) & 3] |= uint64_t(1) << (c & 63);
+        }
+        ++numBitmaps;
+      }
+    }
+  }
+
+  /// Return true if \p c is in the set.
+  bool Contains(uint32_t c) const {
+    if (c < 0x10000) {
+      uint8_t block = blocks[c >> 8];
+      if (block < MaxBitmaps)
+        return (bitmaps[block][(c >> 6) & 3] >> (c & 63)) & 1;
+      if (block != BlockSearch) return block == BlockInside;
+    }
+    return Search(c);
+  }
+
+  /// Return true if the ranges are sorted, disjoint and non-adjacent, which
+  /// Contains() relies on.
+  bool IsValid() const {
+    for (size_t i = 0; i != numRanges; ++i) {
+      if (ranges[i].lower > ranges[i].upper) return false;
+      if (i != 0 && ranges[i - 1].upper + 1 >= ranges[i].lower) return false;
+    }
+    return true;
+  }
+};
+
+}  // namespace unicode
+}  // namespace stone
+
+#endif
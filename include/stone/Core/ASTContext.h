@@ -2,11 +2,14 @@
 #define STONE_CORE_ASTCTX_H
 
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <iterator>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -32,6 +35,7 @@
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/Compiler.h"
 #include "stone/Core/ASTContextAlloc.h"
+#include "stone/Core/Arena.h"
 #include "stone/Core/Builtin.h"
 #include "stone/Core/Context.h"
 #include "stone/Core/Identifier.h"
@@ -58,12 +62,45 @@ class Stmt;
 class Builtin;
 class ASTContext;
 
+/// The kinds of memory that an ASTContext hands out. Each kind comes from an
+/// arena of its own, so that the statistics can tell what the memory holds.
+enum class ArenaKind : uint8_t {
+  Decl,
+  Expr,
+  Stmt,
+  Type,
+  String,
+  Other,
+};
+constexpr unsigned NumArenaKinds = unsigned(ArenaKind::Other) + 1;
+
+/// Return the name that the statistics use for \p kind.
+llvm::StringRef GetArenaKindName(ArenaKind kind);
+
 class ASTContextStats final : public Stats {
   const ASTContext &ac;
 
+  /// The memory of every arena at one point of the compile.
+  struct MemorySample {
+    std::string phase;
+    double seconds;
+    /// The slab memory of each ArenaKind, then of the identifier table.
+    uint64_t totalMemory[NumArenaKinds + 1];
+  };
+  std::vector<MemorySample> samples;
+  std::chrono::steady_clock::time_point start;
+
  public:
-  ASTContextStats(const ASTContext &ac) : ac(ac) {}
+  ASTContextStats(const ASTContext &ac)
+      : ac(ac), start(std::chrono::steady_clock::now()) {}
+  llvm::StringRef GetName() const override { return "ASTContext"; }
+
+  /// Record the memory of every arena now, labelled \p phase, to show how
+  /// the AST grows over a compile.
+  void Sample(llvm::StringRef phase);
+
   void Print() const override;
+  void GetData(llvm::json::Object &data) const override;
 };
 class ASTContext final {
   friend ASTContextStats;
@@ -80,10 +117,38 @@ class ASTContext final {
   const SearchPathOptions &searchPathOpts;
 
   Builtin builtin;
-  /// The allocator used to create AST objects.
+
+  /// The slabs of the decl, expr and stmt arenas of every thread, so that
+  /// nodes can refer to each other with a NodeRef.
+  mutable SlabTable nodeSlabs;
+
+  /// The arenas that one thread creates AST objects in, one per ArenaKind.
+  struct ThreadArenas {
+    Arena arenas[NumArenaKinds];
+    /// The thread that allocates from the arenas.
+    std::thread::id owner;
+
+    explicit ThreadArenas(SlabTable &nodeSlabs);
+  };
+
+  /// The arenas of every thread that has allocated from this context, so
+  /// that threads parsing or checking in parallel never share an allocator.
   /// AST objects are never destructed; rather, all memory associated with the
-  /// AST objects will be released when the ASTContext itself is destroyed.
-  mutable llvm::BumpPtrAllocator bumpAlloc;
+  /// AST objects will be released when the ASTContext itself is destroyed,
+  /// whichever thread allocated it.
+  mutable std::vector<std::unique_ptr<ThreadArenas>> threadArenas;
+
+  /// Held while using threadArenas.
+  mutable std::mutex threadArenasMutex;
+
+  /// Identifies this ASTContext to the per-thread arena slots. IDs are never
+  /// reused, so the slot of a destroyed context is never mistaken for one of
+  /// a new context at the same address.
+  const uint64_t instanceID;
+
+  /// Return the arenas of the calling thread, creating them on its first
+  /// allocation.
+  ThreadArenas &GetThreadArenas() const;
 
   /// Table for all
   IdentifierTable identifiers;
@@ -101,6 +166,9 @@ class ASTContext final {
  public:
   //
   Identifier &GetIdentifier(llvm::StringRef name);
+  /// Return the identifier for \p name given its IdentifierTable::HashName(),
+  /// such as the hash the lexer stores on identifier tokens.
+  Identifier &GetIdentifier(llvm::StringRef name, unsigned hash);
   //
   Builtin &GetBuiltin() const;
   //
@@ -109,25 +177,47 @@ class ASTContext final {
   LangABI *GetLangABI() const;
   //
   SrcMgr &GetSrcMgr() { return sm; }
-  /// Retrieve the allocator for the given arena.
+  /// Retrieve the allocator of the ArenaKind::Other arena of the thread.
   llvm::BumpPtrAllocator &GetAllocator() const;
 
   ASTContextStats &GetStats() { return stats; }
+  IdentifierTableStats &GetIdentifierTableStats() {
+    return identifiers.GetStats();
+  }
 
  public:
   /// Return the total amount of physical memory allocated for representing
   /// AST nodes and type information.
   size_t GetSizeOfMemUsed() const;
 
-  void *Allocate(size_t size, unsigned align = 8) const {
-    return bumpAlloc.Allocate(size, align);
+  /// Return the memory of the arenas for \p kind, summed over the threads.
+  /// No other thread may allocate from the context meanwhile.
+  ArenaUsage GetArenaUsage(ArenaKind kind) const;
+
+  /// Return the number of threads that have allocated from the context.
+  unsigned GetNumThreadArenas() const;
+
+  /// Return the table of the slabs that decls, exprs and stmts are allocated
+  /// in, which resolves their NodeRefs.
+  const SlabTable &GetNodeSlabs() const { return nodeSlabs; }
+  /// Return the memory of the identifier table, which has arenas of its own.
+  ArenaUsage GetIdentifierArenaUsage() const {
+    return identifiers.GetArenaUsage();
+  }
+
+  void *Allocate(size_t size, unsigned align = 8,
+                 ArenaKind kind = ArenaKind::Other) const {
+    return GetThreadArenas().arenas[unsigned(kind)].Allocate(size, align);
   }
   template <typename T>
-  T *Allocate(size_t num = 1) const {
-    return static_cast<T *>(Allocate(num * sizeof(T), alignof(T)));
+  T *Allocate(size_t num = 1, ArenaKind kind = ArenaKind::Other) const {
+    return static_cast<T *>(Allocate(num * sizeof(T), alignof(T), kind));
   }
   void Deallocate(void *Ptr) const {}
 
+  /// Return a copy of \p str that lives as long as the ASTContext.
+  llvm::StringRef CopyString(llvm::StringRef str) const;
+
  public:
 };
 }  // namespace syntax
@@ -1,9 +1,98 @@
 #ifndef STONE_CORE_ASTFILE_H
 #define STONE_CORE_ASTFILE_H
 
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "stone/Core/SrcLoc.h"
+
 namespace stone {
 namespace syntax {
-class ASTFile final {};
+
+class ASTContext;
+class Decl;
+class DeclContext;
+
+/// A module written to disk as one binary image that a later compile maps
+/// into memory and uses in place. Every reference in the image is an index
+/// or an offset, so the image is position independent, and opening it reads
+/// only the header: a decl is materialized the first time it is looked up,
+/// so importing a module costs page faults in proportion to what is used,
+/// not to the size of the module.
+///
+/// Decl IDs start at 1, and 0 stands for the module itself. String IDs also
+/// start at 1, and 0 stands for no name or no file.
+class ASTFile final {
+ public:
+  using DeclID = uint32_t;
+
+ private:
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+  ASTContext &astCtx;
+
+  /// The tables of the image; see ASTFile.cpp for their records.
+  const char *strings = nullptr;
+  llvm::StringRef stringData;
+  const char *decls = nullptr;
+  const char *buckets = nullptr;
+  uint32_t numStrings = 0;
+  uint32_t numDecls = 0;
+  uint32_t numBuckets = 0;
+  uint32_t moduleName = 0;
+  std::pair<DeclID, unsigned> moduleMembers;
+
+  /// The decls materialized so far, by ID.
+  llvm::DenseMap<DeclID, Decl *> materialized;
+  /// The files that locations have been translated to, by string ID.
+  llvm::DenseMap<uint32_t, SrcID> files;
+
+  ASTFile(std::unique_ptr<llvm::MemoryBuffer> buffer, ASTContext &astCtx)
+      : buffer(std::move(buffer)), astCtx(astCtx) {}
+
+  llvm::StringRef GetString(uint32_t id) const;
+  SrcLoc GetLoc(uint32_t file, uint32_t offset);
+
+ public:
+  ASTFile(const ASTFile &) = delete;
+  void operator=(const ASTFile &) = delete;
+
+  /// Write \p module, named \p moduleName, and every decl in it to \p os.
+  static void Write(const DeclContext &module, llvm::StringRef moduleName,
+                    ASTContext &astCtx, llvm::raw_ostream &os);
+
+  /// Map the ASTFile at \p path and check its header. Decls are
+  /// materialized in \p astCtx.
+  static llvm::ErrorOr<std::unique_ptr<ASTFile>> Load(llvm::StringRef path,
+                                                       ASTContext &astCtx);
+  /// Use \p buffer, which holds an ASTFile, and check its header.
+  static llvm::ErrorOr<std::unique_ptr<ASTFile>> Create(
+      std::unique_ptr<llvm::MemoryBuffer> buffer, ASTContext &astCtx);
+
+  llvm::StringRef GetModuleName() const { return GetString(moduleName); }
+  unsigned GetNumDecls() const { return numDecls; }
+  unsigned GetNumMaterializedDecls() const { return materialized.size(); }
+
+  /// Add the members of \p parent named \p name to \p results, materializing
+  /// them if needed.
+  void Lookup(llvm::StringRef name, llvm::SmallVectorImpl<Decl *> &results,
+              DeclID parent = 0);
+
+  /// Return the decl \p id, materializing it and the contexts it is in if
+  /// needed, or null if the file has no such decl.
+  Decl *GetDecl(DeclID id);
+
+  /// Return the ID of the first member of \p parent and the number of
+  /// members, which have consecutive IDs, without materializing them.
+  std::pair<DeclID, unsigned> GetMemberIDs(DeclID parent = 0) const;
+};
+
 }  // namespace syntax
 }  // namespace stone
 
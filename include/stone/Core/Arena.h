@@ -0,0 +1,191 @@
+#ifndef STONE_CORE_ARENA_H
+#define STONE_CORE_ARENA_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "llvm/Support/Allocator.h"
+
+namespace stone {
+
+/// What an arena has handed out and the memory it holds to do so.
+struct ArenaUsage {
+  /// The bytes requested from the arena.
+  uint64_t bytesAllocated = 0;
+  /// The bytes of the slabs that the arena holds.
+  uint64_t totalMemory = 0;
+  uint64_t numSlabs = 0;
+  /// The most slab memory the arena has held, including before a Reset().
+  uint64_t peakMemory = 0;
+
+  /// Return the slab bytes that hold no allocation: alignment padding, the
+  /// tails of slabs that an allocation did not fit in, and the unused end
+  /// of the current slab.
+  uint64_t GetWastedBytes() const { return totalMemory - bytesAllocated; }
+
+  ArenaUsage &operator+=(const ArenaUsage &other) {
+    bytesAllocated += other.bytesAllocated;
+    totalMemory += other.totalMemory;
+    numSlabs += other.numSlabs;
+    peakMemory += other.peakMemory;
+    return *this;
+  }
+};
+
+/// Slabs that can be named by a 32-bit reference. Every slab is aligned to
+/// SlabSize and starts with a Header that names the table and the index of
+/// the slab in it, so an address in the first SlabSize bytes of a slab maps
+/// to a (slab index, offset) reference and back in constant time, without a
+/// search. Offsets count 8-byte units; the reference 0 falls on the header
+/// of the first slab and is never an allocation, so it stands for null.
+///
+/// Slabs are only ever added, and live until the table is destroyed.
+/// Resolving a reference takes no lock, and may race with slabs being added
+/// on other threads.
+class SlabTable final {
+ public:
+  static constexpr unsigned SlabShift = 20;
+  static constexpr size_t SlabSize = size_t(1) << SlabShift;
+  static constexpr unsigned UnitShift = 3;
+  static constexpr unsigned OffsetBits = SlabShift - UnitShift;
+  static constexpr uint32_t OffsetMask = (1u << OffsetBits) - 1;
+  /// With 1 MiB slabs, 32-bit references address 32 GiB.
+  static constexpr unsigned MaxSlabs = 1u << (32 - OffsetBits);
+
+  struct alignas(16) Header {
+    SlabTable *table;
+    uint32_t index;
+  };
+
+ private:
+  std::unique_ptr<std::atomic<char *>[]> slabs;
+  std::atomic<unsigned> numSlabs{0};
+
+  static const Header &GetHeader(const void *ptr) {
+    return *reinterpret_cast<const Header *>(uintptr_t(ptr) & ~(SlabSize - 1));
+  }
+
+ public:
+  SlabTable();
+  ~SlabTable();
+  SlabTable(const SlabTable &) = delete;
+  void operator=(const SlabTable &) = delete;
+
+  /// Allocate and register a slab of \p size bytes, a multiple of SlabSize,
+  /// and return it. Its first sizeof(Header) bytes are the header. Safe to
+  /// call from several threads.
+  char *AllocateSlab(size_t size);
+
+  unsigned GetNumSlabs() const {
+    return numSlabs.load(std::memory_order_relaxed);
+  }
+
+  /// Return the reference to \p ptr, which must be null or 8-byte aligned
+  /// and in the first SlabSize bytes of a slab of some table.
+  static uint32_t Encode(const void *ptr) {
+    if (!ptr) return 0;
+    assert((uintptr_t(ptr) & ((1u << UnitShift) - 1)) == 0 &&
+           "slab references need 8-byte alignment");
+    const Header &header = GetHeader(ptr);
+    assert(header.table->slabs[header.index].load(std::memory_order_relaxed) ==
+               reinterpret_cast<const char *>(&header) &&
+           "address is not in a slab");
+    uintptr_t offset = uintptr_t(ptr) - uintptr_t(&header);
+    return (header.index << OffsetBits) | uint32_t(offset >> UnitShift);
+  }
+
+  /// Return the address that \p ref refers to in this table.
+  void *Resolve(uint32_t ref) const {
+    if (!ref) return nullptr;
+    char *slab = slabs[ref >> OffsetBits].load(std::memory_order_acquire);
+    assert(slab && "reference to a slab that is not in the table");
+    return slab + (size_t(ref & OffsetMask) << UnitShift);
+  }
+
+  /// Return the address that \p ref refers to in the table of the slab that
+  /// holds \p from, such as the object that stores the reference.
+  static void *Resolve(uint32_t ref, const void *from) {
+    if (!ref) return nullptr;
+    return GetHeader(from).table->Resolve(ref);
+  }
+};
+
+/// A bump allocator that keeps count of what it hands out, so that its
+/// memory can be accounted for in the statistics.
+///
+/// An arena that has a SlabTable takes its slabs from the table, so that
+/// what it allocates can be named by a 32-bit reference. Such an arena
+/// cannot be reset, and GetAllocator() may not be used.
+class Arena final {
+  llvm::BumpPtrAllocator alloc;
+  uint64_t bytesAllocated = 0;
+  uint64_t peakMemory = 0;
+
+  SlabTable *table = nullptr;
+  /// The free space of the current table slab.
+  char *cur = nullptr;
+  char *end = nullptr;
+  uint64_t tableMemory = 0;
+  uint64_t numTableSlabs = 0;
+
+  void *AllocateFromTable(size_t size, size_t align);
+
+ public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  void operator=(const Arena &) = delete;
+
+  /// Take slabs from \p slabs from now on. Must be called before the first
+  /// allocation.
+  void SetSlabTable(SlabTable &slabs) {
+    assert(bytesAllocated == 0 && "arena has already allocated");
+    table = &slabs;
+  }
+  bool HasSlabTable() const { return table; }
+
+  void *Allocate(size_t size, size_t align) {
+    bytesAllocated += size;
+    if (table) return AllocateFromTable(size, align);
+    return alloc.Allocate(size, align);
+  }
+  template <typename T>
+  T *Allocate(size_t num = 1) {
+    return static_cast<T *>(Allocate(num * sizeof(T), alignof(T)));
+  }
+
+  /// Free everything allocated so far at once.
+  void Reset() {
+    assert(!table && "slab table memory is never reset");
+    peakMemory = std::max<uint64_t>(peakMemory, alloc.getTotalMemory());
+    alloc.Reset();
+    bytesAllocated = 0;
+  }
+
+  size_t GetTotalMemory() const {
+    return table ? tableMemory : alloc.getTotalMemory();
+  }
+
+  ArenaUsage GetUsage() const {
+    ArenaUsage usage;
+    usage.bytesAllocated = bytesAllocated;
+    usage.totalMemory = GetTotalMemory();
+    usage.numSlabs = table ? numTableSlabs : alloc.GetNumSlabs();
+    usage.peakMemory = std::max(peakMemory, usage.totalMemory);
+    return usage;
+  }
+
+  /// Return the underlying allocator. Allocations made through it directly
+  /// are not counted in bytesAllocated.
+  llvm::BumpPtrAllocator &GetAllocator() {
+    assert(!table && "arena allocates from a slab table");
+    return alloc;
+  }
+};
+
+}  // namespace stone
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef STONE_CORE_CHARSCAN_H
+#define STONE_CORE_CHARSCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "llvm/Support/Compiler.h"
+#include "llvm/Support/Endian.h"
+#include "stone/Core/LLVM.h"
+
+namespace stone {
+namespace ch {
+
+/// The vector width used by the scanning routines below. The widest level
+/// that the host supports is selected the first time a scan runs.
+enum class SIMDLevel {
+  Scalar,
+  SSE2,
+  AVX2,
+};
+
+/// Return the level that the scanning routines currently use.
+SIMDLevel GetSIMDLevel();
+
+/// Force the scanning routines to \p level, clamped to what the host
+/// supports, and return the level actually selected. Intended for tests and
+/// benchmarks that compare the implementations.
+SIMDLevel SetSIMDLevel(SIMDLevel level);
+
+/// Return the first byte in [ptr, end) that is not horizontal whitespace
+/// (' ', '\\t', '\\f', '\\v'), or \p end.
+const char *SkipHorizontalWhitespace(const char *ptr, const char *end);
+
+/// Return the first byte in [ptr, end) that is not an ASCII identifier body
+/// character ([a-zA-Z0-9_$]), or \p end. Bytes >= 0x80 always stop the scan.
+const char *SkipIdentifierBody(const char *ptr, const char *end);
+
+/// Return the first byte in [ptr, end) that is equal to one of \p c0, \p c1,
+/// \p c2 or \p c3, or \p end. Pass a byte more than once to look for fewer
+/// than four.
+const char *FindFirstOf(const char *ptr, const char *end, char c0, char c1,
+                        char c2, char c3);
+
+/// Return the first '\\n' or '\\r' in [ptr, end), or \p end.
+inline const char *FindNewLine(const char *ptr, const char *end) {
+  return FindFirstOf(ptr, end, '\n', '\r', '\n', '\r');
+}
+
+/// Return the number of line breaks in [ptr, end). '\\n', "\\r\\n" and a
+/// '\\r' that is not followed by '\\n' each count as one; every other byte,
+/// including '\\0', is part of a line.
+size_t CountLineBreaks(const char *ptr, const char *end);
+
+/// Write the offset from \p ptr of the first byte after each line break in
+/// [ptr, end) to \p starts, which must have room for CountLineBreaks(ptr,
+/// end) offsets, and return the end of the offsets written.
+unsigned *FindLineStarts(const char *ptr, const char *end, unsigned *starts);
+
+/// Return true if the eight bytes at \p ptr are all ASCII decimal digits.
+/// The bytes are tested together as one 64-bit word.
+inline bool AreEightDigits(const char *ptr) {
+  uint64_t word = llvm::support::endian::read64le(ptr);
+  // A byte is a digit if its high nibble is 3 and adding 6 to it does not
+  // carry into the high nibble.
+  uint64_t highNibbles = word & 0xF0F0F0F0F0F0F0F0ULL;
+  uint64_t carried = (word + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL;
+  return (highNibbles | (carried >> 4)) == 0x3333333333333333ULL;
+}
+
+/// Return the value of the eight ASCII decimal digits at \p ptr, most
+/// significant first. Pairs, then quads, then the halves are combined with
+/// one multiply each instead of eight multiply-adds.
+inline uint32_t ParseEightDigits(const char *ptr) {
+  uint64_t word = llvm::support::endian::read64le(ptr) - 0x3030303030303030ULL;
+  word = (word * 10) + (word >> 8);
+  word = (((word & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+          (((word >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >>
+         32;
+  return uint32_t(word);
+}
+
+}  // namespace ch
+}  // namespace stone
+
+#endif
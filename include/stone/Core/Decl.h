@@ -24,6 +24,7 @@
 #include "stone/Core/DeclName.h"
 #include "stone/Core/Identifier.h"
 #include "stone/Core/LLVM.h"
+#include "stone/Core/NodeRef.h"
 #include "stone/Core/Object.h"
 #include "stone/Core/SrcLoc.h"
 
@@ -43,11 +44,22 @@ class DeclStats final : public Stats {
   void Print() const override;
 };
 
+/// The links from a decl to other nodes are NodeRefs, so the semantic and
+/// the lexical context together take the space of one pointer.
 class alignas(8) Decl : public ASTNode /*TODO: Object */ {
   friend DeclStats;
   decl::Kind kind;
   SrcLoc loc;
-  DeclContext *dc;
+
+  /// The context that the decl is a member of.
+  NodeRef<DeclContext> dc;
+
+  /// The context that the decl is written in, or null if that is dc, as it
+  /// is for nearly every decl.
+  NodeRef<DeclContext> lexicalDC;
+
+  /// The next decl in the context that this decl was added to.
+  NodeRef<Decl> nextDeclInContext;
 
  public:
   /*
@@ -85,19 +97,32 @@ class alignas(8) Decl : public ASTNode /*TODO: Object */ {
 
   friend class DeclContext;
 
-  struct MultipleDeclContext {
-    DeclContext *semanticDeclContext;
-    DeclContext *lexicalDeclContext;
-  };
+ public:
+  decl::Kind GetKind() const { return kind; }
+  SrcLoc GetLoc() const { return loc; }
 
-  llvm::PointerUnion<DeclContext *, MultipleDeclContext *> declCtx;
+  DeclContext *GetDeclContext() const { return dc.Get(this); }
+  DeclContext *GetLexicalDeclContext() const {
+    return lexicalDC ? lexicalDC.Get(this) : GetDeclContext();
+  }
+  void SetLexicalDeclContext(DeclContext *lexical) {
+    lexicalDC = lexical == GetDeclContext() ? nullptr : lexical;
+  }
 
- public:
-  decl::Kind GetKind() { return kind; }
+  Decl *GetNextDeclInContext() const { return nextDeclInContext.Get(this); }
+
+  /// Return this decl as a DeclContext, or null if its kind is not one.
+  DeclContext *GetAsDeclContext();
+  const DeclContext *GetAsDeclContext() const {
+    return const_cast<Decl *>(this)->GetAsDeclContext();
+  }
+
+  /// Return the name of the decl, which is empty if its kind has none.
+  DeclName GetDeclName() const;
 
  protected:
   Decl(decl::Kind kind, DeclContext *dc, SrcLoc loc)
-      : kind(kind), dc(dc), loc(loc) {}
+      : kind(kind), loc(loc), dc(dc) {}
 };
 
 class DeclContext {
@@ -145,19 +170,27 @@ class DeclContext {
  protected:
   /// FirstDecl - The first declaration stored within this declaration
   /// context.
-  mutable Decl *firstDecl = nullptr;
+  mutable NodeRef<Decl> firstDecl;
 
   /// LastDecl - The last declaration stored within this declaration
-  /// context. FIXME: We could probably cache this value somewhere
-  /// outside of the DeclContext, to reduce the size of DeclContext by
-  /// another pointer.
-  mutable Decl *lastDecl = nullptr;
+  /// context.
+  mutable NodeRef<Decl> lastDecl;
 
   /// Build up a chain of declarations.
   ///
   /// \returns the first/last pair of declarations.
   static std::pair<Decl *, Decl *> BuildDeclChain(llvm::ArrayRef<Decl *> decls,
                                                   bool fieldsAlreadyLoaded);
+
+ public:
+  /// Return the first decl of the context; the others follow it through
+  /// Decl::GetNextDeclInContext().
+  Decl *GetFirstDecl() const { return firstDecl.Get(this); }
+  Decl *GetLastDecl() const { return lastDecl.Get(this); }
+
+  /// Append \p d, which must not be in a context yet, to the decls of the
+  /// context.
+  void AddDecl(Decl *d);
 };
 
 class NamingDecl : public Decl {
@@ -171,6 +204,8 @@ class NamingDecl : public Decl {
       : Decl(kind, dc, loc), name(name) {}
 
  public:
+  DeclName GetDeclName() const { return name; }
+
   /// Get the identifier that names this declaration, if there is one.
   ///
   /// This will return NULL if this declaration has no name (e.g., for
@@ -196,10 +231,17 @@ class ValueDecl : public NamingDecl {
  public:
 };
 
-class SpaceDecl : public NamingDecl {
+class SpaceDecl : public NamingDecl, public DeclContext {
  public:
   SpaceDecl(DeclContext *dc, SrcLoc loc, DeclName name)
       : NamingDecl(decl::Kind::Space, dc, loc, name) {}
+
+  static SpaceDecl *Create(const ASTContext &astCtx, DeclContext *dc,
+                           SrcLoc loc, DeclName name);
+  /// Create a space read from the ASTFile decl \p declID.
+  static SpaceDecl *CreateDeserialized(const ASTContext &astCtx,
+                                       unsigned declID, DeclContext *dc,
+                                       SrcLoc loc, DeclName name);
 };
 
 class DeclaratorDecl : public ValueDecl {
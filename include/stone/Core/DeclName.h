@@ -6,11 +6,14 @@ namespace syntax {
 
 class DeclNameLoc {};
 class DeclName {
+  Identifier *identifier = nullptr;
+
  public:
-  // TODO:
-  bool IsIdentifier() const { return false; }
-  // TODO:
-  Identifier *GetAsIdentifier() const {}
+  DeclName() = default;
+  DeclName(Identifier *identifier) : identifier(identifier) {}
+
+  bool IsIdentifier() const { return identifier; }
+  Identifier *GetAsIdentifier() const { return identifier; }
 };
 }  // namespace syntax
 }  // namespace stone
@@ -34,6 +34,10 @@ class Expr : public ValueStmt {
   Expr &operator=(const Expr &) = delete;
   Expr &operator=(Expr &&) = delete;
 
+  // Exprs have an arena of their own in the ASTContext.
+  void *operator new(std::size_t bytes, const ASTContext &astCtx,
+                     unsigned alignment = 8);
+
  public:
 };
 }  // namespace syntax
@@ -149,6 +149,15 @@ class FileMgr : public RefCountedBase<FileMgr> {
   // Caching.
   std::unique_ptr<FileSystemStatCache> StatCache;
 
+  /// Stats gathered by Prefetch(), keyed by the path that getStatValue() is
+  /// asked for. Only filled while Prefetch() looks the files up.
+  llvm::StringMap<llvm::vfs::Status> PrefetchedStats;
+
+  /// Contents read by Prefetch() that getBufferForFile() has not handed out
+  /// yet.
+  llvm::DenseMap<const SrcFile *, std::unique_ptr<llvm::MemoryBuffer>>
+      PrefetchedBuffers;
+
   bool getStatValue(StringRef Path, llvm::vfs::Status &Status, bool isFile,
                     std::unique_ptr<llvm::vfs::File> *F);
 
@@ -201,6 +210,17 @@ class FileMgr : public RefCountedBase<FileMgr> {
   const SrcFile *getFile(StringRef Filename, bool OpenFile = false,
                          bool CacheFailure = true);
 
+  /// Stat and read the given files, and their directories, on up to
+  /// \p NumThreads threads at once (0 for one per hardware thread), then
+  /// look them up with getFile(). The first getBufferForFile() of each file
+  /// returns the contents read here instead of going to the file system.
+  ///
+  /// Files that were already looked up, or that cannot be read, are left to
+  /// getFile() and getBufferForFile() as usual.
+  ///
+  /// \returns the number of files whose contents were read.
+  unsigned Prefetch(ArrayRef<StringRef> Filenames, unsigned NumThreads = 0);
+
   /// Returns the current file system options
   FileSystemOptions &getFileSystemOpts() { return FileSystemOpts; }
   const FileSystemOptions &getFileSystemOpts() const { return FileSystemOpts; }
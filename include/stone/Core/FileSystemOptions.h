@@ -1,6 +1,7 @@
 #ifndef STONE_CORE_FILESYSTEMOPTIONS_H
 #define STONE_CORE_FILESYSTEMOPTIONS_H
 
+#include <cstdint>
 #include <string>
 
 namespace stone {
@@ -8,6 +9,15 @@ namespace stone {
 class FileSystemOptions final {
  public:
   std::string WorkingDir;
+
+  /// Files at least this large are memory-mapped when they are loaded;
+  /// smaller ones are read. Mapping a file costs a system call and a page
+  /// fault per page, which only pays off once the file spans many pages.
+  uint64_t MapThreshold = 64 * 1024;
+
+  /// If not empty, the file that keeps the stat cache between runs; see
+  /// PersistentStatCache.
+  std::string StatCachePath;
 };
 
 }  // namespace stone
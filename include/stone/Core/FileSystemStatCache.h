@@ -6,11 +6,13 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Allocator.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/VirtualFileSystem.h"
 #include "stone/Core/LLVM.h"
 
@@ -69,6 +71,108 @@ class MemorizeStatCalls : public FileSystemStatCache {
                           llvm::vfs::FileSystem &FS) override;
 };
 
+/// A stat cache that is kept in a file, so that it outlives the process.
+///
+/// For absolute paths it remembers which do not exist and which are
+/// directories, along with the device, inode, mtime and size of each
+/// directory. An entry is trusted as long as the directory that contains it
+/// still has the recorded mtime, device and inode: creating, removing or
+/// renaming anything in a directory changes its mtime. That costs one stat
+/// per directory and process instead of one per path, which is what makes
+/// probing the same search paths on every run cheap. Regular files are not
+/// cached, because writing a file in place leaves its directory's mtime
+/// alone.
+///
+/// The file is a hash table keyed by the xxHash64 of the path and is mapped
+/// and queried in place. Paths that were looked up for the first time are
+/// written back, together with the entries that are still valid, when the
+/// cache is destroyed.
+class PersistentStatCache : public FileSystemStatCache {
+ public:
+  struct DirRecord {
+    int64_t MTime;
+    uint64_t Device;
+    uint64_t Inode;
+    uint64_t Size;
+    uint32_t Perms;
+  };
+
+ private:
+  std::string CachePath;
+  std::unique_ptr<llvm::MemoryBuffer> File;
+
+  /// The tables of File; all empty if it is missing or malformed.
+  const char *Dirs = nullptr;
+  const char *Buckets = nullptr;
+  StringRef Strings;
+  uint32_t NumDirs = 0;
+  uint32_t NumBuckets = 0;
+
+  enum DirState : uint8_t { Unchecked, Unchanged, Changed };
+
+  /// Whether each directory of File has been found unchanged.
+  std::vector<DirState> DirStates;
+
+  /// Directories and entries found by this process, keyed by path. An entry
+  /// is true for a directory and false for a path that does not exist.
+  llvm::StringMap<DirRecord> NewDirs;
+  llvm::StringMap<bool> NewEntries;
+
+  unsigned NumHits = 0;
+  unsigned NumMisses = 0;
+
+  explicit PersistentStatCache(StringRef CachePath) : CachePath(CachePath) {}
+
+  StringRef getString(uint32_t Offset, uint32_t Length) const;
+  StringRef getDirPath(uint32_t Index) const;
+  DirRecord getDir(uint32_t Index) const;
+
+  /// Return true if directory \p Index of File is unchanged, statting it the
+  /// first time.
+  bool isDirUnchanged(uint32_t Index, llvm::vfs::FileSystem &FS);
+
+  /// Look \p Path up in File. Return true and set \p Status if it is a
+  /// directory, or \p Missing if it does not exist.
+  bool lookup(StringRef Path, llvm::vfs::Status &Status, bool &Missing,
+              llvm::vfs::FileSystem &FS);
+
+  /// Record the result of statting \p Path, if the directory that contains
+  /// it can be recorded too.
+  void record(StringRef Path, const llvm::vfs::Status *Status,
+              llvm::vfs::FileSystem &FS);
+
+  /// Record \p Path, a directory with \p Status, unless it was modified too
+  /// recently for its mtime to be trusted. Return true if it was recorded.
+  bool recordDir(StringRef Path, const llvm::vfs::Status &Status);
+
+ public:
+  /// Open the cache kept in \p CachePath. A missing or malformed file gives
+  /// an empty cache that will be written there.
+  static std::unique_ptr<PersistentStatCache> create(StringRef CachePath);
+
+  ~PersistentStatCache() override;
+
+  std::error_code getStat(StringRef Path, llvm::vfs::Status &Status,
+                          bool isFile, std::unique_ptr<llvm::vfs::File> *F,
+                          llvm::vfs::FileSystem &FS) override;
+
+  /// Record \p Path and, if it is a directory, every directory below it.
+  /// This is how a cache is populated before the first compile.
+  void addTree(StringRef Path, llvm::vfs::FileSystem &FS);
+
+  /// Return true if save() has anything to write.
+  bool isDirty() const;
+
+  /// Write the valid entries to the cache file, replacing it atomically so
+  /// that processes reading it never see a partial file.
+  std::error_code save();
+
+  /// Return the number of lookups answered from the file, and the number
+  /// that had to go to the file system.
+  unsigned getNumHits() const { return NumHits; }
+  unsigned getNumMisses() const { return NumMisses; }
+};
+
 }  // namespace stone
 
 #endif  // LLVM_CLANG_BASIC_FILESYSTEMSTATCACHE_H
@@ -1,10 +1,12 @@
 #ifndef LLVM_CLANG_BASIC_IDENTIFIERTABLE_H
 #define LLVM_CLANG_BASIC_IDENTIFIERTABLE_H
 
+#include <atomic>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <mutex>
 #include <string>
 #include <utility>
 
@@ -13,12 +15,21 @@
 #include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Allocator.h"
+#include "llvm/Support/DJB.h"
 #include "llvm/Support/PointerLikeTypeTraits.h"
 #include "llvm/Support/type_traits.h"
+#include "stone/Core/Arena.h"
 #include "stone/Core/LLVM.h"
 #include "stone/Core/Stats.h"
 #include "stone/Core/TokenKind.h"
 
+/// When set, the IdentifierTable counts lookup hits and misses and the
+/// number of slots each lookup probes, for IdentifierTableStats. The counters
+/// are shared by the threads that use a shard, so they are off by default.
+#ifndef STONE_IDENTIFIER_TABLE_STATS
+#define STONE_IDENTIFIER_TABLE_STATS 0
+#endif
+
 namespace stone {
 class LangOptions;
 class SrcLoc;
@@ -35,81 +46,36 @@ using IdentifierLocPair = std::pair<Identifier *, SrcLoc>;
 /// of a pointer to one of these classes.
 enum { IdentifierAlignment = 8 };
 
-/// One of these records is kept for each identifier that
-/// is lexed.  This contains information about whether the token was \#define'd,
-/// is a language keyword, or if it is a front-end token of some sort (e.g. a
-/// variable or function name).  The preprocessor keeps this information in a
-/// set, and all tk::identifier tokens have a pointer to one of these.
+/// One of these records is kept for each identifier that is lexed. It records
+/// whether the identifier is a language keyword.
+///
+/// The record is an eight byte header followed directly by the
+/// null-terminated name, so the name costs no pointer and no second
+/// allocation, and getNameStart() is an address computation. The length is
+/// stored in the header, like the key length of a StringMapEntry.
 /// It is aligned to 8 bytes because DeclName needs the lower 3 bits.
 class alignas(IdentifierAlignment) Identifier {
   friend class IdentifierTable;
 
-  // Front-end token ID or tk::identifier.
-  tk kind;
+  // The length of the name that follows the header.
+  uint32_t nameLength;
 
-  // ObjC keyword ('protocol' in '@protocol') or builtin (__builtin_inf).
-  // First NUM_OBJC_KEYWORDS values are for Objective-C,
-  // the remaining values are for builtins.
-  unsigned BuiltinID : 13;
-
-  // True if the identifier is a language extension.
-  unsigned IsExtension : 1;
+  // Front-end token ID or tk::identifier.
+  unsigned kind : 8;
 
   // True if the identifier is a keyword in a newer or proposed Standard.
   unsigned isKeywordReserved : 1;
 
-  // True if the identifier is poisoned.
-  unsigned IsPoisoned : 1;
-
-  // True if the identifier is a C++ operator keyword.
-  unsigned IsOperatorKeyword : 1;
-
-  // Internal bit set by the member function RecomputeNeedsHandleIdentifier.
-  // See comment about RecomputeNeedsHandleIdentifier for more info.
-  unsigned NeedsHandleIdentifier : 1;
-
-  // True if the identifier was loaded (at least partially) from an AST file.
+  // True if the identifier was loaded from an AST file.
   unsigned IsFromAST : 1;
 
-  // True if the identifier has changed from the definition
-  // loaded from an AST file.
-  unsigned ChangedAfterLoad : 1;
-
-  // True if the identifier's frontend information has changed from the
-  // definition loaded from an AST file.
-  unsigned FEChangedAfterLoad : 1;
-
-  // True if revertTokenIDToIdentifier was called.
-  unsigned RevertedTokenID : 1;
-
-  // True if there may be additional information about
-  // this identifier stored externally.
-  unsigned OutOfDate : 1;
-
-  // True if this is the 'import' contextual keyword.
-  unsigned IsModulesImport : 1;
+  // 22 bits left in the header.
 
-  // 29 bits left in a 64-bit word.
-
-  // Managed by the language front-end.
-  void *FETokenInfo = nullptr;
-
-  llvm::StringMapEntry<Identifier *> *entry = nullptr;
-
-  Identifier()
-      : kind(tk::identifier),
-        BuiltinID(0),
-        IsExtension(false),
+  explicit Identifier(uint32_t nameLength)
+      : nameLength(nameLength),
+        kind(unsigned(tk::identifier)),
         isKeywordReserved(false),
-        IsPoisoned(false),
-        IsOperatorKeyword(false),
-        NeedsHandleIdentifier(false),
-        IsFromAST(false),
-        ChangedAfterLoad(false),
-        FEChangedAfterLoad(false),
-        RevertedTokenID(false),
-        OutOfDate(false),
-        IsModulesImport(false) {}
+        IsFromAST(false) {}
 
  public:
   Identifier(const Identifier &) = delete;
@@ -134,10 +100,12 @@ class alignas(IdentifierAlignment) Identifier {
 
   /// Return the beginning of the actual null-terminated string for this
   /// identifier.
-  const char *getNameStart() const { return entry->getKeyData(); }
+  const char *getNameStart() const {
+    return reinterpret_cast<const char *>(this + 1);
+  }
 
   /// Efficiently return the length of this identifier info.
-  unsigned getLength() const { return entry->getKeyLength(); }
+  unsigned getLength() const { return nameLength; }
 
   /// Return the actual identifier string.
   StringRef GetName() const { return StringRef(getNameStart(), getLength()); }
@@ -145,68 +113,7 @@ class alignas(IdentifierAlignment) Identifier {
   /// If this is a source-language token (e.g. 'for'), this API
   /// can be used to cause the lexer to map identifiers to source-language
   /// tokens.
-  tk getTokenKind() const { return kind; }
-
-  /// True if revertTokenIDToIdentifier() was called.
-  bool hasRevertedTokenIDToIdentifier() const { return RevertedTokenID; }
-
-  /// Revert TokenID to tk::identifier; used for GNU libstdc++ 4.2
-  /// compatibility.
-  ///
-  /// TokenID is normally read-only but there are 2 instances where we revert it
-  /// to tk::identifier for libstdc++ 4.2. Keep track of when this happens
-  /// using this method so we can inform serialization about it.
-  void revertTokenIDToIdentifier() {
-    assert(kind != tk::identifier && "Already at tok::identifier");
-    kind = tk::identifier;
-    RevertedTokenID = true;
-  }
-  void revertIdentifierToTokenID(tk k) {
-    assert(kind == tk::identifier && "Should be at tok::identifier");
-    kind = k;
-    RevertedTokenID = false;
-  }
-
-  /// True if setNotBuiltin() was called.
-  bool hasRevertedBuiltin() const {
-    // TODO: //return ObjCOrBuiltinID == tk::NUM_OBJC_KEYWORDS;
-    return false;
-  }
-
-  /// Revert the identifier to a non-builtin identifier. We do this if
-  /// the name of a known builtin library function is used to declare that
-  /// function, but an unexpected type is specified.
-  void revertBuiltin() { setBuiltinID(0); }
-
-  /// Return a value indicating whether this is a builtin function.
-  ///
-  /// 0 is not-built-in. 1+ are specific builtin functions.
-  unsigned getBuiltinID() const {
-    // TODO:
-    // if (BuiltinID >= tk::NUM_OBJC_KEYWORDS)
-    //  return ObjCOrBuiltinID - tk::NUM_OBJC_KEYWORDS;
-    // else
-    return 0;
-  }
-  void setBuiltinID(unsigned ID) {
-    // TODO:
-    // ObjCOrBuiltinID = ID + tk::NUM_OBJC_KEYWORDS;
-    // assert(ObjCOrBuiltinID - unsigned(tk::NUM_OBJC_KEYWORDS) == ID
-    //       && "ID too large for field!");
-  }
-
-  /// get/setExtension - Initialize information about whether or not this
-  /// language token is an extension.  This controls extension warnings, and is
-  /// only valid if a custom token ID is set.
-  bool isExtensionToken() const { return IsExtension; }
-
-  void setIsExtensionToken(bool Val) {
-    IsExtension = Val;
-    if (Val)
-      NeedsHandleIdentifier = true;
-    else
-      RecomputeNeedsHandleIdentifier();
-  }
+  tk getTokenKind() const { return tk(kind); }
 
   /// is/setIsKeywordReserved - Initialize information about whether or not
   /// this language token is a keyword in a newer or proposed Standard. This
@@ -214,100 +121,17 @@ class alignas(IdentifierAlignment) Identifier {
   /// corresponding Standard. Once a compatibility problem has been diagnosed
   /// with this keyword, the flag will be cleared.
   bool IsKeywordReserved() const { return isKeywordReserved; }
-
-  void SetIsKeywordReserved(bool reserved) {
-    isKeywordReserved = reserved;
-    if (reserved)
-      NeedsHandleIdentifier = true;
-    else
-      RecomputeNeedsHandleIdentifier();
-  }
-
-  /// setIsPoisoned - Mark this identifier as poisoned.  After poisoning, the
-  /// Preprocessor will emit an error every time this token is used.
-  void setIsPoisoned(bool Value = true) {
-    IsPoisoned = Value;
-    if (Value)
-      NeedsHandleIdentifier = true;
-    else
-      RecomputeNeedsHandleIdentifier();
-  }
-
-  /// Return true if this token has been poisoned.
-  bool isPoisoned() const { return IsPoisoned; }
-
-  /// isCPlusPlusOperatorKeyword/setIsCPlusPlusOperatorKeyword controls whether
-  /// this identifier is a C++ alternate representation of an operator.
-  void setIsOperatorKeyword(bool Val = true) { IsOperatorKeyword = Val; }
-  bool isOperatorKeyword() const { return IsOperatorKeyword; }
+  void SetIsKeywordReserved(bool reserved) { isKeywordReserved = reserved; }
 
   /// Return true if this token is a keyword in the specified language.
   bool IsKeyword(const LangOptions &LangOpts) const;
 
-  /// Get and set FETokenInfo. The language front-end is allowed to associate
-  /// arbitrary metadata with this token.
-  void *getFETokenInfo() const { return FETokenInfo; }
-  void setFETokenInfo(void *T) { FETokenInfo = T; }
-
-  /// Return true if the Preprocessor::HandleIdentifier must be called
-  /// on a token of this identifier.
-  ///
-  /// If this returns false, we know that HandleIdentifier will not affect
-  /// the token.
-  bool isHandleIdentifierCase() const { return NeedsHandleIdentifier; }
-
   /// Return true if the identifier in its current state was loaded
   /// from an AST file.
   bool isFromAST() const { return IsFromAST; }
 
   void setIsFromAST() { IsFromAST = true; }
 
-  /// Determine whether this identifier has changed since it was loaded
-  /// from an AST file.
-  bool hasChangedSinceDeserialization() const { return ChangedAfterLoad; }
-
-  /// Note that this identifier has changed since it was loaded from
-  /// an AST file.
-  void setChangedSinceDeserialization() { ChangedAfterLoad = true; }
-
-  /// Determine whether the frontend token information for this
-  /// identifier has changed since it was loaded from an AST file.
-  bool hasFETokenInfoChangedSinceDeserialization() const {
-    return FEChangedAfterLoad;
-  }
-
-  /// Note that the frontend token information for this identifier has
-  /// changed since it was loaded from an AST file.
-  void setFETokenInfoChangedSinceDeserialization() {
-    FEChangedAfterLoad = true;
-  }
-
-  /// Determine whether the information for this identifier is out of
-  /// date with respect to the external source.
-  bool isOutOfDate() const { return OutOfDate; }
-
-  /// Set whether the information for this identifier is out of
-  /// date with respect to the external source.
-  void setOutOfDate(bool OOD) {
-    OutOfDate = OOD;
-    if (OOD)
-      NeedsHandleIdentifier = true;
-    else
-      RecomputeNeedsHandleIdentifier();
-  }
-
-  /// Determine whether this is the contextual keyword \c import.
-  bool isModulesImport() const { return IsModulesImport; }
-
-  /// Set whether this identifier is the contextual keyword \c import.
-  void setModulesImport(bool I) {
-    IsModulesImport = I;
-    if (I)
-      NeedsHandleIdentifier = true;
-    else
-      RecomputeNeedsHandleIdentifier();
-  }
-
   /// Return true if this identifier is an editor placeholder.
   ///
   /// Editor placeholders are produced by the code-completion engine and are
@@ -325,39 +149,11 @@ class alignas(IdentifierAlignment) Identifier {
   bool operator<(const Identifier &RHS) const {
     return GetName() < RHS.GetName();
   }
-
- private:
-  /// The Preprocessor::HandleIdentifier does several special (but rare)
-  /// things to identifiers of various sorts.  For example, it changes the
-  /// \c for keyword token from tk::identifier to tok::for.
-  ///
-  /// This method is very tied to the definition of HandleIdentifier.  Any
-  /// change to it should be reflected here.
-  void RecomputeNeedsHandleIdentifier() {
-    NeedsHandleIdentifier = isPoisoned() || isExtensionToken() ||
-                            IsKeywordReserved() || isOutOfDate() ||
-                            isModulesImport();
-  }
-};
-
-/// An RAII object for [un]poisoning an identifier within a scope.
-///
-/// \p II is allowed to be null, in which case objects of this type have
-/// no effect.
-class PoisonIdentifierRAIIObject {
-  Identifier *const II;
-  const bool OldValue;
-
- public:
-  PoisonIdentifierRAIIObject(Identifier *II, bool NewValue)
-      : II(II), OldValue(II ? II->isPoisoned() : false) {
-    if (II) II->setIsPoisoned(NewValue);
-  }
-
-  ~PoisonIdentifierRAIIObject() {
-    if (II) II->setIsPoisoned(OldValue);
-  }
 };
+static_assert(sizeof(Identifier) == IdentifierAlignment,
+              "the identifier header no longer fits in eight bytes");
+static_assert(unsigned(tk::MAX) <= UINT8_MAX,
+              "token kinds no longer fit in Identifier::kind");
 
 /// An iterator that walks over all of the known identifiers
 /// in the lookup table.
@@ -393,7 +189,9 @@ class IdentifierTableStats final : public Stats {
 
  public:
   IdentifierTableStats(const IdentifierTable &table) : table(table) {}
+  llvm::StringRef GetName() const override { return "IdentifierTable"; }
   void Print() const override;
+  void GetData(llvm::json::Object &data) const override;
 };
 
 /// Implements an efficient mapping from strings to Identifier nodes.
@@ -401,42 +199,158 @@ class IdentifierTableStats final : public Stats {
 /// This has no other purpose, but this is an extremely performance-critical
 /// piece of the code, as each occurrence of every identifier goes through
 /// here when lexed.
+///
+/// The table may be used from several threads at once. Names are split over
+/// NumShards shards by the top bits of their mixed hash. Each shard is an
+/// open-addressed hash table with its own lock and its own arena, which holds
+/// the identifiers, their names and the bucket arrays. Looking up a name that
+/// is already in the table takes no locks: slots are only ever filled, never
+/// changed, and a grown bucket array is published only once it is complete.
+/// Only inserting a new name takes the lock of its shard. Each name has
+/// exactly one Identifier, whose address never changes, so pointer equality
+/// is name equality.
 class IdentifierTable final {
   const LangOptions &langOpts;
   friend IdentifierTableStats;
+  IdentifierTableStats stats;
+
+ public:
+  static constexpr unsigned ShardBits = 4;
+  static constexpr unsigned NumShards = 1u << ShardBits;
+
+  /// Probe lengths from 1 up to this are counted separately in the
+  /// statistics; longer probes share the last count.
+  static constexpr unsigned MaxProbeLength = 16;
+
+  /// Return the shard of a name whose HashName() is \p hash. The top bits of
+  /// a djb hash hardly depend on a short name, so the hash is mixed first;
+  /// the buckets of a shard use its low bits as they are.
+  static unsigned GetShardIndex(unsigned hash) {
+    return (hash * 0x9E3779B1u) >> (32 - ShardBits);
+  }
+
+ private:
+  struct Slot {
+    std::atomic<Identifier *> identifier{nullptr};
+    // Written before the identifier is published and read only after it
+    // has been seen, so it needs no synchronization of its own.
+    unsigned hash = 0;
+  };
+
+  /// A power-of-two sized array of slots, allocated with the slots directly
+  /// after it. A replaced array is not freed until the table is, so readers
+  /// that are still probing it stay safe; the arrays of a shard add up to
+  /// less than twice the final one.
+  struct alignas(Slot) Buckets {
+    unsigned mask;
+
+    Slot *GetSlots() { return reinterpret_cast<Slot *>(this + 1); }
+    const Slot *GetSlots() const {
+      return reinterpret_cast<const Slot *>(this + 1);
+    }
+    unsigned GetNumBuckets() const { return mask + 1; }
+  };
+
+#if STONE_IDENTIFIER_TABLE_STATS
+  struct Counters {
+    std::atomic<uint64_t> numHits{0};
+    std::atomic<uint64_t> numMisses{0};
+    /// probeLengths[n - 1] counts the lookups that probed n slots.
+    std::atomic<uint64_t> probeLengths[MaxProbeLength] = {};
+
+    void Count(unsigned numProbes, bool found) {
+      (found ? numHits : numMisses).fetch_add(1, std::memory_order_relaxed);
+      unsigned n = numProbes < MaxProbeLength ? numProbes : MaxProbeLength;
+      probeLengths[n - 1].fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+#endif
 
-  using Entries = llvm::StringMap<Identifier *, llvm::BumpPtrAllocator>;
-  Entries entries;
+  struct Shard {
+    std::atomic<Buckets *> buckets{nullptr};
+    std::atomic<unsigned> numItems{0};
+    /// Held while inserting into this shard.
+    std::mutex mutex;
+    Arena alloc;
+#if STONE_IDENTIFIER_TABLE_STATS
+    Counters counters;
+#endif
+  };
+
+  Shard shards[NumShards];
+
+  /// Return the identifier for \p name if it is in the table, without taking
+  /// any locks. \p numProbes is set to the number of slots examined.
+  Identifier *Find(llvm::StringRef name, unsigned hash,
+                   unsigned &numProbes) const {
+    const Buckets *buckets =
+        shards[GetShardIndex(hash)].buckets.load(std::memory_order_acquire);
+    const Slot *slots = buckets->GetSlots();
+    numProbes = 1;
+    for (unsigned i = hash & buckets->mask;;
+         i = (i + 1) & buckets->mask, ++numProbes) {
+      Identifier *identifier =
+          slots[i].identifier.load(std::memory_order_acquire);
+      if (!identifier) return nullptr;
+      if (slots[i].hash == hash && identifier->GetName() == name)
+        return identifier;
+    }
+  }
+
+  /// Return the identifier for \p name, creating it under the shard lock if
+  /// no other thread has done so.
+  Identifier &Insert(llvm::StringRef name, unsigned hash);
+
+  /// Allocate an array of \p numBuckets empty slots from \p alloc.
+  static Buckets *AllocateBuckets(Arena &alloc,
+                                  unsigned numBuckets);
+
+  /// Replace the bucket array of \p shard with one twice as large. The shard
+  /// lock must be held.
+  static Buckets *Grow(Shard &shard);
 
  public:
   /// Create the identifier table, populating it with info about the
   /// language keywords for the language specified by \p LangOpts.
   explicit IdentifierTable(const LangOptions &langOpts);
 
-  llvm::BumpPtrAllocator &GetAllocator() { return entries.getAllocator(); }
+  IdentifierTable(const IdentifierTable &) = delete;
+  void operator=(const IdentifierTable &) = delete;
+
+  IdentifierTableStats &GetStats() { return stats; }
+
+  /// Return the hash that the table uses for \p name. The hash can be built
+  /// up piece by piece: HashName(b, HashName(a)) is the hash of a + b.
+  static unsigned HashName(llvm::StringRef name, unsigned hash = 5381) {
+    return llvm::djbHash(name, hash);
+  }
+  /// Add one character to \p hash; HashName(name + c) is
+  /// HashNameChar(HashName(name), c).
+  static unsigned HashNameChar(unsigned hash, char c) {
+    return (hash << 5) + hash + (unsigned char)c;
+  }
 
   /// Return the identifier token info for the specified named
   /// identifier.
-  Identifier &Get(llvm::StringRef name) {
-    auto &entry = *entries.insert(std::make_pair(name, nullptr)).first;
-    Identifier *&identifier = entry.second;
-    if (identifier) {
-      return *identifier;
-    }
-    // Lookups failed, make a new Identifier.
-    void *mem = GetAllocator().Allocate<Identifier>();
-    identifier = new (mem) Identifier();
-
-    // Make sure GetName() knows how to find the Identifier
-    // contents.
-    identifier->entry = &entry;
-    return *identifier;
+  Identifier &Get(llvm::StringRef name) { return Get(name, HashName(name)); }
+
+  /// Return the identifier for \p name, whose HashName() the caller has
+  /// already computed, e.g. the lexer while it scanned the name.
+  Identifier &Get(llvm::StringRef name, unsigned hash) {
+    assert(hash == HashName(name) && "hash is not the hash of the name");
+    unsigned numProbes;
+    Identifier *identifier = Find(name, hash, numProbes);
+#if STONE_IDENTIFIER_TABLE_STATS
+    shards[GetShardIndex(hash)].counters.Count(numProbes, identifier);
+#endif
+    if (identifier) return *identifier;
+    return Insert(name, hash);
   }
 
   Identifier &Get(llvm::StringRef name, tk k) {
     auto &identifier = Get(name);
-    identifier.kind = k;
-    assert(identifier.kind == k && "TokenCode too large");
+    identifier.kind = unsigned(k);
+    assert(identifier.getTokenKind() == k && "TokenCode too large");
     return identifier;
   }
 
@@ -446,28 +360,43 @@ class IdentifierTable final {
   /// This is a version of Get() meant for external sources that want to
   /// introduce or modify an identifier. If they called Get(), they would
   /// likely end up in a recursion.
-  Identifier &GetOwn(llvm::StringRef name) {
-    auto &entry = *entries.insert(std::make_pair(name, nullptr)).first;
-    Identifier *&identifier = entry.second;
-    if (identifier) {
-      return *identifier;
+  Identifier &GetOwn(llvm::StringRef name) { return Get(name); }
+
+  /// Walks every identifier in the table, shard by shard. No identifiers may
+  /// be inserted while a walk is in progress.
+  class iterator {
+    const IdentifierTable *table;
+    unsigned shard;
+    unsigned slot;
+
+    void SkipEmpty();
+
+   public:
+    iterator(const IdentifierTable *table, unsigned shard)
+        : table(table), shard(shard), slot(0) {
+      SkipEmpty();
     }
-    // Lookups failed, make a new Identifier.
-    void *mem = GetAllocator().Allocate<Identifier>();
-    identifier = new (mem) Identifier();
-
-    // Make sure GetName() knows how to find the Identifier
-    // contents.
-    identifier->entry = &entry;
-    return *identifier;
-  }
 
-  using iterator = Entries::const_iterator;
-  using const_iterator = Entries::const_iterator;
+    Identifier &operator*() const;
+    iterator &operator++() {
+      ++slot;
+      SkipEmpty();
+      return *this;
+    }
+    bool operator==(const iterator &other) const {
+      return shard == other.shard && slot == other.slot;
+    }
+    bool operator!=(const iterator &other) const { return !(*this == other); }
+  };
+  using const_iterator = iterator;
+
+  iterator begin() const { return iterator(this, 0); }
+  iterator end() const { return iterator(this, NumShards); }
+  unsigned size() const;
 
-  iterator begin() const { return entries.begin(); }
-  iterator end() const { return entries.end(); }
-  unsigned size() const { return entries.size(); }
+  /// Return the memory of the arenas that hold the identifiers, their names
+  /// and the bucket arrays, summed over the shards.
+  ArenaUsage GetArenaUsage() const;
 
   /// Populate the identifier table with info about the language keywords
   /// for the language specified by \p LangOpts.
@@ -0,0 +1,64 @@
+#ifndef STONE_CORE_NODEREF_H
+#define STONE_CORE_NODEREF_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "stone/Core/Arena.h"
+
+namespace stone {
+namespace syntax {
+
+/// A reference to an AST node of type T in 32 bits, half the size of a
+/// pointer, for the links between nodes. The value is the slab and offset of
+/// the node in the SlabTable of its ASTContext, which holds the decls, stmts
+/// and exprs.
+///
+/// Resolving a reference needs the table, which is found from any address in
+/// the same context: normally the node that stores the reference.
+template <typename T>
+class NodeRef final {
+  uint32_t value = 0;
+
+ public:
+  NodeRef() = default;
+  NodeRef(std::nullptr_t) {}
+  /// \p node must be null or allocated from a node arena of an ASTContext.
+  explicit NodeRef(T *node) : value(SlabTable::Encode(node)) {}
+
+  NodeRef &operator=(T *node) {
+    value = SlabTable::Encode(node);
+    return *this;
+  }
+
+  /// Return the node, given \p from in the same ASTContext.
+  T *Get(const void *from) const {
+    return static_cast<T *>(SlabTable::Resolve(value, from));
+  }
+  /// Return the node, given the SlabTable of its ASTContext.
+  T *Get(const SlabTable &table) const {
+    return static_cast<T *>(table.Resolve(value));
+  }
+
+  bool IsNull() const { return value == 0; }
+  explicit operator bool() const { return value != 0; }
+
+  uint32_t GetOpaqueValue() const { return value; }
+  static NodeRef GetFromOpaqueValue(uint32_t value) {
+    NodeRef ref;
+    ref.value = value;
+    return ref;
+  }
+
+  friend bool operator==(NodeRef lhs, NodeRef rhs) {
+    return lhs.value == rhs.value;
+  }
+  friend bool operator!=(NodeRef lhs, NodeRef rhs) {
+    return lhs.value != rhs.value;
+  }
+};
+
+}  // namespace syntax
+}  // namespace stone
+
+#endif
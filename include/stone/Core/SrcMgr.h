@@ -34,10 +34,13 @@
 #ifndef STONE_CORE_SOURCEMANAGER_H
 #define STONE_CORE_SOURCEMANAGER_H
 
+#include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
@@ -52,6 +55,7 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Allocator.h"
 #include "llvm/Support/Compiler.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "stone/Core/Diagnostics.h"
 #include "stone/Core/FileMgr.h"
@@ -91,6 +95,87 @@ inline bool isModuleMap(CharacteristicKind CK) {
   return CK == C_User_ModuleMap || CK == C_System_ModuleMap;
 }
 
+/// How a source buffer is about to be read; see SrcMgr::adviseBufferAccess().
+enum class BufferAccess {
+  /// Front to back, as by the lexer.
+  Sequential,
+
+  /// Here and there, as by the parser and diagnostics.
+  Random,
+
+  /// Unlikely to be read again soon, so its pages may be dropped. Mapped
+  /// buffers are reread from the file if they are read after all.
+  NotNeeded
+};
+
+/// The offsets at which the lines of a buffer start.
+///
+/// Buffers smaller than CompressionThreshold keep one 32-bit offset per line.
+/// Larger buffers keep the offset of every BlockSize-th line and, for the
+/// lines in between, the distance from the previous line as an 8 or 16-bit
+/// delta, whichever fits every line. A buffer with a line too long for 16
+/// bits is not compressed. Finding a line in a compressed table is a binary
+/// search over the block offsets and a scan of at most BlockSize - 1 deltas.
+class LineOffsetTable {
+ public:
+  static constexpr unsigned BlockShift = 6;
+  static constexpr unsigned BlockSize = 1u << BlockShift;
+  static constexpr unsigned CompressionThreshold = 1u << 20;
+
+  enum class Encoding : uint8_t { Offsets32, Deltas8, Deltas16 };
+
+ private:
+  /// The start of every line, or of the first line of every block.
+  unsigned *Starts = nullptr;
+
+  /// The distance of every line from the line before it, indexed by line.
+  /// The entries of the first line of each block are not used.
+  void *Deltas = nullptr;
+
+  unsigned NumLines = 0;
+  Encoding Enc = Encoding::Offsets32;
+
+  /// Set with a release store once the table has been filled in, so that a
+  /// thread that sees isComputed() also sees the table.
+  std::atomic<bool> Computed{false};
+
+ public:
+  /// Use \p Offsets, the start of each of \p NumLines lines, which must
+  /// live as long as the table.
+  void assign(unsigned *Offsets, unsigned NumLines);
+
+  /// Store a compressed copy of \p Offsets, or a plain copy if some line is
+  /// too long to compress, allocated from \p Alloc.
+  void assignCompressed(llvm::ArrayRef<unsigned> Offsets,
+                        llvm::BumpPtrAllocator &Alloc);
+
+  /// Use the lines of \p Other, which must be computed, without copying
+  /// them. Both tables must belong to the same SrcMgr.
+  void share(const LineOffsetTable &Other);
+
+  bool isComputed() const { return Computed.load(std::memory_order_acquire); }
+  unsigned size() const { return NumLines; }
+  Encoding getEncoding() const { return Enc; }
+
+  /// Return the offsets of all lines if the table is not compressed, or
+  /// null.
+  const unsigned *getOffsets() const {
+    return Enc == Encoding::Offsets32 ? Starts : nullptr;
+  }
+
+  /// Return the offset of the start of line \p Index, counting from 0.
+  unsigned getLineStart(unsigned Index) const;
+
+  /// Return the number of lines that start at or before \p FilePos, which
+  /// is the 1-based number of the line that contains it.
+  unsigned findLine(unsigned FilePos) const;
+
+  /// Return the bytes the table occupies, and the bytes it would occupy
+  /// without compression.
+  size_t getMemorySize() const;
+  size_t getUncompressedSize() const { return NumLines * sizeof(unsigned); }
+};
+
 /// One instance of this struct is kept for every file loaded or used.
 ///
 /// This object owns the MemoryBuffer object.
@@ -110,6 +195,17 @@ class alignas(8) ContentCache {
   /// whether the buffer is invalid.
   mutable llvm::PointerIntPair<const llvm::MemoryBuffer *, 2> Buffer;
 
+  /// Set with a release store once Buffer has been loaded or replaced, so
+  /// that getBuffer() only takes a lock the first time.
+  mutable std::atomic<bool> BufferLoaded{false};
+
+  /// Read the file into Buffer; see getBuffer().
+  void loadBuffer(DiagnosticEngine &de, const SrcMgr &SM, SrcLoc Loc) const;
+
+  /// If a file loaded earlier has the same contents as Buffer, use its
+  /// buffer instead; see SharedContents.
+  void shareIdenticalContents(const SrcMgr &SM) const;
+
  public:
   /// Reference to the file entry representing this ContentCache.
   ///
@@ -125,16 +221,16 @@ class alignas(8) ContentCache {
   /// with the contents of another file.
   const SrcFile *ContentsEntry;
 
-  /// A bump pointer allocated array of offsets for each source line.
-  ///
-  /// This is lazily computed.  This is owned by the SrcMgr
-  /// BumpPointerAllocator object.
-  unsigned *SourceLineCache = nullptr;
+  /// The cache whose buffer, line table and tokens this one uses because
+  /// their files have byte-identical contents, e.g. two copies of the same
+  /// generated file; null if the contents are not shared.
+  mutable const ContentCache *SharedContents = nullptr;
 
-  /// The number of lines in this ContentCache.
+  /// The offsets of each source line.
   ///
-  /// This is only valid if SourceLineCache is non-null.
-  unsigned NumLines = 0;
+  /// This is lazily computed.  The offsets are owned by the SrcMgr
+  /// BumpPointerAllocator object.
+  LineOffsetTable SourceLineCache;
 
   /// Indicates whether the buffer itself was provided to override
   /// the actual file contents.
@@ -174,10 +270,8 @@ class alignas(8) ContentCache {
     ContentsEntry = RHS.ContentsEntry;
 
     assert(RHS.Buffer.getPointer() == nullptr &&
-           RHS.SourceLineCache == nullptr &&
+           !RHS.SourceLineCache.isComputed() &&
            "Passed ContentCache object cannot own a buffer.");
-
-    NumLines = RHS.NumLines;
   }
 
   ContentCache &operator=(const ContentCache &RHS) = delete;
@@ -223,6 +317,13 @@ class alignas(8) ContentCache {
   /// with the given buffer.
   void replaceBuffer(const llvm::MemoryBuffer *B, bool DoNotFree = false);
 
+  /// Keep the buffer but leave freeing it to someone else.
+  void disownBuffer() { Buffer.setInt(Buffer.getInt() | DoNotFreeFlag); }
+
+  /// Tell the OS how the buffer is about to be read, if it is mapped from a
+  /// file. Does nothing for buffers that have not been loaded yet.
+  void adviseAccess(BufferAccess Access) const;
+
   /// Determine whether the buffer itself is invalid.
   bool isBufferInvalid() const { return Buffer.getInt() & InvalidFlag; }
 
@@ -461,6 +562,54 @@ class SLocEntry {
   }
 };
 
+/// The table of local SLocEntries.
+///
+/// Entries are stored in segments that double in size and are never moved,
+/// and the number of entries is published with a release store after the
+/// entry has been written. A thread that reads size() may therefore read
+/// every entry below it while another thread appends; appends themselves
+/// must not race with each other.
+class SLocEntryTable {
+  static constexpr unsigned FirstSegmentShift = 8;
+  static constexpr unsigned NumSegments = 24;
+
+  /// Segment I holds the (1 << FirstSegmentShift) << I entries that follow
+  /// the entries of the segments before it.
+  SLocEntry *Segments[NumSegments] = {};
+  std::atomic<unsigned> Size{0};
+
+  static unsigned getSegment(unsigned Index) {
+    return llvm::Log2_32((Index >> FirstSegmentShift) + 1);
+  }
+  static unsigned getSegmentBegin(unsigned Segment) {
+    return ((1u << Segment) - 1) << FirstSegmentShift;
+  }
+
+ public:
+  SLocEntryTable() = default;
+  SLocEntryTable(const SLocEntryTable &) = delete;
+  SLocEntryTable &operator=(const SLocEntryTable &) = delete;
+  ~SLocEntryTable();
+
+  unsigned size() const { return Size.load(std::memory_order_acquire); }
+  bool empty() const { return size() == 0; }
+
+  const SLocEntry &operator[](unsigned Index) const {
+    unsigned Segment = getSegment(Index);
+    return Segments[Segment][Index - getSegmentBegin(Segment)];
+  }
+
+  /// Append \p Entry and publish it to readers.
+  void push_back(const SLocEntry &Entry);
+
+  /// Forget every entry. Unlike push_back(), this must not run concurrently
+  /// with readers.
+  void clear() { Size.store(0, std::memory_order_relaxed); }
+
+  /// Return the bytes allocated for the segments.
+  size_t getMemorySize() const;
+};
+
 }  // namespace src
 
 /// External source of source location entries.
@@ -626,11 +775,23 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
   /// as they do not refer to a file.
   std::vector<src::ContentCache *> MemBufferInfos;
 
+  /// The first ContentCache loaded with each content hash, so that files
+  /// with the same contents share one buffer; see
+  /// ContentCache::SharedContents.
+  mutable llvm::DenseMap<uint64_t, const src::ContentCache *> ContentsByHash;
+
+  /// Buffers that a ContentCache gave up while others still shared them.
+  std::vector<std::unique_ptr<const llvm::MemoryBuffer>> OrphanedBuffers;
+
+  /// Stop sharing the buffer of \p CC with files loaded from now on, before
+  /// it is replaced.
+  void unshareContents(src::ContentCache *CC);
+
   /// The table of SLocEntries that are local to this module.
   ///
   /// Positive SrcIDs are indexes into this table. Entry 0 indicates an invalid
   /// expansion.
-  SmallVector<src::SLocEntry, 0> LocalSrcLocTable;
+  src::SLocEntryTable LocalSrcLocTable;
 
   /// The table of SLocEntries that are loaded from other modules.
   ///
@@ -640,8 +801,9 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
 
   /// The starting offset of the next local SLocEntry.
   ///
-  /// This is LocalSrcLocTable.back().Offset + the size of that entry.
-  unsigned NextLocalOffset;
+  /// This is LocalSrcLocTable.back().Offset + the size of that entry. It is
+  /// atomic because isOffsetInSrcID() reads it while SrcIDs may be created.
+  std::atomic<unsigned> NextLocalOffset{0};
 
   /// The starting offset of the latest batch of loaded SLocEntries.
   ///
@@ -662,40 +824,25 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
   /// An external source for source location entries.
   ExternalSLocEntrySource *ExternalSLocEntries = nullptr;
 
-  /// A one-entry cache to speed up getSrcID.
-  ///
-  /// LastSrcIDLookup records the last SrcID looked up or created, because it
-  /// is very common to look up many tokens from the same file.
-  mutable SrcID LastSrcIDLookup;
-
   /// Holds information for \#line directives.
   ///
   /// This is referenced by indices from SrcLocTable.
   std::unique_ptr<SrcLineTable> LineTable;
 
-  /// These ivars serve as a cache used in the GetLineNumber
-  /// method which is used to speedup GetLineNumber calls to nearby locations.
-  mutable SrcID LastLineNoSrcIDQuery;
-  mutable src::ContentCache *LastLineNoContentCache;
-  mutable unsigned LastLineNoFilePos;
-  mutable unsigned LastLineNoResult;
-
   /// The file ID for the main source file of the translation unit.
   SrcID MainSrcID;
 
   /// The file ID for the precompiled preamble there is one.
   SrcID PreambleSrcID;
 
-  // Statistics for -print-stats.
-  mutable unsigned NumLinearScans = 0;
-  mutable unsigned NumBinaryProbes = 0;
+  /// Serializes getBufferData(), which may read a file's contents on first
+  /// use and is called from every lexer thread. Not used in concurrent mode,
+  /// where ContentCache::getBuffer() is safe to call from any thread.
+  mutable std::mutex BufferDataMutex;
 
-  /// Associates a SrcID with its "included/expanded in" decomposed
-  /// location.
-  ///
-  /// Used to cache results from and speed-up \c getDecomposedIncludedLoc
-  /// function.
-  mutable llvm::DenseMap<SrcID, std::pair<SrcID, unsigned>> IncludedLocMap;
+  /// In concurrent mode, serializes loading buffers, computing line tables
+  /// and allocating from ContentCacheAlloc.
+  mutable std::mutex ContentMutex;
 
   /// The key value into the IsBeforeInTUCache table.
   using IsBeforeInTUCacheKey = std::pair<SrcID, SrcID>;
@@ -705,9 +852,69 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
   using InBeforeInTUCache =
       llvm::DenseMap<IsBeforeInTUCacheKey, InBeforeInTUCacheEntry>;
 
-  /// Cache results for the isBeforeInTranslationUnit method.
-  mutable InBeforeInTUCache IBTUCache;
-  mutable InBeforeInTUCacheEntry IBTUCacheOverflow;
+  /// Lazily computed map of macro argument chunks to their expanded
+  /// source location.
+  using MacroArgsMap = std::map<unsigned, SrcLoc>;
+
+  /// The caches that speed up location queries.
+  ///
+  /// A SrcMgr has one of these, or in concurrent mode one per thread that
+  /// queries it, so that threads resolving locations never write to the
+  /// same cache; see getLookupCache().
+  struct LookupCache {
+    /// A one-entry cache to speed up getSrcID.
+    ///
+    /// LastSrcIDLookup records the last SrcID looked up or created, because
+    /// it is very common to look up many tokens from the same file.
+    SrcID LastSrcIDLookup;
+
+    /// These serve as a cache used in the GetLineNumber method which is used
+    /// to speedup GetLineNumber calls to nearby locations.
+    SrcID LastLineNoSrcIDQuery;
+    src::ContentCache *LastLineNoContentCache = nullptr;
+    unsigned LastLineNoFilePos = 0;
+    unsigned LastLineNoResult = 0;
+
+    // Statistics for -print-stats.
+    unsigned NumLinearScans = 0;
+    unsigned NumBinaryProbes = 0;
+
+    /// Associates a SrcID with its "included/expanded in" decomposed
+    /// location.
+    ///
+    /// Used to cache results from and speed-up \c getDecomposedIncludedLoc
+    /// function.
+    llvm::DenseMap<SrcID, std::pair<SrcID, unsigned>> IncludedLocMap;
+
+    /// Cache results for the isBeforeInTranslationUnit method.
+    InBeforeInTUCache IBTUCache;
+    InBeforeInTUCacheEntry IBTUCacheOverflow;
+
+    llvm::DenseMap<SrcID, std::unique_ptr<MacroArgsMap>> MacroArgsCacheMap;
+  };
+
+  /// The lookup caches when the SrcMgr is not concurrent.
+  mutable LookupCache Lookups;
+
+  /// Whether lookup caches are kept per thread; see setConcurrent().
+  bool Concurrent = false;
+
+  /// Identifies this SrcMgr in the per-thread lookup caches. IDs are never
+  /// reused, so the cache of a destroyed SrcMgr is never mistaken for one of
+  /// a new SrcMgr at the same address.
+  const uint64_t InstanceID;
+
+  /// Bumped by clearIDTables() to invalidate the per-thread lookup caches.
+  std::atomic<unsigned> LookupGeneration{0};
+
+  /// Return the lookup caches that the calling thread should use.
+  LookupCache &getLookupCache() const {
+    return Concurrent ? getThreadLookupCache() : Lookups;
+  }
+  LookupCache &getThreadLookupCache() const;
+
+  /// Allocate memory for a ContentCache.
+  src::ContentCache *allocateContentCache();
 
   /// Return the cache entry for comparing the given file IDs
   /// for isBeforeInTranslationUnit.
@@ -718,13 +925,6 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
 
   mutable std::unique_ptr<src::ContentCache> FakeContentCacheForRecovery;
 
-  /// Lazily computed map of macro argument chunks to their expanded
-  /// source location.
-  using MacroArgsMap = std::map<unsigned, SrcLoc>;
-
-  mutable llvm::DenseMap<SrcID, std::unique_ptr<MacroArgsMap>>
-      MacroArgsCacheMap;
-
   /// The stack of modules being built, which is used to detect
   /// cycles in the module dependency graph as modules are being built, as
   /// well as to describe why we're rebuilding a particular module.
@@ -743,6 +943,16 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
 
   void clearIDTables();
 
+  /// Enable or disable concurrent mode, in which several threads may resolve
+  /// locations, compute line and column numbers and emit diagnostics at once
+  /// without taking a global lock. The lookup caches are kept per thread,
+  /// and buffers and line tables are computed once under a lock. Creating
+  /// SrcIDs must still be serialized, but may overlap with lookups.
+  ///
+  /// Only change the mode while no other thread is using the SrcMgr.
+  void setConcurrent(bool Enable = true) { Concurrent = Enable; }
+  bool isConcurrent() const { return Concurrent; }
+
   /// Initialize this source manager suitably to replay the compilation
   /// described by \p Old. Requires that \p Old outlive \p *this.
   void initializeForReplay(const SrcMgr &Old);
@@ -988,6 +1198,9 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
   ///
   /// \param FID The file ID whose contents will be returned.
   /// \param Invalid If non-NULL, will be set true if an error occurred.
+  ///
+  /// This may be called from several threads at once, as long as no SrcIDs
+  /// are being created at the same time.
   StringRef getBufferData(SrcID FID, bool *Invalid = nullptr) const;
 
   /// Get the number of SrcIDs (files and macros) that were created
@@ -1016,6 +1229,13 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
   // SrcLoc manipulation methods.
   //===--------------------------------------------------------------------===//
 
+  /// Tell the OS how the buffer of \p FID is about to be read. The lexer
+  /// reads a buffer sequentially, the parser and diagnostics at random; once
+  /// a file's AST is complete only diagnostics may still need its text.
+  /// This only affects buffers mapped from files; see
+  /// FileSystemOptions::MapThreshold.
+  void adviseBufferAccess(SrcID FID, src::BufferAccess Access) const;
+
   /// Return the SrcID for a SrcLoc.
   ///
   /// This is a very hot method that is used for all SrcMgr queries
@@ -1026,6 +1246,7 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
     unsigned SLocOffset = SpellingLoc.getOffset();
 
     // If our one-entry cache covers this offset, just return it.
+    SrcID LastSrcIDLookup = getLookupCache().LastSrcIDLookup;
     if (isOffsetInSrcID(LastSrcIDLookup, SLocOffset)) return LastSrcIDLookup;
 
     return getSrcIDSlow(SLocOffset);
@@ -1475,6 +1696,14 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
     return ContentCacheAlloc.getTotalMemory();
   }
 
+  /// Return the bytes of the ContentCache allocator that compressing line
+  /// tables has saved.
+  size_t getLineTableBytesSaved() const;
+
+  /// Return the number of files that share the buffer of another file with
+  /// the same contents, and the bytes of buffers that sharing has saved.
+  std::pair<unsigned, size_t> getSharedContentsStats() const;
+
   struct MemoryBufferSizes {
     const size_t malloc_bytes;
     const size_t mmap_bytes;
@@ -1665,6 +1894,7 @@ class SrcMgr : public RefCountedBase<SrcMgr> {
  private:
   friend class ASTReader;
   friend class ASTWriter;
+  friend class src::ContentCache;
 
   llvm::MemoryBuffer *getFakeBufferForRecovery() const;
   const src::ContentCache *getFakeContentCacheForRecovery() const;
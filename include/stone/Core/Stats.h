@@ -2,7 +2,10 @@
 #define STONE_CORE_STATS_H
 
 #include <iostream>
+#include <vector>
 
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/JSON.h"
 #include "stone/Core/Mem.h"
 
 namespace stone {
@@ -16,14 +19,31 @@ class Stats {
   virtual ~Stats() {}
 
  public:
+  /// The name that keys this group in StatEngine::GetData().
+  virtual llvm::StringRef GetName() const { return "stats"; }
+
   virtual void Print() const = 0;
+
+  /// Add the statistics to \p data as named values, for tools that compare
+  /// them across runs rather than read them.
+  virtual void GetData(llvm::json::Object &data) const {}
 };
 
 class StatEngine {
+  std::vector<std::unique_ptr<Stats>> ownedStats;
+  std::vector<const Stats *> entries;
+
  public:
   StatEngine();
   /// Owns the Stats
   void AddStats(std::unique_ptr<Stats> stats);
+  /// Report \p stats, which stays owned by its component, until
+  /// RemoveStats() is called.
+  void AddStats(const Stats &stats);
+  void RemoveStats(const Stats &stats);
+
+  /// Return the data of every Stats, keyed by Stats::GetName().
+  llvm::json::Object GetData() const;
   ///
   void Print();
 };
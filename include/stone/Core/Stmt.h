@@ -23,6 +23,8 @@
 
 namespace stone {
 namespace syntax {
+class ASTContext;
+
 class Stmt : public ASTNode {
   stmt::Kind kind;
 
@@ -33,6 +35,10 @@ class Stmt : public ASTNode {
   Stmt &operator=(const Stmt &) = delete;
   Stmt &operator=(Stmt &&) = delete;
 
+  // Only allow allocation of Stmts using the allocator in ASTContext.
+  void *operator new(std::size_t bytes, const ASTContext &astCtx,
+                     unsigned alignment = 8);
+
  public:
   stmt::Kind GetKind() { return kind; }
 };
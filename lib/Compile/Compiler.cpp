@@ -2,6 +2,8 @@
 
 #include "stone/Compile/Analysis.h"
 #include "stone/Compile/Frontend.h"
+#include "stone/Compile/TokenBuffer.h"
+#include "stone/Core/FileSystemStatCache.h"
 #include "stone/Core/Ret.h"
 
 using namespace stone;
@@ -14,8 +16,13 @@ Compiler::Compiler(CompilePipeline *pipeline)
       fm(compileOpts.fsOpts),
       sm(GetDiagEngine(), fm) {
   analysis.reset(new Analysis(*this, compileOpts, GetSrcMgr()));
+  GetStatEngine().AddStats(analysis->GetASTContext().GetStats());
+  GetStatEngine().AddStats(
+      analysis->GetASTContext().GetIdentifierTableStats());
 }
 
+Compiler::~Compiler() {}
+
 void Compiler::ComputeMode(const llvm::opt::DerivedArgList &args) {
   Session::ComputeMode(args);
 }
@@ -29,7 +36,8 @@ bool Compiler::Build(llvm::ArrayRef<const char *> args) {
   // Computer the compiler mode.
   ComputeMode(*dArgList);
 
-  BuildInputs();
+  BuildOptions(*dArgList);
+  BuildInputs(*dArgList);
 
   // Setup the main module
   // if (!mainModule) {
@@ -40,7 +48,39 @@ bool Compiler::Build(llvm::ArrayRef<const char *> args) {
 
   return true;
 }
-void Compiler::BuildInputs() {}
+void Compiler::BuildOptions(const llvm::opt::DerivedArgList &args) {
+  if (const llvm::opt::Arg *arg = args.getLastArg(opts::j)) {
+    unsigned numThreads;
+    if (llvm::StringRef(arg->getValue()).getAsInteger(10, numThreads)) {
+      os << "D(SrcLoc(),"
+         << "msg::error_invalid_arg_value,"
+         << "arg->getAsString(args), arg->getValue());" << '\n';
+    } else {
+      compileOpts.analysisOpts.numLexThreads = numThreads;
+    }
+  }
+  if (args.hasArg(opts::SampleASTMemory))
+    compileOpts.analysisOpts.sampleASTMemory = true;
+  if (const llvm::opt::Arg *arg = args.getLastArg(opts::StatCache)) {
+    // The file manager already exists, so the cache is installed rather than
+    // left to the options.
+    compileOpts.fsOpts.StatCachePath = arg->getValue();
+    fm.setStatCache(PersistentStatCache::create(arg->getValue()));
+  }
+}
+
+void Compiler::BuildInputs(const llvm::opt::DerivedArgList &args) {
+  llvm::SmallVector<llvm::StringRef, 16> inputNames;
+  for (const llvm::opt::Arg *arg : args) {
+    if (arg->getOption().getKind() != llvm::opt::Option::InputClass) continue;
+    llvm::StringRef argValue = arg->getValue();
+    if (!argValue.equals("-")) inputNames.push_back(argValue);
+  }
+  // Stat and read all of the inputs at once rather than one at a time as
+  // each is first needed.
+  fm.Prefetch(inputNames);
+}
+
 ModeKind Compiler::GetDefaultModeKind() { return ModeKind::EmitObject; }
 
 void Compiler::PrintLifecycle() {}
@@ -62,7 +102,23 @@ int Compiler::Run() {
 
 void Compiler::Parse() { Parse(false); }
 
+void Compiler::Lex() {
+  llvm::SmallVector<SrcID, 16> srcIDs;
+  for (auto input : inputs) srcIDs.push_back(input->GetSrcID());
+
+  lexedInputs = stone::analysis::Lex(srcIDs, sm, *this,
+                                     compileOpts.analysisOpts.numLexThreads);
+  SampleASTMemory("lex");
+}
+
+void Compiler::SampleASTMemory(llvm::StringRef phase) {
+  if (compileOpts.analysisOpts.sampleASTMemory)
+    analysis->GetASTContext().GetStats().Sample(phase);
+}
+
 void Compiler::Parse(bool check) {
+  // Lex every input up front so that the files are lexed in parallel.
+  Lex();
   for (auto input : inputs) {
     // stone::analysis::Parse
     if (check) {
@@ -70,9 +126,17 @@ void Compiler::Parse(bool check) {
         CheckSourceUnit();
       }
     }
+    // Once the input's AST is complete only diagnostics may still read its
+    // text, so its pages can go.
+    if (!check || !compileOpts.analysisOpts.wholeModuleCheck)
+      sm.adviseBufferAccess(input->GetSrcID(), src::BufferAccess::NotNeeded);
   }
+  SampleASTMemory(check ? "check" : "parse");
   if (check && compileOpts.analysisOpts.wholeModuleCheck) {
     CheckModule();
+    for (auto input : inputs)
+      sm.adviseBufferAccess(input->GetSrcID(), src::BufferAccess::NotNeeded);
+    SampleASTMemory("check module");
   }
 }
 void Compiler::Check() { Parse(true); }
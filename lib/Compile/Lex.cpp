@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "llvm/ADT/DenseMap.h"
+#include "stone/Compile/Frontend.h"
+#include "stone/Compile/Lexer.h"
+#include "stone/Compile/TokenBuffer.h"
+#include "stone/Core/SrcMgr.h"
+
+using namespace stone;
+using namespace stone::analysis;
+
+std::vector<std::shared_ptr<LexedFile>> stone::analysis::Lex(
+    llvm::ArrayRef<SrcID> srcIDs, SrcMgr &sm, const stone::Context &ctx,
+    unsigned numThreads) {
+  std::vector<std::shared_ptr<LexedFile>> lexedFiles(srcIDs.size());
+  if (srcIDs.empty()) return lexedFiles;
+
+  if (numThreads == 0) numThreads = std::thread::hardware_concurrency();
+  numThreads = std::max(1u, std::min<unsigned>(numThreads, srcIDs.size()));
+
+  // Files with identical contents share one buffer in the SrcMgr, and so
+  // lex to the same tokens. Only the first file to reach a buffer lexes it;
+  // the others take its tokens once every thread is done.
+  std::mutex lexedBuffersMutex;
+  llvm::DenseMap<const char *, unsigned> lexedBuffers;
+  std::vector<unsigned> sameAs(srcIDs.size());
+
+  // Files differ a lot in size, so each thread takes the next file as it
+  // finishes one instead of being handed a fixed share up front.
+  std::atomic<unsigned> nextFile(0);
+  auto lexFiles = [&]() {
+    for (unsigned i = nextFile++; i < srcIDs.size(); i = nextFile++) {
+      llvm::StringRef buffer = sm.getBufferData(srcIDs[i]);
+      {
+        std::lock_guard<std::mutex> lock(lexedBuffersMutex);
+        auto inserted = lexedBuffers.insert({buffer.data(), i});
+        sameAs[i] = inserted.first->second;
+        if (!inserted.second) continue;
+      }
+      Lexer lexer(srcIDs[i], sm, ctx);
+      lexedFiles[i] = std::make_shared<LexedFile>(buffer);
+      lexer.Lex(lexedFiles[i]->tokens);
+      // From here on the text is read by token, in no particular order.
+      sm.adviseBufferAccess(srcIDs[i], src::BufferAccess::Random);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < numThreads; ++t) threads.emplace_back(lexFiles);
+  lexFiles();
+  for (auto &thread : threads) thread.join();
+
+  for (unsigned i = 0; i != srcIDs.size(); ++i) {
+    if (sameAs[i] != i) lexedFiles[i] = lexedFiles[sameAs[i]];
+  }
+  return lexedFiles;
+}
+
+unsigned stone::analysis::Relex(const TokenBuffer &oldTokens,
+                                const TextEdit &edit, const SrcID srcID,
+                                SrcMgr &sm, const stone::Context &ctx,
+                                TokenBuffer &tokens) {
+  StringRef oldText = oldTokens.GetBuffer();
+  StringRef text = tokens.GetBuffer();
+  assert(tokens.empty() && "relexing into a buffer that has tokens");
+  assert(!oldTokens.empty() && oldTokens.Is(oldTokens.size() - 1, tk::eof) &&
+         "old token buffer has not been lexed to the end");
+  assert(sm.getBufferData(srcID).data() == text.data() &&
+         "token buffer belongs to another buffer");
+  assert(edit.offset + edit.removedLength <= oldText.size() &&
+         text.size() ==
+             oldText.size() - edit.removedLength + edit.insertedText.size() &&
+         text.substr(edit.offset, edit.insertedText.size()) ==
+             edit.insertedText &&
+         "edit does not turn the old text into the new text");
+  (void)oldText;
+
+  // Where the edit ends in the new text, and how far it moved what follows.
+  unsigned editEnd = edit.offset + edit.insertedText.size();
+  int64_t delta = int64_t(edit.insertedText.size()) - edit.removedLength;
+
+  // The token before the first one starting at or after the edit may run
+  // into it. Relex one more before that, in case its end was decided by a
+  // character that the edit changed.
+  unsigned keep = oldTokens.LowerBound(edit.offset);
+  keep = keep < 2 ? 0 : keep - 2;
+  for (unsigned i = 0; i != keep; ++i) tokens.PushCopy(oldTokens, i);
+  unsigned startOffset = 0;
+  if (keep != 0)
+    startOffset = oldTokens.GetOffset(keep - 1) + oldTokens.GetLength(keep - 1);
+
+  Lexer lexer(srcID, sm, ctx, startOffset, text.size());
+  unsigned numLexed = 0;
+  unsigned old = keep;
+  while (true) {
+    const Token &tok = lexer.Peek();
+    ++numLexed;
+
+    // The lexer only remembers where it is, so once a token past the edit
+    // starts where an old token did, with the same leading newline, the rest
+    // of the stream is the old one shifted by delta.
+    unsigned offset = tok.GetRawText().begin() - text.begin();
+    if (offset >= editEnd) {
+      unsigned oldOffset = offset - delta;
+      old = oldTokens.LowerBound(oldOffset, old);
+      if (old != oldTokens.size() && oldTokens.GetOffset(old) == oldOffset &&
+          oldTokens.GetFlags(old) == TokenBuffer::ComputeFlags(tok)) {
+        assert(oldTokens.GetKind(old) == tok.GetKind() &&
+               oldTokens.GetLength(old) == tok.GetLength() &&
+               "relexed token differs from the old one");
+        for (; old != oldTokens.size(); ++old)
+          tokens.PushCopy(oldTokens, old, delta);
+        return numLexed;
+      }
+    }
+
+    bool isEOF = tok.Is(tk::eof);
+    lexer.PushNextToken(tokens);
+    if (isEOF) return numLexed;
+  }
+}
@@ -1,6 +1,14 @@
 #include "stone/Compile/Lexer.h"
 
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/ConvertUTF.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
+#include "stone/Compile/TokenBuffer.h"
+#include "stone/Compile/UnicodeCharSet.h"
+#include "stone/Core/ASTContext.h"
 #include "stone/Core/Char.h"
+#include "stone/Core/CharScan.h"
 #include "stone/Core/SrcMgr.h"
 
 using namespace stone;
@@ -71,56 +79,57 @@ uint32_t stone::analysis::ValidateUTF8CharAndAdvance(const char *&Ptr,
   return EncodedBytes == 4 ? CharValue : ~0U;
 }
 
-static bool IsValidIdentifierContinuationCodePoint(uint32_t c) {
+// N1518: Recommendations for extended identifier characters for C and C++
+// Proposed Annex X.1: Ranges of characters allowed
+static constexpr unicode::UnicodeCharRange identifierContinuationRanges[] = {
+    {0x00A8, 0x00A8}, {0x00AA, 0x00AA}, {0x00AD, 0x00AD}, {0x00AF, 0x00AF},
+    {0x00B2, 0x00B5}, {0x00B7, 0x00BA}, {0x00BC, 0x00BE}, {0x00C0, 0x00D6},
+    {0x00D8, 0x00F6}, {0x00F8, 0x167F}, {0x1681, 0x180D}, {0x180F, 0x1FFF},
+    {0x200B, 0x200D}, {0x202A, 0x202E}, {0x203F, 0x2040}, {0x2054, 0x2054},
+    {0x2060, 0x218F}, {0x2460, 0x24FF}, {0x2776, 0x2793}, {0x2C00, 0x2DFF},
+    {0x2E80, 0x2FFF}, {0x3004, 0x3007}, {0x3021, 0x302F}, {0x3031, 0xD7FF},
+    {0xF900, 0xFD3D}, {0xFD40, 0xFDCF}, {0xFDF0, 0xFE44}, {0xFE47, 0xFFF8},
+    {0x10000, 0x1FFFD}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+    {0x40000, 0x4FFFD}, {0x50000, 0x5FFFD}, {0x60000, 0x6FFFD},
+    {0x70000, 0x7FFFD}, {0x80000, 0x8FFFD}, {0x90000, 0x9FFFD},
+    {0xA0000, 0xAFFFD}, {0xB0000, 0xBFFFD}, {0xC0000, 0xCFFFD},
+    {0xD0000, 0xDFFFD}, {0xE0000, 0xEFFFD},
+};
+
+// Proposed Annex X.1 without Proposed Annex X.2: Ranges of characters
+// disallowed initially (0x0300-0x036F, 0x1DC0-0x1DFF, 0x20D0-0x20FF and
+// 0xFE20-0xFE2F).
+static constexpr unicode::UnicodeCharRange identifierStartRanges[] = {
+    {0x00A8, 0x00A8}, {0x00AA, 0x00AA}, {0x00AD, 0x00AD}, {0x00AF, 0x00AF},
+    {0x00B2, 0x00B5}, {0x00B7, 0x00BA}, {0x00BC, 0x00BE}, {0x00C0, 0x00D6},
+    {0x00D8, 0x00F6}, {0x00F8, 0x02FF}, {0x0370, 0x167F}, {0x1681, 0x180D},
+    {0x180F, 0x1DBF}, {0x1E00, 0x1FFF}, {0x200B, 0x200D}, {0x202A, 0x202E},
+    {0x203F, 0x2040}, {0x2054, 0x2054}, {0x2060, 0x20CF}, {0x2100, 0x218F},
+    {0x2460, 0x24FF}, {0x2776, 0x2793}, {0x2C00, 0x2DFF}, {0x2E80, 0x2FFF},
+    {0x3004, 0x3007}, {0x3021, 0x302F}, {0x3031, 0xD7FF}, {0xF900, 0xFD3D},
+    {0xFD40, 0xFDCF}, {0xFDF0, 0xFE1F}, {0xFE30, 0xFE44}, {0xFE47, 0xFFF8},
+    {0x10000, 0x1FFFD}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+    {0x40000, 0x4FFFD}, {0x50000, 0x5FFFD}, {0x60000, 0x6FFFD},
+    {0x70000, 0x7FFFD}, {0x80000, 0x8FFFD}, {0x90000, 0x9FFFD},
+    {0xA0000, 0xAFFFD}, {0xB0000, 0xBFFFD}, {0xC0000, 0xCFFFD},
+    {0xD0000, 0xDFFFD}, {0xE0000, 0xEFFFD},
+};
+
+static constexpr unicode::UnicodeCharSet identifierContinuationChars(
+    identifierContinuationRanges);
+static constexpr unicode::UnicodeCharSet identifierStartChars(
+    identifierStartRanges);
+
+bool stone::analysis::IsValidIdentifierContinuationCodePoint(uint32_t c) {
   if (c < 0x80) return stone::isIdentifierBody(c, /*dollar*/ true);
-
-  // N1518: Recommendations for extended identifier characters for C and C++
-  // Proposed Annex X.1: Ranges of characters allowed
-  return c == 0x00A8 || c == 0x00AA || c == 0x00AD || c == 0x00AF ||
-         (c >= 0x00B2 && c <= 0x00B5) || (c >= 0x00B7 && c <= 0x00BA) ||
-         (c >= 0x00BC && c <= 0x00BE) || (c >= 0x00C0 && c <= 0x00D6) ||
-         (c >= 0x00D8 && c <= 0x00F6) || (c >= 0x00F8 && c <= 0x00FF)
-
-         || (c >= 0x0100 && c <= 0x167F) || (c >= 0x1681 && c <= 0x180D) ||
-         (c >= 0x180F && c <= 0x1FFF)
-
-         || (c >= 0x200B && c <= 0x200D) || (c >= 0x202A && c <= 0x202E) ||
-         (c >= 0x203F && c <= 0x2040) || c == 0x2054 ||
-         (c >= 0x2060 && c <= 0x206F)
-
-         || (c >= 0x2070 && c <= 0x218F) || (c >= 0x2460 && c <= 0x24FF) ||
-         (c >= 0x2776 && c <= 0x2793) || (c >= 0x2C00 && c <= 0x2DFF) ||
-         (c >= 0x2E80 && c <= 0x2FFF)
-
-         || (c >= 0x3004 && c <= 0x3007) || (c >= 0x3021 && c <= 0x302F) ||
-         (c >= 0x3031 && c <= 0x303F)
-
-         || (c >= 0x3040 && c <= 0xD7FF)
-
-         || (c >= 0xF900 && c <= 0xFD3D) || (c >= 0xFD40 && c <= 0xFDCF) ||
-         (c >= 0xFDF0 && c <= 0xFE44) || (c >= 0xFE47 && c <= 0xFFF8)
-
-         || (c >= 0x10000 && c <= 0x1FFFD) || (c >= 0x20000 && c <= 0x2FFFD) ||
-         (c >= 0x30000 && c <= 0x3FFFD) || (c >= 0x40000 && c <= 0x4FFFD) ||
-         (c >= 0x50000 && c <= 0x5FFFD) || (c >= 0x60000 && c <= 0x6FFFD) ||
-         (c >= 0x70000 && c <= 0x7FFFD) || (c >= 0x80000 && c <= 0x8FFFD) ||
-         (c >= 0x90000 && c <= 0x9FFFD) || (c >= 0xA0000 && c <= 0xAFFFD) ||
-         (c >= 0xB0000 && c <= 0xBFFFD) || (c >= 0xC0000 && c <= 0xCFFFD) ||
-         (c >= 0xD0000 && c <= 0xDFFFD) || (c >= 0xE0000 && c <= 0xEFFFD);
+  return identifierContinuationChars.Contains(c);
 }
-static bool IsValidIdentifierStartCodePoint(uint32_t c) {
-  if (!IsValidIdentifierContinuationCodePoint(c)) return false;
-
-  if (c < 0x80 && (stone::isDigit(c) || c == '$')) return false;
 
-  // N1518: Recommendations for extended identifier characters for C and C++
-  // Proposed Annex X.2: Ranges of characters disallowed initially
-  if ((c >= 0x0300 && c <= 0x036F) || (c >= 0x1DC0 && c <= 0x1DFF) ||
-      (c >= 0x20D0 && c <= 0x20FF) || (c >= 0xFE20 && c <= 0xFE2F))
-    return false;
-
-  return true;
+bool stone::analysis::IsValidIdentifierStartCodePoint(uint32_t c) {
+  if (c < 0x80) return stone::isIdentifierHead(c);
+  return identifierStartChars.Contains(c);
 }
+
 static bool AdvanceIf(char const *&ptr, char const *end,
                       bool (*predicate)(uint32_t)) {
   char const *next = ptr;
@@ -224,27 +233,6 @@ static bool IsRightBound(const char *tokEnd, bool isLeftBound,
       return true;
   }
 }
-static bool IsNewLine(const signed char ch) {
-  switch (ch) {
-    case '\n':
-    case '\r':
-      return true;
-    default:
-      return false;
-  }
-}
-
-static bool IsWhiteSpace(const signed char ch) {
-  switch (ch) {
-    case ' ':
-    case '\t':
-    case '\f':
-    case '\v':
-      return true;
-    default:
-      return false;
-  }
-}
 static bool IsOperator(const signed char ch) {
   switch (ch) {
     case '=':
@@ -339,15 +327,131 @@ static bool IsIdentifier(const signed char ch) {
   }
 }
 
+//===----------------------------------------------------------------------===//
+// Keywords
+//===----------------------------------------------------------------------===//
+namespace {
+/// A keyword spelling as listed in TokenKind.def.
+struct KeywordSpelling {
+  const char *text;
+  unsigned length;
+  tk kind;
+  unsigned flag;
+};
+
+constexpr KeywordSpelling keywordSpellings[] = {
+#define KEYWORD(kw, S) {#kw, sizeof(#kw) - 1, tk::kw_##kw, S},
+#include "stone/Core/TokenKind.def"
+};
+constexpr unsigned NumKeywordSpellings =
+    sizeof(keywordSpellings) / sizeof(keywordSpellings[0]);
+
+/// Every keyword is at most MaxKeywordLength bytes and starts with one of
+/// [_a-z], which lets the first character select a column directly.
+constexpr unsigned MaxKeywordLength = 15;
+constexpr unsigned char FirstKeywordChar = '_';
+constexpr unsigned char LastKeywordChar = 'z';
+constexpr unsigned NumKeywordColumns = LastKeywordChar - FirstKeywordChar + 1;
+
+constexpr bool KeywordSpellingsFitMap() {
+  for (const auto &spelling : keywordSpellings) {
+    auto first = static_cast<unsigned char>(spelling.text[0]);
+    if (spelling.length == 0 || spelling.length > MaxKeywordLength ||
+        first < FirstKeywordChar || first > LastKeywordChar)
+      return false;
+  }
+  return NumKeywordSpellings <= 255;
+}
+static_assert(KeywordSpellingsFitMap(),
+              "A keyword in TokenKind.def does not fit the KeywordMap layout");
+
+/// Maps keyword spellings to token kinds. The map is built by the compiler
+/// from TokenKind.def: keywords are bucketed by length and then by first
+/// character, so a lookup is two table loads, a last-character check and one
+/// final memcmp. Identifiers that are not keywords usually miss on the first
+/// load and never touch the keyword text.
+class KeywordMap final {
+  struct Entry {
+    const char *text = nullptr;
+    tk kind = tk::identifier;
+  };
+  struct Bucket {
+    unsigned char start = 0;
+    unsigned char size = 0;
+  };
+
+  Entry entries[NumKeywordSpellings];
+  Bucket buckets[MaxKeywordLength + 1][NumKeywordColumns];
+
+  static constexpr unsigned GetColumn(const char *text) {
+    return static_cast<unsigned char>(text[0]) - FirstKeywordChar;
+  }
+
+ public:
+  constexpr KeywordMap() : entries(), buckets() {
+    // Only TOKON keywords are lexed as keywords. Reserved (TOKRSV) and
+    // disabled (TOKOFF) keywords remain identifiers, which is what
+    // IdentifierTable::AddKeywords records for them as well.
+    for (const auto &spelling : keywordSpellings) {
+      if (spelling.flag & TOKON)
+        ++buckets[spelling.length][GetColumn(spelling.text)].size;
+    }
+    unsigned start = 0;
+    for (auto &row : buckets) {
+      for (auto &bucket : row) {
+        bucket.start = start;
+        start += bucket.size;
+        bucket.size = 0;
+      }
+    }
+    for (const auto &spelling : keywordSpellings) {
+      if (!(spelling.flag & TOKON)) continue;
+      auto &bucket = buckets[spelling.length][GetColumn(spelling.text)];
+      auto &entry = entries[bucket.start + bucket.size++];
+      entry.text = spelling.text;
+      entry.kind = spelling.kind;
+    }
+  }
+
+  /// Return the keyword kind for \p text, or tk::identifier.
+  tk Lookup(const char *text, size_t length) const {
+    if (length == 0 || length > MaxKeywordLength) return tk::identifier;
+
+    auto first = static_cast<unsigned char>(text[0]);
+    if (first < FirstKeywordChar || first > LastKeywordChar)
+      return tk::identifier;
+
+    const Bucket &bucket = buckets[length][first - FirstKeywordChar];
+    for (unsigned i = bucket.start, e = i + bucket.size; i != e; ++i) {
+      const Entry &entry = entries[i];
+      if (entry.text[length - 1] == text[length - 1] &&
+          memcmp(entry.text, text, length) == 0)
+        return entry.kind;
+    }
+    return tk::identifier;
+  }
+};
+}  // namespace
+
+static constexpr KeywordMap keywordMap;
+
 Lexer::Lexer(const SrcID srcID, SrcMgr &sm, const stone::Context &ctx,
-             CompilePipeline *pipeline)
-    : srcID(srcID), sm(sm), ctx(ctx) {
+             CompilePipeline *pipeline, TriviaRetentionMode triviaRetention)
+    : srcID(srcID), sm(sm), ctx(ctx), triviaRetention(triviaRetention) {
+  // Go through getBufferData(), which is safe to call from lexer threads.
   bool invalid = false;
-  auto memBuffer = sm.getBuffer(srcID, SrcLoc(), &invalid /*true means error*/);
+  StringRef contents = sm.getBufferData(srcID, &invalid);
 
-  assert(invalid = true && "No memory buffer found for the Lexer");
+  assert(!invalid && "No source buffer found for the Lexer");
 
-  Init(/*startOffset=*/0, memBuffer->getBufferSize());
+  Init(/*startOffset=*/0, contents.size());
+}
+
+Lexer::Lexer(const SrcID srcID, SrcMgr &sm, const stone::Context &ctx,
+             unsigned startOffset, unsigned endOffset,
+             CompilePipeline *pipeline, TriviaRetentionMode triviaRetention)
+    : srcID(srcID), sm(sm), ctx(ctx), triviaRetention(triviaRetention) {
+  Init(startOffset, endOffset);
 }
 void Lexer::Init(unsigned startOffset, unsigned endOffset) {
   assert(startOffset <= endOffset);
@@ -395,12 +499,30 @@ void Lexer::Init(unsigned startOffset, unsigned endOffset) {
   // LexerDiagnostics()));
 }
 
+void Lexer::Lex(TokenBuffer &tokens) {
+  // Push straight from nextToken rather than copying each token out first.
+  while (nextToken.IsNot(tk::eof)) PushNextToken(tokens);
+  PushNextToken(tokens);
+}
+
+void Lexer::PushNextToken(TokenBuffer &tokens) {
+  assert(tokens.GetBuffer().data() == bufferStart &&
+         "token buffer belongs to another buffer");
+  tokens.Push(nextToken);
+  if (hasNextIntegerValue)
+    tokens.SetIntegerValue(tokens.size() - 1, nextIntegerValue);
+  if (nextToken.IsNot(tk::eof)) Lex();
+}
+
 void Lexer::Lex() {
   assert((curPtr >= bufferStart && curPtr <= bufferEnd) &&
          "Cannot Lex -- the current pointer is out of range!");
 
   leadingTrivia.clear();
   trailingTrivia.clear();
+  nextTokenTriviaStart = curPtr;
+  triviaIsStale = false;
+  hasNextIntegerValue = false;
 
   if (curPtr == bufferStart) {
     if (bufferStart < contentStart) {
@@ -421,6 +543,11 @@ void Lexer::Lex() {
   const char *tokStart = curPtr;
   auto ch = (signed char)*curPtr++;
   switch (ch) {
+    case 0:
+      // LexTrivia only stops at a NUL that ends the buffer.
+      curPtr = tokStart;
+      return CreateToken(tk::eof, tokStart);
+
     case -1:
     case -2:
       // Diagnose(CurPtr-1, diag::lex_utf16_bom_marker);
@@ -449,6 +576,17 @@ void Lexer::Lex() {
     case '\\':
       return CreateToken(tk::backslash, tokStart);
 
+    case '"':
+      return LexStrLiteral(tokStart);
+    case '#': {
+      // A raw string literal, #"..."#, with any number of '#'.
+      const char *quote = curPtr;
+      while (*quote == '#') ++quote;
+      if (*quote != '"') return CreateToken(tk::unk, tokStart);
+      curPtr = quote + 1;
+      return LexStrLiteral(tokStart, quote - tokStart);
+    }
+
       // case '<':
       // case '>':
       //  return LexOperatorIdentifier();
@@ -458,45 +596,613 @@ void Lexer::Lex() {
         // return LexOperatorIdentifier());
       }
       if (IsIdentifier(ch)) {
-        return LexIdentifier();
+        return LexIdentifier(tokStart);
+      }
+      if (!isASCII(ch)) {
+        curPtr = tokStart;
+        if (AdvanceIfValidStartOfIdentifier(curPtr, bufferEnd)) {
+          return LexIdentifier(tokStart);
+        }
+        curPtr = tokStart + 1;
       }
       if (IsNumber(ch)) {
-        return LexNumber();
+        return LexNumber(tokStart);
       }
+      // Anything else, including operators until they are lexed, becomes an
+      // unknown token so that every call produces a token.
+      return CreateToken(tk::unk, tokStart);
     }
   }
 }
-void Lexer::LexIdentifier() {
-  const char *tokStart = curPtr - 1;
-  curPtr = tokStart;
-  bool didStart = AdvanceIfValidStartOfIdentifier(curPtr, bufferEnd);
-
-  assert(didStart && "Unexpected start");
-  (void)didStart;
-
-  // Lex [a-zA-Z_$0-9[[:XID_Continue:]]]*
-  while (AdvanceIfValidContinuationOfIdentifier(curPtr, bufferEnd))
-    ;
+/// Lex the rest of an identifier or keyword whose first character, starting
+/// at \p tokStart, has already been consumed.
+void Lexer::LexIdentifier(const char *tokStart) {
+  assert(curPtr > tokStart && "Unexpected start");
+
+  // Lex [a-zA-Z_$0-9[[:XID_Continue:]]]*, hashing each byte as it is
+  // classified so that interning the identifier does not walk it again. Only
+  // a byte >= 0x80 has to go through UTF-8 validation.
+  using syntax::IdentifierTable;
+  unsigned hash = IdentifierTable::HashName(
+      StringRef(tokStart, curPtr - tokStart));
+  while (true) {
+    while (isIdentifierBody(*curPtr, /*AllowDollar=*/true))
+      hash = IdentifierTable::HashNameChar(hash, *curPtr++);
+    const char *charStart = curPtr;
+    if (isASCII(*curPtr) ||
+        !AdvanceIfValidContinuationOfIdentifier(curPtr, bufferEnd))
+      break;
+    hash = IdentifierTable::HashName(StringRef(charStart, curPtr - charStart),
+                                     hash);
+  }
 
   auto kind = GetKindOfIdentifier(StringRef(tokStart, curPtr - tokStart));
 
-  return CreateToken(kind, tokStart);
+  CreateToken(kind, tokStart);
+  if (nextToken.IsNot(tk::eof)) nextToken.SetIdentifierHash(hash);
 }
 
 /// This is either an identifier or a keyword.
 tk Lexer::GetKindOfIdentifier(StringRef tokStr) {
-#define KEYWORD(kw, S) \
-  if (tokStr == #kw) return tk::kw_##kw;
-#include "stone/Core/TokenKind.def"
-  return tk::identifier;
+  return keywordMap.Lookup(tokStr.data(), tokStr.size());
+}
+
+tk stone::analysis::GetKeywordKind(StringRef text) {
+  return keywordMap.Lookup(text.data(), text.size());
+}
+static TriviaKind GetHorizontalWhitespaceKind(char c) {
+  switch (c) {
+    case ' ':
+      return TriviaKind::Space;
+    case '\t':
+      return TriviaKind::Tab;
+    case '\v':
+      return TriviaKind::VerticalTab;
+    case '\f':
+      return TriviaKind::Formfeed;
+    default:
+      llvm_unreachable("not horizontal whitespace");
+  }
+}
+
+/// Record the horizontal whitespace in [begin, end) as one piece per run of
+/// the same character.
+static void AddHorizontalWhitespace(Trivia &trivia, const char *begin,
+                                    const char *end) {
+  for (const char *ptr = begin; ptr != end;) {
+    const char *runStart = ptr;
+    char c = *ptr++;
+    while (ptr != end && *ptr == c) ++ptr;
+    trivia.AppendOrSquash(GetHorizontalWhitespaceKind(c), ptr - runStart);
+  }
+}
+
+/// Lex the trivia in front of (leading) or behind (trailing) the next token.
+/// Runs of whitespace and the bodies of comments are skipped with the
+/// vectorized scanners in CharScan.h; the trivia pieces are only built when
+/// the lexer retains trivia. Trailing trivia stops in front of the first line
+/// break, so that the line break sets the start-of-line bit of the token that
+/// follows it.
+void Lexer::LexTrivia(Trivia &trivia, bool isTrailing) {
+  const bool retainTrivia = triviaRetention == TriviaRetentionMode::With;
+  while (true) {
+    const char *triviaStart = curPtr;
+    switch (*curPtr) {
+      case ' ':
+      case '\t':
+      case '\v':
+      case '\f':
+        curPtr = ch::SkipHorizontalWhitespace(curPtr + 1, bufferEnd);
+        if (retainTrivia) AddHorizontalWhitespace(trivia, triviaStart, curPtr);
+        continue;
+
+      case '\n':
+      case '\r': {
+        if (isTrailing) return;
+        nextToken.SetAtStartOfLine(true);
+        if (!retainTrivia) {
+          ++curPtr;
+          continue;
+        }
+        TriviaKind kind = TriviaKind::Newline;
+        if (*curPtr == '\r') {
+          kind = curPtr[1] == '\n' ? TriviaKind::CarriageReturnLineFeed
+                                   : TriviaKind::CarriageReturn;
+        }
+        curPtr += kind == TriviaKind::CarriageReturnLineFeed ? 2 : 1;
+        trivia.AppendOrSquash(kind, curPtr - triviaStart);
+        continue;
+      }
+
+      case '/':
+        if (curPtr[1] == '/') {
+          curPtr = ch::FindNewLine(curPtr + 2, bufferEnd);
+          if (retainTrivia)
+            trivia.push_back(TriviaKind::LineComment, curPtr - triviaStart);
+          continue;
+        }
+        if (curPtr[1] == '*') {
+          bool isMultiline = SkipBlockComment();
+          if (isMultiline) {
+            // A comment that spans lines ends the trailing trivia; the
+            // leading trivia of the next token picks it up again.
+            if (isTrailing) {
+              curPtr = triviaStart;
+              return;
+            }
+            nextToken.SetAtStartOfLine(true);
+          }
+          if (retainTrivia)
+            trivia.push_back(TriviaKind::BlockComment, curPtr - triviaStart);
+          continue;
+        }
+        return;
+
+      case 0:
+        // The NUL at the end of the buffer is the EOF token; any other NUL
+        // is stray text between tokens.
+        if (curPtr == bufferEnd || curPtr == codeCompletionPtr) return;
+        // TODO: Diagnose the embedded NUL.
+        ++curPtr;
+        if (retainTrivia)
+          trivia.AppendOrSquash(TriviaKind::GarbageText, curPtr - triviaStart);
+        continue;
+
+      default:
+        return;
+    }
+  }
+}
+
+/// Skip the '/* */' comment that starts at curPtr, including any comments
+/// nested in it, and return whether it contains a line break. An
+/// unterminated comment runs to the end of the buffer.
+bool Lexer::SkipBlockComment() {
+  assert(curPtr[0] == '/' && curPtr[1] == '*' && "Not a block comment");
+  const char *ptr = curPtr + 2;
+  unsigned depth = 1;
+  bool isMultiline = false;
+  while (true) {
+    ptr = ch::FindFirstOf(ptr, bufferEnd, '*', '/', '\n', '\r');
+    if (ptr == bufferEnd) {
+      // TODO: Diagnose the unterminated comment.
+      break;
+    }
+    char c = *ptr++;
+    if (c == '*' && *ptr == '/') {
+      ++ptr;
+      if (--depth == 0) break;
+    } else if (c == '/' && *ptr == '*') {
+      ++ptr;
+      ++depth;
+    } else if (c == '\n' || c == '\r') {
+      isMultiline = true;
+    }
+  }
+  curPtr = ptr;
+  return isMultiline;
 }
-void Lexer::LexTrivia(Trivia trivia, bool isTrailing) {}
 
 void Lexer::LexChar() {}
 
-void Lexer::LexNumber() {}
+/// Rebuild the trivia of nextToken after RestoreState(), by lexing it again
+/// from the start of the leading trivia.
+void Lexer::RelexTrivia() {
+  const char *savedCurPtr = curPtr;
+  leadingTrivia.clear();
+  trailingTrivia.clear();
+
+  curPtr = nextTokenTriviaStart;
+  if (curPtr == bufferStart && bufferStart < contentStart) {
+    leadingTrivia.push_back(TriviaKind::GarbageText, contentStart - curPtr);
+    curPtr = contentStart;
+  }
+  LexTrivia(leadingTrivia, /*isTrailing=*/false);
+  assert(curPtr == nextToken.GetRawText().begin() &&
+         "leading trivia does not end at the token");
+
+  if (nextToken.IsNot(tk::eof)) {
+    curPtr = nextToken.GetRawText().end();
+    LexTrivia(trailingTrivia, /*isTrailing=*/true);
+  }
+  assert((nextToken.Is(tk::eof) || curPtr == savedCurPtr) &&
+         "trailing trivia does not end at the lexer position");
+
+  curPtr = savedCurPtr;
+  triviaIsStale = false;
+}
+
+/// Skip the decimal digits and '_' separators at \p ptr, accumulating the
+/// digits into \p value. Runs of eight digits are tested and converted a word
+/// at a time. \p overflow is set once the value no longer fits in 64 bits.
+static const char *LexDecimalDigits(const char *ptr, const char *end,
+                                    uint64_t &value, bool &overflow) {
+  while (true) {
+    bool overflowed;
+    if (end - ptr >= 8 && ch::AreEightDigits(ptr)) {
+      value = llvm::SaturatingMultiplyAdd<uint64_t>(
+          value, 100000000, ch::ParseEightDigits(ptr), &overflowed);
+      overflow |= overflowed;
+      ptr += 8;
+    } else if (isDigit(*ptr)) {
+      value = llvm::SaturatingMultiplyAdd<uint64_t>(value, 10, *ptr - '0',
+                                                    &overflowed);
+      overflow |= overflowed;
+      ++ptr;
+    } else if (*ptr == '_') {
+      ++ptr;
+    } else {
+      return ptr;
+    }
+  }
+}
+
+/// Return the value of \p c as a digit in \p radix, or ~0U if it is not one.
+static unsigned GetDigitValue(char c, unsigned radix) {
+  unsigned digit = ~0U;
+  if (isDigit(c))
+    digit = c - '0';
+  else if (c >= 'a' && c <= 'f')
+    digit = c - 'a' + 10;
+  else if (c >= 'A' && c <= 'F')
+    digit = c - 'A' + 10;
+  return digit < radix ? digit : ~0U;
+}
 
-void Lexer::LexStrLiteral() {}
+/// Skip the digits of \p radix and '_' separators at \p ptr, accumulating
+/// them into \p value like LexDecimalDigits().
+static const char *LexRadixDigits(const char *ptr, unsigned radix,
+                                  uint64_t &value, bool &overflow) {
+  while (true) {
+    if (*ptr == '_') {
+      ++ptr;
+      continue;
+    }
+    unsigned digit = GetDigitValue(*ptr, radix);
+    if (digit == ~0U) return ptr;
+    bool overflowed;
+    value = llvm::SaturatingMultiplyAdd<uint64_t>(value, radix, digit,
+                                                  &overflowed);
+    overflow |= overflowed;
+    ++ptr;
+  }
+}
+
+/// Lex a number literal whose first digit, at \p tokStart, has already been
+/// consumed.
+///
+///   integer_literal  ::= [0-9][0-9_]*
+///   integer_literal  ::= 0x[0-9a-fA-F][0-9a-fA-F_]*
+///   integer_literal  ::= 0o[0-7][0-7_]*
+///   integer_literal  ::= 0b[01][01_]*
+///   floating_literal ::= [0-9][0-9_]*\.[0-9][0-9_]*
+///   floating_literal ::= [0-9][0-9_]*\.[0-9][0-9_]*[eE][+-]?[0-9][0-9_]*
+///   floating_literal ::= [0-9][0-9_]*[eE][+-]?[0-9][0-9_]*
+///   floating_literal ::= 0x[0-9A-Fa-f][0-9A-Fa-f_]*
+///                          (\.[0-9A-Fa-f][0-9A-Fa-f_]*)?[pP][+-]?[0-9][0-9_]*
+///
+/// The value of an integer literal is computed while its digits are scanned.
+void Lexer::LexNumber(const char *tokStart) {
+  assert(curPtr == tokStart + 1 && isDigit(*tokStart) && "Unexpected start");
+
+  if (*tokStart == '0') {
+    switch (*curPtr) {
+      case 'x':
+        return LexHexNumber(tokStart);
+      case 'o':
+        return LexRadixNumber(tokStart, 8);
+      case 'b':
+        return LexRadixNumber(tokStart, 2);
+      default:
+        break;
+    }
+  }
+
+  uint64_t value = 0;
+  bool overflow = false;
+  curPtr = LexDecimalDigits(tokStart, bufferEnd, value, overflow);
+
+  // A '.' that is not followed by a digit is a member access, as in
+  // "1.description".
+  bool isFloat = false;
+  if (*curPtr == '.' && isDigit(curPtr[1])) {
+    isFloat = true;
+    curPtr = LexDecimalDigits(curPtr + 1, bufferEnd, value, overflow);
+  }
+  if (*curPtr == 'e' || *curPtr == 'E') {
+    const char *exponent = curPtr + 1;
+    if (*exponent == '+' || *exponent == '-') ++exponent;
+    // TODO: Diagnose the missing exponent digits.
+    if (!isDigit(*exponent)) return LexInvalidNumber(tokStart);
+    isFloat = true;
+    curPtr = LexDecimalDigits(exponent, bufferEnd, value, overflow);
+  }
+
+  // TODO: Diagnose an invalid digit or a trailing identifier character.
+  if (isIdentifierBody(*curPtr, /*AllowDollar=*/true))
+    return LexInvalidNumber(tokStart);
+
+  if (isFloat) return CreateToken(tk::floating_literal, tokStart);
+  return CreateIntegerToken(tokStart, value, overflow);
+}
+
+/// Lex an integer literal with a '0o' or '0b' prefix.
+void Lexer::LexRadixNumber(const char *tokStart, unsigned radix) {
+  ++curPtr;
+  // TODO: Diagnose a prefix without digits.
+  if (GetDigitValue(*curPtr, radix) == ~0U) return LexInvalidNumber(tokStart);
+
+  uint64_t value = 0;
+  bool overflow = false;
+  curPtr = LexRadixDigits(curPtr, radix, value, overflow);
+
+  // TODO: Diagnose an invalid digit or a trailing identifier character.
+  if (isIdentifierBody(*curPtr, /*AllowDollar=*/true))
+    return LexInvalidNumber(tokStart);
+  return CreateIntegerToken(tokStart, value, overflow);
+}
+
+/// Lex a hexadecimal integer or floating point literal.
+void Lexer::LexHexNumber(const char *tokStart) {
+  ++curPtr;
+  // TODO: Diagnose a prefix without digits.
+  if (!isHexDigit(*curPtr)) return LexInvalidNumber(tokStart);
+
+  uint64_t value = 0;
+  bool overflow = false;
+  curPtr = LexRadixDigits(curPtr, 16, value, overflow);
+
+  if ((*curPtr != '.' || !isHexDigit(curPtr[1])) && *curPtr != 'p' &&
+      *curPtr != 'P') {
+    // TODO: Diagnose an invalid digit or a trailing identifier character.
+    if (isIdentifierBody(*curPtr, /*AllowDollar=*/true))
+      return LexInvalidNumber(tokStart);
+    return CreateIntegerToken(tokStart, value, overflow);
+  }
+
+  // A hexadecimal floating point literal. The value is not needed.
+  const char *dot = nullptr;
+  if (*curPtr == '.') {
+    dot = curPtr;
+    curPtr = LexRadixDigits(curPtr + 1, 16, value, overflow);
+  }
+  if (*curPtr != 'p' && *curPtr != 'P') {
+    // "0xff.description" is a member access; anything else that looks like
+    // a fraction is missing its exponent.
+    if (dot && !isDigit(dot[1])) {
+      curPtr = dot;
+      return CreateIntegerToken(tokStart, value, overflow);
+    }
+    // TODO: Diagnose the missing exponent.
+    return LexInvalidNumber(tokStart);
+  }
+  const char *exponent = curPtr + 1;
+  if (*exponent == '+' || *exponent == '-') ++exponent;
+  // TODO: Diagnose the missing exponent digits.
+  if (!isDigit(*exponent)) return LexInvalidNumber(tokStart);
+  curPtr = LexDecimalDigits(exponent, bufferEnd, value, overflow);
+
+  // TODO: Diagnose an invalid digit or a trailing identifier character.
+  if (isIdentifierBody(*curPtr, /*AllowDollar=*/true))
+    return LexInvalidNumber(tokStart);
+  return CreateToken(tk::floating_literal, tokStart);
+}
+
+/// Make the rest of a malformed number, up to the next character that cannot
+/// continue an identifier, a single unknown token.
+void Lexer::LexInvalidNumber(const char *tokStart) {
+  curPtr = ch::SkipIdentifierBody(curPtr, bufferEnd);
+  return CreateToken(tk::unk, tokStart);
+}
+
+void Lexer::CreateIntegerToken(const char *tokStart, uint64_t value,
+                               bool overflow) {
+  CreateToken(tk::integer_literal, tokStart);
+  // CreateToken turns tokens past an artificial EOF into tk::eof.
+  if (!overflow && nextToken.Is(tk::integer_literal)) {
+    nextIntegerValue = value;
+    hasNextIntegerValue = true;
+  }
+}
+
+/// Return true if \p ptr starts with \p count '#'.
+static bool HasCustomDelimiter(const char *ptr, unsigned count) {
+  for (unsigned i = 0; i != count; ++i) {
+    if (ptr[i] != '#') return false;
+  }
+  return true;
+}
+
+/// Lex a string literal whose opening '"', and the \p customDelimiterLen
+/// '#' before it, have already been consumed.
+///
+/// Only '"', '\\' and line breaks matter inside a literal, so the lexer jumps
+/// between them with a vectorized search. The token records whether any
+/// escape was seen; GetStringLiteralValue() uses that to return literals
+/// without escapes straight from the buffer.
+void Lexer::LexStrLiteral(const char *tokStart, unsigned customDelimiterLen) {
+  assert(curPtr[-1] == '"' && "Unexpected start");
+
+  bool isMultiline = curPtr[0] == '"' && curPtr[1] == '"';
+  if (isMultiline) curPtr += 2;
+
+  bool hasEscapes = false;
+  while (true) {
+    const char *ptr = ch::FindFirstOf(curPtr, bufferEnd, '"', '\\', '\n', '\r');
+    if (ptr == bufferEnd) {
+      // TODO: Diagnose the unterminated string.
+      curPtr = bufferEnd;
+      return CreateToken(tk::unk, tokStart);
+    }
+
+    switch (*ptr) {
+      case '\n':
+      case '\r':
+        if (!isMultiline) {
+          // TODO: Diagnose the unterminated string.
+          curPtr = ptr;
+          return CreateToken(tk::unk, tokStart);
+        }
+        curPtr = ptr + 1;
+        break;
+
+      case '\\': {
+        curPtr = ptr + 1;
+        // In a raw string, only '\' followed by the delimiter escapes.
+        if (!HasCustomDelimiter(curPtr, customDelimiterLen)) break;
+        curPtr += customDelimiterLen;
+        hasEscapes = true;
+        // Skip the escaped character so that '\"' does not end the literal.
+        // A single-line literal cannot continue on the next line.
+        if (*curPtr == '\n' || *curPtr == '\r') {
+          if (!isMultiline) {
+            // TODO: Diagnose the unterminated string.
+            return CreateToken(tk::unk, tokStart);
+          }
+        } else if (curPtr != bufferEnd) {
+          ++curPtr;
+        }
+        break;
+      }
+
+      case '"': {
+        curPtr = ptr + 1;
+        if (isMultiline) {
+          if (ptr[1] != '"' || ptr[2] != '"') break;
+          curPtr = ptr + 3;
+        }
+        if (!HasCustomDelimiter(curPtr, customDelimiterLen)) break;
+        curPtr += customDelimiterLen;
+        CreateToken(tk::string_literal, tokStart);
+        if (nextToken.Is(tk::string_literal))
+          nextToken.setStringLiteral(isMultiline, customDelimiterLen,
+                                     hasEscapes);
+        return;
+      }
+    }
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// String literal values
+//===----------------------------------------------------------------------===//
+
+/// Decode the escape sequence after a '\' and its delimiter at \p ptr into
+/// \p out. Return the character after the sequence.
+static const char *DecodeEscape(const char *ptr, const char *end, char *&out) {
+  switch (*ptr) {
+    case '0':
+      *out++ = '\0';
+      return ptr + 1;
+    case 't':
+      *out++ = '\t';
+      return ptr + 1;
+    case 'n':
+      *out++ = '\n';
+      return ptr + 1;
+    case 'r':
+      *out++ = '\r';
+      return ptr + 1;
+    case 'u': {
+      // \u{1-8 hex digits}
+      if (end - ptr > 1 && ptr[1] == '{') {
+        const char *digits = ptr + 2;
+        const char *digitsEnd = digits;
+        uint32_t codePoint = 0;
+        while (digitsEnd != end && isHexDigit(*digitsEnd) &&
+               digitsEnd - digits < 8) {
+          codePoint = codePoint * 16 + llvm::hexDigitValue(*digitsEnd);
+          ++digitsEnd;
+        }
+        if (digitsEnd != digits && digitsEnd != end && *digitsEnd == '}' &&
+            llvm::ConvertCodePointToUTF8(codePoint, out))
+          return digitsEnd + 1;
+      }
+      // TODO: Diagnose the invalid escape; keep its text.
+      *out++ = 'u';
+      return ptr + 1;
+    }
+    default:
+      // '\\', '"', '\'' and, until they are diagnosed, invalid escapes stand
+      // for themselves.
+      *out++ = *ptr;
+      return ptr + 1;
+  }
+}
+
+StringRef stone::analysis::GetStringLiteralValue(const Token &tok,
+                                                 syntax::ASTContext &ac) {
+  assert(tok.Is(tk::string_literal) && "not a string literal");
+  unsigned delimiterLen = tok.GetCustomDelimiterLen();
+  unsigned quoteLen = tok.IsMultilineString() ? 3 : 1;
+  StringRef body = tok.GetRawText()
+                       .drop_front(delimiterLen + quoteLen)
+                       .drop_back(delimiterLen + quoteLen);
+
+  // The common case needs no copy.
+  if (!tok.IsMultilineString() && !tok.HasEscapes()) return body;
+
+  // A multiline literal starts on the line after the opening quotes and ends
+  // on the line before the closing ones, and every line loses the
+  // indentation of the closing quotes.
+  StringRef indent;
+  if (tok.IsMultilineString()) {
+    if (body.startswith("\r\n"))
+      body = body.drop_front(2);
+    else if (body.startswith("\n") || body.startswith("\r"))
+      body = body.drop_front(1);
+
+    size_t lastLine = body.find_last_of("\n\r");
+    StringRef lastLineText =
+        lastLine == StringRef::npos ? body : body.substr(lastLine + 1);
+    if (lastLineText.find_first_not_of(" \t") == StringRef::npos) {
+      indent = lastLineText;
+      body = body.drop_back(lastLineText.size());
+      if (body.endswith("\r\n"))
+        body = body.drop_back(2);
+      else if (body.endswith("\n") || body.endswith("\r"))
+        body = body.drop_back(1);
+    }
+  }
+
+  // Decoding never makes the text longer.
+  char *start = static_cast<char *>(ac.Allocate(body.size(), 1));
+  char *out = start;
+  const char *ptr = body.begin();
+  const char *end = body.end();
+  bool atLineStart = tok.IsMultilineString();
+  while (ptr != end) {
+    if (atLineStart) {
+      // TODO: Diagnose a line that is not indented like the closing quotes.
+      if (StringRef(ptr, end - ptr).startswith(indent)) ptr += indent.size();
+      atLineStart = false;
+      continue;
+    }
+    char c = *ptr;
+    if (c == '\r' || c == '\n') {
+      // Line breaks are normalized to '\n'.
+      ptr += (c == '\r' && ptr + 1 != end && ptr[1] == '\n') ? 2 : 1;
+      *out++ = '\n';
+      atLineStart = true;
+      continue;
+    }
+    if (c != '\\' || !HasCustomDelimiter(ptr + 1, delimiterLen) ||
+        end - ptr <= delimiterLen + 1) {
+      *out++ = c;
+      ++ptr;
+      continue;
+    }
+    ptr += 1 + delimiterLen;
+    if (*ptr == '\n' || *ptr == '\r') {
+      // A '\' at the end of a line joins it with the next one.
+      ptr += (*ptr == '\r' && ptr + 1 != end && ptr[1] == '\n') ? 2 : 1;
+      atLineStart = true;
+      continue;
+    }
+    ptr = DecodeEscape(ptr, end, out);
+  }
+  return StringRef(start, out - start);
+}
 
 void Lexer::Diagnose() {}
 
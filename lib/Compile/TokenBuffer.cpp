@@ -0,0 +1,65 @@
+#include "stone/Compile/TokenBuffer.h"
+
+#include <algorithm>
+
+using namespace stone;
+using namespace stone::analysis;
+
+void TokenBuffer::Push(tk kind, unsigned offset, unsigned length,
+                       uint8_t flags, unsigned identifierHash) {
+  assert(buffer.size() <= UINT32_MAX && "buffer too large for 32-bit offsets");
+  assert(offset + length <= buffer.size() && "token is not in the buffer");
+
+  unsigned slot = numTokens & ChunkMask;
+  if (slot == 0) chunks.push_back(alloc.Allocate<Chunk>());
+  Chunk &chunk = *chunks.back();
+
+  chunk.kinds[slot] = uint8_t(kind);
+  chunk.flags[slot] = flags;
+  chunk.offsets[slot] = offset;
+  chunk.lengths[slot] = length;
+  chunk.hashes[slot] = identifierHash;
+  ++numTokens;
+}
+
+unsigned TokenBuffer::LowerBound(unsigned offset, unsigned from) const {
+  // Offsets increase with the index, so this is a binary search.
+  unsigned count = numTokens - from;
+  while (count > 0) {
+    unsigned half = count / 2;
+    if (GetOffset(from + half) < offset) {
+      from += half + 1;
+      count -= half + 1;
+    } else {
+      count = half;
+    }
+  }
+  return from;
+}
+
+llvm::Optional<uint64_t> TokenBuffer::GetIntegerValue(unsigned index) const {
+  auto it = std::lower_bound(
+      integerValues.begin(), integerValues.end(), index,
+      [](const std::pair<unsigned, uint64_t> &entry, unsigned index) {
+        return entry.first < index;
+      });
+  if (it == integerValues.end() || it->first != index) return llvm::None;
+  return it->second;
+}
+
+Token TokenBuffer::GetToken(unsigned index) const {
+  uint8_t flags = GetFlags(index);
+  Token tok(GetKind(index), GetRawText(index));
+  tok.SetAtStartOfLine(flags & AtStartOfLine);
+  if (flags & EscapedIdentifier) tok.SetEscapedIdentifier(true);
+  tok.SetIdentifierHash(GetIdentifierHash(index));
+  if (tok.Is(tk::string_literal)) {
+    // The custom delimiter is the run of '#' that opens the literal, so it
+    // does not need a slot of its own.
+    StringRef text = tok.GetRawText();
+    unsigned customDelimiterLen = text.size() - text.ltrim('#').size();
+    tok.setStringLiteral(flags & MultilineString, customDelimiterLen,
+                         flags & HasEscapes);
+  }
+  return tok;
+}
@@ -1,6 +1,8 @@
 #include "stone/Core/ASTContext.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <memory>
 
 #include "llvm/ADT/DenseMap.h"
@@ -9,17 +11,24 @@
 #include "llvm/ADT/StringSwitch.h"
 #include "llvm/Support/Allocator.h"
 #include "llvm/Support/Compiler.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FormatVariadic.h"
 
 using namespace stone;
 using namespace stone::syntax;
 
+/// The instanceID of the next ASTContext. IDs start at 1, so that 0 marks an
+/// unused per-thread arena slot.
+static std::atomic<uint64_t> NextInstanceID{1};
+
 ASTContext::ASTContext(const stone::Context &ctx,
                        const SearchPathOptions &spOpts, SrcMgr &sm)
     : ctx(ctx),
       searchPathOpts(spOpts),
       sm(sm),
       identifiers(ctx.GetLangOptions()),
-      stats(*this) {
+      stats(*this),
+      instanceID(NextInstanceID.fetch_add(1, std::memory_order_relaxed)) {
   builtin.Init(*this);
 }
 
@@ -28,8 +37,169 @@ ASTContext::~ASTContext() {}
 Identifier &ASTContext::GetIdentifier(llvm::StringRef name) {
   return identifiers.Get(name);
 }
+Identifier &ASTContext::GetIdentifier(llvm::StringRef name, unsigned hash) {
+  return identifiers.Get(name, hash);
+}
+ASTContext::ThreadArenas::ThreadArenas(SlabTable &nodeSlabs) {
+  for (ArenaKind kind : {ArenaKind::Decl, ArenaKind::Expr, ArenaKind::Stmt})
+    arenas[unsigned(kind)].SetSlabTable(nodeSlabs);
+}
+
+/// The number of ASTContexts whose arenas a thread finds without a lock.
+static constexpr unsigned NumThreadArenaSlots = 4;
+
+ASTContext::ThreadArenas &ASTContext::GetThreadArenas() const {
+  struct Slot {
+    uint64_t ownerID = 0;
+    ThreadArenas *arenas = nullptr;
+  };
+  static thread_local Slot slots[NumThreadArenaSlots];
+  static thread_local unsigned nextVictim = 0;
+
+  for (Slot &slot : slots) {
+    if (slot.ownerID == instanceID) return *slot.arenas;
+  }
+
+  // A thread whose slot was taken by another context finds its arenas
+  // again here, so it does not start new slabs every time it comes back.
+  // A new thread may be given the ID of one that has exited, and its arenas
+  // with it; the two never allocate at the same time.
+  ThreadArenas *arenas = nullptr;
+  {
+    std::thread::id self = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock(threadArenasMutex);
+    for (const auto &existing : threadArenas) {
+      if (existing->owner == self) {
+        arenas = existing.get();
+        break;
+      }
+    }
+    if (!arenas) {
+      arenas = new ThreadArenas(nodeSlabs);
+      arenas->owner = self;
+      threadArenas.emplace_back(arenas);
+    }
+  }
+  Slot &slot = slots[nextVictim++ % NumThreadArenaSlots];
+  slot.ownerID = instanceID;
+  slot.arenas = arenas;
+  return *arenas;
+}
+
+ArenaUsage ASTContext::GetArenaUsage(ArenaKind kind) const {
+  std::lock_guard<std::mutex> lock(threadArenasMutex);
+  ArenaUsage usage;
+  for (const auto &arenas : threadArenas)
+    usage += arenas->arenas[unsigned(kind)].GetUsage();
+  return usage;
+}
+
+unsigned ASTContext::GetNumThreadArenas() const {
+  std::lock_guard<std::mutex> lock(threadArenasMutex);
+  return threadArenas.size();
+}
+
 size_t ASTContext::GetSizeOfMemUsed() const {
-  return bumpAlloc.getTotalMemory();
+  std::lock_guard<std::mutex> lock(threadArenasMutex);
+  size_t size = 0;
+  for (const auto &arenas : threadArenas) {
+    for (const Arena &arena : arenas->arenas) size += arena.GetTotalMemory();
+  }
+  return size;
 }
 
-void ASTContextStats::Print() const {}
+llvm::BumpPtrAllocator &ASTContext::GetAllocator() const {
+  return GetThreadArenas().arenas[unsigned(ArenaKind::Other)].GetAllocator();
+}
+
+llvm::StringRef ASTContext::CopyString(llvm::StringRef str) const {
+  char *copy = Allocate<char>(str.size(), ArenaKind::String);
+  std::memcpy(copy, str.data(), str.size());
+  return llvm::StringRef(copy, str.size());
+}
+
+llvm::StringRef stone::syntax::GetArenaKindName(ArenaKind kind) {
+  switch (kind) {
+    case ArenaKind::Decl:
+      return "decls";
+    case ArenaKind::Expr:
+      return "exprs";
+    case ArenaKind::Stmt:
+      return "stmts";
+    case ArenaKind::Type:
+      return "types";
+    case ArenaKind::String:
+      return "strings";
+    case ArenaKind::Other:
+      return "other";
+  }
+  llvm_unreachable("bad arena kind");
+}
+
+//===----------------------------------------------------------------------===//
+// Stats
+//===----------------------------------------------------------------------===//
+void ASTContextStats::Sample(llvm::StringRef phase) {
+  MemorySample sample;
+  sample.phase = phase.str();
+  sample.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  for (unsigned i = 0; i != NumArenaKinds; ++i)
+    sample.totalMemory[i] = ac.GetArenaUsage(ArenaKind(i)).totalMemory;
+  sample.totalMemory[NumArenaKinds] = ac.GetIdentifierArenaUsage().totalMemory;
+  samples.push_back(std::move(sample));
+}
+
+void ASTContextStats::GetData(llvm::json::Object &data) const {
+  auto toObject = [](const ArenaUsage &usage) {
+    return llvm::json::Object{
+        {"bytesAllocated", int64_t(usage.bytesAllocated)},
+        {"totalMemory", int64_t(usage.totalMemory)},
+        {"slabs", int64_t(usage.numSlabs)},
+        {"wastedBytes", int64_t(usage.GetWastedBytes())},
+        {"peakMemory", int64_t(usage.peakMemory)},
+    };
+  };
+
+  // Identifiers live in the arenas of the identifier table, and are
+  // reported next to the arenas of the context.
+  llvm::json::Object arenas;
+  ArenaUsage total;
+  for (unsigned i = 0; i != NumArenaKinds; ++i) {
+    ArenaUsage usage = ac.GetArenaUsage(ArenaKind(i));
+    arenas[GetArenaKindName(ArenaKind(i))] = toObject(usage);
+    total += usage;
+  }
+  ArenaUsage identifiers = ac.GetIdentifierArenaUsage();
+  arenas["identifiers"] = toObject(identifiers);
+  total += identifiers;
+  data["arenas"] = std::move(arenas);
+  data["total"] = toObject(total);
+  data["threads"] = int64_t(ac.GetNumThreadArenas());
+
+  if (samples.empty()) return;
+  llvm::json::Array samplesData;
+  for (const MemorySample &sample : samples) {
+    llvm::json::Object totalMemory;
+    for (unsigned i = 0; i != NumArenaKinds; ++i)
+      totalMemory[GetArenaKindName(ArenaKind(i))] =
+          int64_t(sample.totalMemory[i]);
+    totalMemory["identifiers"] = int64_t(sample.totalMemory[NumArenaKinds]);
+    samplesData.push_back(llvm::json::Object{
+        {"phase", sample.phase},
+        {"seconds", sample.seconds},
+        {"totalMemory", std::move(totalMemory)},
+    });
+  }
+  data["samples"] = std::move(samplesData);
+}
+
+/// Print the memory of each arena of the context. The peak of an arena is
+/// the most memory it has held; samples, if any, show how it got there.
+void ASTContextStats::Print() const {
+  llvm::json::Object data;
+  GetData(data);
+  os << "\n*** AST Context Stats: " << '\n';
+  os << llvm::formatv("{0:2}", llvm::json::Value(std::move(data))) << '\n';
+}
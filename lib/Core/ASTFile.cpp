@@ -0,0 +1,333 @@
+#include "stone/Core/ASTFile.h"
+
+#include <cstring>
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/DJB.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/MathExtras.h"
+#include "stone/Core/ASTContext.h"
+#include "stone/Core/Decl.h"
+#include "stone/Core/FileMgr.h"
+#include "stone/Core/SrcMgr.h"
+
+using namespace stone;
+using namespace stone::syntax;
+
+//===----------------------------------------------------------------------===//
+// Format
+//===----------------------------------------------------------------------===//
+
+// The image is a header followed by four tables, all little-endian so that
+// an image can be shared between hosts:
+//
+//   DiskString[numStrings]     identifiers and file names
+//   char[stringDataSize]       the text of the strings
+//   DiskDecl[numDecls]         the decls; the members of a context are
+//                              adjacent, so a context names them by range
+//   DiskLookup[numBuckets]     (parent, name) -> decl, open addressing
+//
+// The records are built of unaligned little-endian integers, so they are
+// used in place whatever the alignment of the buffer.
+namespace {
+using ulittle32_t = llvm::support::ulittle32_t;
+
+struct DiskHeader {
+  char magic[8];
+  ulittle32_t version;
+  ulittle32_t moduleName;
+  ulittle32_t numStrings;
+  ulittle32_t stringsOffset;
+  ulittle32_t stringDataOffset;
+  ulittle32_t stringDataSize;
+  ulittle32_t numDecls;
+  ulittle32_t declsOffset;
+  ulittle32_t numBuckets;
+  ulittle32_t bucketsOffset;
+  ulittle32_t firstModuleMember;
+  ulittle32_t numModuleMembers;
+};
+
+struct DiskString {
+  ulittle32_t offset;
+  ulittle32_t length;
+};
+
+struct DiskDecl {
+  ulittle32_t kind;
+  ulittle32_t name;
+  /// The location of the decl, as a file name and an offset in the file.
+  ulittle32_t file;
+  ulittle32_t offset;
+  ulittle32_t parent;
+  ulittle32_t firstMember;
+  ulittle32_t numMembers;
+};
+
+/// A bucket is empty if decl is 0.
+struct DiskLookup {
+  ulittle32_t hash;
+  ulittle32_t decl;
+};
+}  // namespace
+
+static const char ASTFileMagic[8] = {'S', 'T', 'O', 'N', 'E', 'A', 'S', 'T'};
+static constexpr uint32_t ASTFileVersion = 1;
+
+/// Return the lookup hash of the member \p name of \p parent. The hash is
+/// part of the format, so it must not depend on the host.
+static uint32_t HashMember(ASTFile::DeclID parent, llvm::StringRef name) {
+  return llvm::djbHash(name, 5381 + parent * 0x9E3779B1u);
+}
+
+//===----------------------------------------------------------------------===//
+// Writing
+//===----------------------------------------------------------------------===//
+
+void ASTFile::Write(const DeclContext &module, llvm::StringRef moduleName,
+                    ASTContext &astCtx, llvm::raw_ostream &os) {
+  SrcMgr &sm = astCtx.GetSrcMgr();
+
+  llvm::StringMap<uint32_t> stringIDs;
+  std::vector<llvm::StringRef> stringList;
+  auto getStringID = [&](llvm::StringRef str) -> uint32_t {
+    if (str.empty()) return 0;
+    auto inserted = stringIDs.insert({str, stringList.size() + 1});
+    if (inserted.second) stringList.push_back(inserted.first->getKey());
+    return inserted.first->second;
+  };
+  uint32_t moduleNameID = getStringID(moduleName);
+
+  // Number the decls breadth first, so that the members of each context
+  // get consecutive IDs; entry 0 of members is the module.
+  std::vector<const Decl *> declList;
+  std::vector<std::pair<DeclID, unsigned>> members(1);
+  auto addMembers = [&](const DeclContext &dc, DeclID parent) {
+    DeclID first = declList.size() + 1;
+    for (Decl *d = dc.GetFirstDecl(); d; d = d->GetNextDeclInContext())
+      declList.push_back(d);
+    unsigned count = declList.size() + 1 - first;
+    members[parent] = {count ? first : 0, count};
+  };
+  addMembers(module, 0);
+  for (DeclID id = 1; id <= declList.size(); ++id) {
+    members.emplace_back(0, 0);
+    if (const DeclContext *dc = declList[id - 1]->GetAsDeclContext())
+      addMembers(*dc, id);
+  }
+
+  std::vector<DiskDecl> diskDecls(declList.size());
+  std::vector<std::pair<DeclID, uint32_t>> namedDecls;
+  for (DeclID id = 1; id <= declList.size(); ++id) {
+    const Decl *d = declList[id - 1];
+    DiskDecl &record = diskDecls[id - 1];
+    std::memset(&record, 0, sizeof(record));
+    record.kind = d->GetKind();
+    if (Identifier *name = d->GetDeclName().GetAsIdentifier()) {
+      record.name = getStringID(name->GetName());
+      namedDecls.emplace_back(id, record.name);
+    }
+    if (d->GetLoc().isValid()) {
+      std::pair<SrcID, unsigned> decomposed =
+          sm.getDecomposedLoc(d->GetLoc());
+      if (const SrcFile *file = sm.getSrcFileForID(decomposed.first)) {
+        record.file = getStringID(file->getName());
+        record.offset = decomposed.second;
+      }
+    }
+    record.firstMember = members[id].first;
+    record.numMembers = members[id].second;
+  }
+  // The parents follow from the member ranges.
+  for (DeclID id = 0; id != members.size(); ++id) {
+    for (unsigned i = 0; i != members[id].second; ++i)
+      diskDecls[members[id].first + i - 1].parent = id;
+  }
+
+  // Keep the table at most half full, so that probe sequences stay short.
+  uint32_t numBuckets =
+      namedDecls.empty() ? 0 : llvm::NextPowerOf2(namedDecls.size() * 2 - 1);
+  std::vector<DiskLookup> diskBuckets(numBuckets);
+  std::memset(diskBuckets.data(), 0, numBuckets * sizeof(DiskLookup));
+  for (const auto &named : namedDecls) {
+    DiskLookup entry;
+    entry.hash = HashMember(diskDecls[named.first - 1].parent,
+                            stringList[named.second - 1]);
+    entry.decl = named.first;
+    uint32_t i = entry.hash & (numBuckets - 1);
+    while (diskBuckets[i].decl != 0) i = (i + 1) & (numBuckets - 1);
+    diskBuckets[i] = entry;
+  }
+
+  std::vector<DiskString> diskStrings(stringList.size());
+  uint32_t stringDataSize = 0;
+  for (unsigned i = 0; i != stringList.size(); ++i) {
+    diskStrings[i].offset = stringDataSize;
+    diskStrings[i].length = stringList[i].size();
+    stringDataSize += stringList[i].size();
+  }
+
+  DiskHeader header;
+  std::memcpy(header.magic, ASTFileMagic, sizeof(ASTFileMagic));
+  header.version = ASTFileVersion;
+  header.moduleName = moduleNameID;
+  header.numStrings = diskStrings.size();
+  header.stringsOffset = sizeof(DiskHeader);
+  header.stringDataOffset =
+      header.stringsOffset + diskStrings.size() * sizeof(DiskString);
+  header.stringDataSize = stringDataSize;
+  header.numDecls = diskDecls.size();
+  header.declsOffset = header.stringDataOffset + stringDataSize;
+  header.numBuckets = numBuckets;
+  header.bucketsOffset =
+      header.declsOffset + diskDecls.size() * sizeof(DiskDecl);
+  header.firstModuleMember = members[0].first;
+  header.numModuleMembers = members[0].second;
+
+  os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  os.write(reinterpret_cast<const char *>(diskStrings.data()),
+           diskStrings.size() * sizeof(DiskString));
+  for (llvm::StringRef str : stringList) os << str;
+  os.write(reinterpret_cast<const char *>(diskDecls.data()),
+           diskDecls.size() * sizeof(DiskDecl));
+  os.write(reinterpret_cast<const char *>(diskBuckets.data()),
+           diskBuckets.size() * sizeof(DiskLookup));
+}
+
+//===----------------------------------------------------------------------===//
+// Reading
+//===----------------------------------------------------------------------===//
+
+llvm::ErrorOr<std::unique_ptr<ASTFile>> ASTFile::Load(llvm::StringRef path,
+                                                      ASTContext &astCtx) {
+  auto bufferOrErr =
+      astCtx.GetSrcMgr().getFileMgr().getBufferForFile(path, false);
+  if (!bufferOrErr) return bufferOrErr.getError();
+  return Create(std::move(*bufferOrErr), astCtx);
+}
+
+llvm::ErrorOr<std::unique_ptr<ASTFile>> ASTFile::Create(
+    std::unique_ptr<llvm::MemoryBuffer> buffer, ASTContext &astCtx) {
+  // Only the header and the sizes of the tables are checked here, so that
+  // opening a file does not touch every page of it. The records are checked
+  // when they are used.
+  llvm::StringRef data = buffer->getBuffer();
+  auto invalid = std::make_error_code(std::errc::invalid_argument);
+  if (data.size() < sizeof(DiskHeader)) return invalid;
+  const auto &header = *reinterpret_cast<const DiskHeader *>(data.data());
+  auto fits = [&](uint32_t offset, uint64_t size) {
+    return offset + size <= data.size();
+  };
+  if (std::memcmp(header.magic, ASTFileMagic, sizeof(ASTFileMagic)) ||
+      header.version != ASTFileVersion ||
+      !fits(header.stringsOffset,
+            uint64_t(header.numStrings) * sizeof(DiskString)) ||
+      !fits(header.stringDataOffset, header.stringDataSize) ||
+      !fits(header.declsOffset, uint64_t(header.numDecls) * sizeof(DiskDecl)) ||
+      !fits(header.bucketsOffset,
+            uint64_t(header.numBuckets) * sizeof(DiskLookup)) ||
+      (header.numBuckets && !llvm::isPowerOf2_32(header.numBuckets)) ||
+      uint64_t(header.firstModuleMember) + header.numModuleMembers >
+          uint64_t(header.numDecls) + 1)
+    return invalid;
+
+  std::unique_ptr<ASTFile> file(new ASTFile(std::move(buffer), astCtx));
+  file->strings = data.data() + header.stringsOffset;
+  file->stringData =
+      data.substr(header.stringDataOffset, header.stringDataSize);
+  file->decls = data.data() + header.declsOffset;
+  file->buckets = data.data() + header.bucketsOffset;
+  file->numStrings = header.numStrings;
+  file->numDecls = header.numDecls;
+  file->numBuckets = header.numBuckets;
+  file->moduleName = header.moduleName;
+  file->moduleMembers = {header.firstModuleMember, header.numModuleMembers};
+  return file;
+}
+
+llvm::StringRef ASTFile::GetString(uint32_t id) const {
+  if (id == 0 || id > numStrings) return llvm::StringRef();
+  const auto &str = reinterpret_cast<const DiskString *>(strings)[id - 1];
+  if (uint64_t(str.offset) + str.length > stringData.size())
+    return llvm::StringRef();
+  return stringData.substr(str.offset, str.length);
+}
+
+SrcLoc ASTFile::GetLoc(uint32_t file, uint32_t offset) {
+  if (file == 0) return SrcLoc();
+  SrcMgr &sm = astCtx.GetSrcMgr();
+  auto inserted = files.insert({file, SrcID()});
+  if (inserted.second) {
+    // A file that is gone leaves the decls in it without a location.
+    if (const SrcFile *entry = sm.getFileMgr().getFile(GetString(file)))
+      inserted.first->second = sm.getOrCreateSrcID(entry, src::C_User);
+  }
+  SrcID srcID = inserted.first->second;
+  if (srcID.isInvalid() || offset > sm.getSrcIDSize(srcID)) return SrcLoc();
+  return sm.getLocForStartOfFile(srcID).getLocWithOffset(offset);
+}
+
+std::pair<ASTFile::DeclID, unsigned> ASTFile::GetMemberIDs(
+    DeclID parent) const {
+  if (parent == 0) return moduleMembers;
+  if (parent > numDecls) return {0, 0};
+  const auto &record = reinterpret_cast<const DiskDecl *>(decls)[parent - 1];
+  if (uint64_t(record.firstMember) + record.numMembers > uint64_t(numDecls) + 1)
+    return {0, 0};
+  return {record.firstMember, record.numMembers};
+}
+
+Decl *ASTFile::GetDecl(DeclID id) {
+  if (id == 0 || id > numDecls) return nullptr;
+  auto found = materialized.find(id);
+  if (found != materialized.end()) return found->second;
+
+  const auto &record = reinterpret_cast<const DiskDecl *>(decls)[id - 1];
+  // Members have higher IDs than their context, which bounds the recursion
+  // even in a damaged file.
+  DeclContext *dc = nullptr;
+  if (record.parent != 0) {
+    if (record.parent >= id) return nullptr;
+    Decl *parent = GetDecl(record.parent);
+    dc = parent ? parent->GetAsDeclContext() : nullptr;
+    if (!dc) return nullptr;
+  }
+
+  DeclName name;
+  if (record.name != 0) {
+    llvm::StringRef str = GetString(record.name);
+    if (str.empty()) return nullptr;
+    name = &astCtx.GetIdentifier(str);
+  }
+  SrcLoc loc = GetLoc(record.file, record.offset);
+
+  Decl *d = nullptr;
+  switch (record.kind) {
+    case decl::Space:
+      d = SpaceDecl::CreateDeserialized(astCtx, id, dc, loc, name);
+      break;
+    default:
+      // Other kinds of decls cannot be created yet.
+      return nullptr;
+  }
+  materialized[id] = d;
+  return d;
+}
+
+void ASTFile::Lookup(llvm::StringRef name,
+                     llvm::SmallVectorImpl<Decl *> &results, DeclID parent) {
+  if (numBuckets == 0) return;
+  uint32_t hash = HashMember(parent, name);
+  const auto *table = reinterpret_cast<const DiskLookup *>(buckets);
+  for (uint32_t i = hash & (numBuckets - 1), numProbes = 0;
+       numProbes != numBuckets; i = (i + 1) & (numBuckets - 1), ++numProbes) {
+    const DiskLookup &entry = table[i];
+    if (entry.decl == 0) return;
+    if (entry.hash != hash || entry.decl > numDecls) continue;
+    const auto &record =
+        reinterpret_cast<const DiskDecl *>(decls)[entry.decl - 1];
+    if (record.parent != parent || GetString(record.name) != name) continue;
+    if (Decl *d = GetDecl(entry.decl)) results.push_back(d);
+  }
+}
@@ -0,0 +1,79 @@
+#include "stone/Core/Arena.h"
+
+#include <cstdlib>
+#include <new>
+
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+using namespace stone;
+
+static char *AllocateAligned(size_t size, size_t align) {
+#ifdef _WIN32
+  void *ptr = _aligned_malloc(size, align);
+#else
+  void *ptr = nullptr;
+  if (posix_memalign(&ptr, align, size) != 0) ptr = nullptr;
+#endif
+  if (!ptr) llvm::report_bad_alloc_error("slab allocation failed");
+  return static_cast<char *>(ptr);
+}
+
+static void FreeAligned(char *ptr) {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  std::free(ptr);
+#endif
+}
+
+SlabTable::SlabTable() : slabs(new std::atomic<char *>[MaxSlabs]) {}
+
+SlabTable::~SlabTable() {
+  for (unsigned i = 0, e = GetNumSlabs(); i != e; ++i)
+    FreeAligned(slabs[i].load(std::memory_order_relaxed));
+}
+
+char *SlabTable::AllocateSlab(size_t size) {
+  assert(size % SlabSize == 0 && "slabs are a multiple of SlabSize");
+  unsigned index = numSlabs.fetch_add(1, std::memory_order_relaxed);
+  if (index >= MaxSlabs)
+    llvm::report_fatal_error("too much AST memory for 32-bit references");
+
+  char *slab = AllocateAligned(size, SlabSize);
+  new (slab) Header{this, index};
+  slabs[index].store(slab, std::memory_order_release);
+  return slab;
+}
+
+static char *AlignPtr(char *ptr, size_t align) {
+  assert(llvm::isPowerOf2_64(align) && "alignment is not a power of two");
+  return reinterpret_cast<char *>((uintptr_t(ptr) + align - 1) & ~(align - 1));
+}
+
+void *Arena::AllocateFromTable(size_t size, size_t align) {
+  char *ptr = AlignPtr(cur, align);
+  if (cur && ptr + size <= end) {
+    cur = ptr + size;
+    return ptr;
+  }
+
+  // A fresh slab replaces the current one, unless the allocation needs a
+  // larger slab: that slab holds it alone and the current one stays in use.
+  size_t paddedSize = sizeof(SlabTable::Header) + size + align - 1;
+  size_t slabSize = llvm::alignTo(paddedSize, SlabTable::SlabSize);
+  char *slab = table->AllocateSlab(slabSize);
+  tableMemory += slabSize;
+  ++numTableSlabs;
+
+  ptr = AlignPtr(slab + sizeof(SlabTable::Header), align);
+  if (slabSize == SlabTable::SlabSize) {
+    cur = ptr + size;
+    end = slab + slabSize;
+  }
+  return ptr;
+}
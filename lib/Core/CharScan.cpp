@@ -0,0 +1,358 @@
+#include "stone/Core/CharScan.h"
+
+#include <atomic>
+#include <cstdint>
+
+#include "llvm/Support/MathExtras.h"
+#include "stone/Core/Char.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STONE_CHARSCAN_X86 1
+#include <immintrin.h>
+#else
+#define STONE_CHARSCAN_X86 0
+#endif
+
+using namespace stone;
+using namespace stone::ch;
+
+namespace {
+/// One implementation of every scanning routine.
+struct ScanFns {
+  SIMDLevel level;
+  const char *(*skipHorizontalWhitespace)(const char *ptr, const char *end);
+  const char *(*skipIdentifierBody)(const char *ptr, const char *end);
+  const char *(*findFirstOf)(const char *ptr, const char *end, char c0,
+                             char c1, char c2, char c3);
+  size_t (*countLineBreaks)(const char *ptr, const char *end);
+  unsigned *(*findLineStarts)(const char *base, const char *ptr,
+                              const char *end, unsigned *starts);
+};
+}  // namespace
+
+//===----------------------------------------------------------------------===//
+// Scalar
+//===----------------------------------------------------------------------===//
+static const char *ScalarSkipHorizontalWhitespace(const char *ptr,
+                                                  const char *end) {
+  while (ptr != end && isHorizontalWhitespace(*ptr)) ++ptr;
+  return ptr;
+}
+
+static const char *ScalarSkipIdentifierBody(const char *ptr,
+                                            const char *end) {
+  while (ptr != end && isIdentifierBody(*ptr, /*AllowDollar=*/true)) ++ptr;
+  return ptr;
+}
+
+static const char *ScalarFindFirstOf(const char *ptr, const char *end, char c0,
+                                     char c1, char c2, char c3) {
+  for (; ptr != end; ++ptr) {
+    char c = *ptr;
+    if (c == c0 || c == c1 || c == c2 || c == c3) return ptr;
+  }
+  return ptr;
+}
+
+static bool IsLineBreak(const char *ptr, const char *end) {
+  return *ptr == '\n' || (*ptr == '\r' && (ptr + 1 == end || ptr[1] != '\n'));
+}
+
+static size_t ScalarCountLineBreaks(const char *ptr, const char *end) {
+  size_t count = 0;
+  for (; ptr != end; ++ptr) count += IsLineBreak(ptr, end);
+  return count;
+}
+
+/// The vector versions scan from \p ptr but report offsets from \p base, so
+/// that they can hand the tail of the buffer to this one.
+static unsigned *ScalarFindLineStarts(const char *base, const char *ptr,
+                                      const char *end, unsigned *starts) {
+  for (; ptr != end; ++ptr) {
+    if (IsLineBreak(ptr, end)) *starts++ = ptr + 1 - base;
+  }
+  return starts;
+}
+
+static const ScanFns scalarFns = {
+    SIMDLevel::Scalar,     ScalarSkipHorizontalWhitespace,
+    ScalarSkipIdentifierBody, ScalarFindFirstOf,
+    ScalarCountLineBreaks, ScalarFindLineStarts};
+
+#if STONE_CHARSCAN_X86
+//===----------------------------------------------------------------------===//
+// SSE2
+//===----------------------------------------------------------------------===//
+__attribute__((target("sse2"))) static const char *SSE2SkipHorizontalWhitespace(
+    const char *ptr, const char *end) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i formfeed = _mm_set1_epi8('\f');
+  const __m128i vtab = _mm_set1_epi8('\v');
+  while (end - ptr >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+    __m128i ws = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, formfeed), _mm_cmpeq_epi8(v, vtab)));
+    uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(ws)) & 0xFFFF;
+    if (mask) return ptr + llvm::countTrailingZeros(mask);
+    ptr += 16;
+  }
+  return ScalarSkipHorizontalWhitespace(ptr, end);
+}
+
+/// Return a mask of the bytes of \p v that are in [lo, hi]. The compares are
+/// signed, so bytes >= 0x80 are never in an ASCII range.
+__attribute__((target("sse2"))) static inline __m128i SSE2InRange(__m128i v,
+                                                                   char lo,
+                                                                   char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+__attribute__((target("sse2"))) static const char *SSE2SkipIdentifierBody(
+    const char *ptr, const char *end) {
+  const __m128i caseBit = _mm_set1_epi8(0x20);
+  const __m128i under = _mm_set1_epi8('_');
+  const __m128i dollar = _mm_set1_epi8('$');
+  while (end - ptr >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+    // Setting the case bit maps [A-Z] onto [a-z] and nothing else onto it.
+    __m128i letter = SSE2InRange(_mm_or_si128(v, caseBit), 'a', 'z');
+    __m128i digit = SSE2InRange(v, '0', '9');
+    __m128i other =
+        _mm_or_si128(_mm_cmpeq_epi8(v, under), _mm_cmpeq_epi8(v, dollar));
+    __m128i body = _mm_or_si128(_mm_or_si128(letter, digit), other);
+    uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(body)) & 0xFFFF;
+    if (mask) return ptr + llvm::countTrailingZeros(mask);
+    ptr += 16;
+  }
+  return ScalarSkipIdentifierBody(ptr, end);
+}
+
+__attribute__((target("sse2"))) static const char *SSE2FindFirstOf(
+    const char *ptr, const char *end, char c0, char c1, char c2, char c3) {
+  const __m128i v0 = _mm_set1_epi8(c0);
+  const __m128i v1 = _mm_set1_epi8(c1);
+  const __m128i v2 = _mm_set1_epi8(c2);
+  const __m128i v3 = _mm_set1_epi8(c3);
+  while (end - ptr >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+    __m128i hit =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, v0), _mm_cmpeq_epi8(v, v1)),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, v2), _mm_cmpeq_epi8(v, v3)));
+    uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+    if (mask) return ptr + llvm::countTrailingZeros(mask);
+    ptr += 16;
+  }
+  return ScalarFindFirstOf(ptr, end, c0, c1, c2, c3);
+}
+
+/// Return a bit for each of the 16 bytes at \p ptr that ends a line. The
+/// byte after them is loaded too, so that a '\r' at the end is only a line
+/// break if the next block does not start with '\n'.
+__attribute__((target("sse2"))) static inline uint32_t SSE2LineBreakMask(
+    const char *ptr) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+  __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 1));
+  __m128i cr = _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'));
+  __m128i breaks = _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                                _mm_andnot_si128(_mm_cmpeq_epi8(next, nl), cr));
+  return static_cast<uint32_t>(_mm_movemask_epi8(breaks));
+}
+
+__attribute__((target("sse2"))) static size_t SSE2CountLineBreaks(
+    const char *ptr, const char *end) {
+  size_t count = 0;
+  for (; end - ptr > 16; ptr += 16)
+    count += llvm::countPopulation(SSE2LineBreakMask(ptr));
+  return count + ScalarCountLineBreaks(ptr, end);
+}
+
+__attribute__((target("sse2"))) static unsigned *SSE2FindLineStarts(
+    const char *base, const char *ptr, const char *end, unsigned *starts) {
+  for (; end - ptr > 16; ptr += 16) {
+    unsigned offset = ptr + 1 - base;
+    for (uint32_t mask = SSE2LineBreakMask(ptr); mask; mask &= mask - 1)
+      *starts++ = offset + llvm::countTrailingZeros(mask);
+  }
+  return ScalarFindLineStarts(base, ptr, end, starts);
+}
+
+static const ScanFns sse2Fns = {
+    SIMDLevel::SSE2,     SSE2SkipHorizontalWhitespace,
+    SSE2SkipIdentifierBody, SSE2FindFirstOf,
+    SSE2CountLineBreaks, SSE2FindLineStarts};
+
+//===----------------------------------------------------------------------===//
+// AVX2
+//===----------------------------------------------------------------------===//
+__attribute__((target("avx2"))) static const char *AVX2SkipHorizontalWhitespace(
+    const char *ptr, const char *end) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i formfeed = _mm256_set1_epi8('\f');
+  const __m256i vtab = _mm256_set1_epi8('\v');
+  while (end - ptr >= 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr));
+    __m256i ws = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, formfeed),
+                        _mm256_cmpeq_epi8(v, vtab)));
+    uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(ws));
+    if (mask) return ptr + llvm::countTrailingZeros(mask);
+    ptr += 32;
+  }
+  return SSE2SkipHorizontalWhitespace(ptr, end);
+}
+
+__attribute__((target("avx2"))) static inline __m256i AVX2InRange(__m256i v,
+                                                                   char lo,
+                                                                   char hi) {
+  return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+__attribute__((target("avx2"))) static const char *AVX2SkipIdentifierBody(
+    const char *ptr, const char *end) {
+  const __m256i caseBit = _mm256_set1_epi8(0x20);
+  const __m256i under = _mm256_set1_epi8('_');
+  const __m256i dollar = _mm256_set1_epi8('$');
+  while (end - ptr >= 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr));
+    __m256i letter = AVX2InRange(_mm256_or_si256(v, caseBit), 'a', 'z');
+    __m256i digit = AVX2InRange(v, '0', '9');
+    __m256i other = _mm256_or_si256(_mm256_cmpeq_epi8(v, under),
+                                    _mm256_cmpeq_epi8(v, dollar));
+    __m256i body = _mm256_or_si256(_mm256_or_si256(letter, digit), other);
+    uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(body));
+    if (mask) return ptr + llvm::countTrailingZeros(mask);
+    ptr += 32;
+  }
+  return SSE2SkipIdentifierBody(ptr, end);
+}
+
+__attribute__((target("avx2"))) static const char *AVX2FindFirstOf(
+    const char *ptr, const char *end, char c0, char c1, char c2, char c3) {
+  const __m256i v0 = _mm256_set1_epi8(c0);
+  const __m256i v1 = _mm256_set1_epi8(c1);
+  const __m256i v2 = _mm256_set1_epi8(c2);
+  const __m256i v3 = _mm256_set1_epi8(c3);
+  while (end - ptr >= 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr));
+    __m256i hit = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, v0), _mm256_cmpeq_epi8(v, v1)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, v2), _mm256_cmpeq_epi8(v, v3)));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+    if (mask) return ptr + llvm::countTrailingZeros(mask);
+    ptr += 32;
+  }
+  return SSE2FindFirstOf(ptr, end, c0, c1, c2, c3);
+}
+
+__attribute__((target("avx2"))) static inline uint32_t AVX2LineBreakMask(
+    const char *ptr) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr));
+  __m256i next =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr + 1));
+  __m256i cr = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'));
+  __m256i breaks =
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+                      _mm256_andnot_si256(_mm256_cmpeq_epi8(next, nl), cr));
+  return static_cast<uint32_t>(_mm256_movemask_epi8(breaks));
+}
+
+__attribute__((target("avx2,popcnt"))) static size_t AVX2CountLineBreaks(
+    const char *ptr, const char *end) {
+  size_t count = 0;
+  for (; end - ptr > 32; ptr += 32)
+    count += llvm::countPopulation(AVX2LineBreakMask(ptr));
+  return count + SSE2CountLineBreaks(ptr, end);
+}
+
+__attribute__((target("avx2"))) static unsigned *AVX2FindLineStarts(
+    const char *base, const char *ptr, const char *end, unsigned *starts) {
+  for (; end - ptr > 32; ptr += 32) {
+    unsigned offset = ptr + 1 - base;
+    for (uint32_t mask = AVX2LineBreakMask(ptr); mask; mask &= mask - 1)
+      *starts++ = offset + llvm::countTrailingZeros(mask);
+  }
+  return SSE2FindLineStarts(base, ptr, end, starts);
+}
+
+static const ScanFns avx2Fns = {
+    SIMDLevel::AVX2,     AVX2SkipHorizontalWhitespace,
+    AVX2SkipIdentifierBody, AVX2FindFirstOf,
+    AVX2CountLineBreaks, AVX2FindLineStarts};
+#endif
+
+//===----------------------------------------------------------------------===//
+// Dispatch
+//===----------------------------------------------------------------------===//
+static SIMDLevel GetHostSIMDLevel() {
+#if STONE_CHARSCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return SIMDLevel::AVX2;
+  if (__builtin_cpu_supports("sse2")) return SIMDLevel::SSE2;
+#endif
+  return SIMDLevel::Scalar;
+}
+
+static const ScanFns &GetScanFnsForLevel(SIMDLevel level) {
+  switch (level) {
+#if STONE_CHARSCAN_X86
+    case SIMDLevel::AVX2:
+      return avx2Fns;
+    case SIMDLevel::SSE2:
+      return sse2Fns;
+#endif
+    default:
+      return scalarFns;
+  }
+}
+
+/// The selected implementation. Racing first uses store the same value.
+static std::atomic<const ScanFns *> currentScanFns{nullptr};
+
+static const ScanFns &GetScanFns() {
+  const ScanFns *fns = currentScanFns.load(std::memory_order_relaxed);
+  if (LLVM_LIKELY(fns != nullptr)) return *fns;
+  fns = &GetScanFnsForLevel(GetHostSIMDLevel());
+  currentScanFns.store(fns, std::memory_order_relaxed);
+  return *fns;
+}
+
+SIMDLevel stone::ch::GetSIMDLevel() { return GetScanFns().level; }
+
+SIMDLevel stone::ch::SetSIMDLevel(SIMDLevel level) {
+  SIMDLevel host = GetHostSIMDLevel();
+  if (static_cast<unsigned>(level) > static_cast<unsigned>(host)) level = host;
+  const ScanFns &fns = GetScanFnsForLevel(level);
+  currentScanFns.store(&fns, std::memory_order_relaxed);
+  return fns.level;
+}
+
+const char *stone::ch::SkipHorizontalWhitespace(const char *ptr,
+                                                const char *end) {
+  return GetScanFns().skipHorizontalWhitespace(ptr, end);
+}
+
+const char *stone::ch::SkipIdentifierBody(const char *ptr, const char *end) {
+  return GetScanFns().skipIdentifierBody(ptr, end);
+}
+
+const char *stone::ch::FindFirstOf(const char *ptr, const char *end, char c0,
+                                   char c1, char c2, char c3) {
+  return GetScanFns().findFirstOf(ptr, end, c0, c1, c2, c3);
+}
+
+size_t stone::ch::CountLineBreaks(const char *ptr, const char *end) {
+  return GetScanFns().countLineBreaks(ptr, end);
+}
+
+unsigned *stone::ch::FindLineStarts(const char *ptr, const char *end,
+                                    unsigned *starts) {
+  return GetScanFns().findLineStarts(ptr, ptr, end, starts);
+}
@@ -40,7 +40,7 @@ void *Decl::operator new(std::size_t size, const ASTContext &astCtx,
   static_assert(sizeof(unsigned) * 2 >= alignof(Decl),
                 "Decl won't be misaligned");
 
-  void *start = astCtx.Allocate(size + extra + 8);
+  void *start = astCtx.Allocate(size + extra + 8, 8, ArenaKind::Decl);
   void *result = (char *)start + 8;
 
   unsigned *prefixPtr = (unsigned *)result - 2;
@@ -79,7 +79,49 @@ void *Decl::operator new(std::size_t size, const ASTContext &astCtx,
     }
   */
 
-  return ::operator new(size + extra, astCtx);
+  return astCtx.Allocate(size + extra, alignof(Decl), ArenaKind::Decl);
+}
+
+DeclContext *Decl::GetAsDeclContext() {
+  switch (kind) {
+    case decl::Space:
+      return static_cast<SpaceDecl *>(this);
+    case decl::Module:
+      return static_cast<Module *>(this);
+    default:
+      return nullptr;
+  }
+}
+
+DeclName Decl::GetDeclName() const {
+  switch (kind) {
+    case decl::IfConfig:
+    case decl::Block:
+      return DeclName();
+    default:
+      return static_cast<const NamingDecl *>(this)->GetDeclName();
+  }
+}
+
+void DeclContext::AddDecl(Decl *d) {
+  assert(!d->nextDeclInContext && d != GetLastDecl() &&
+         "decl is already in a context");
+  if (Decl *last = GetLastDecl())
+    last->nextDeclInContext = d;
+  else
+    firstDecl = d;
+  lastDecl = d;
+}
+
+SpaceDecl *SpaceDecl::Create(const ASTContext &astCtx, DeclContext *dc,
+                             SrcLoc loc, DeclName name) {
+  return new (astCtx, dc) SpaceDecl(dc, loc, name);
+}
+
+SpaceDecl *SpaceDecl::CreateDeserialized(const ASTContext &astCtx,
+                                         unsigned declID, DeclContext *dc,
+                                         SrcLoc loc, DeclName name) {
+  return new (astCtx, declID) SpaceDecl(dc, loc, name);
 }
 
 // stone::Module *Decl::GetOwningModule() const {
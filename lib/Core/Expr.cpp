@@ -1 +1,11 @@
 #include "stone/Core/Expr.h"
+
+#include "stone/Core/ASTContext.h"
+
+using namespace stone;
+using namespace stone::syntax;
+
+void *Expr::operator new(std::size_t bytes, const ASTContext &astCtx,
+                         unsigned alignment) {
+  return astCtx.Allocate(bytes, alignment, ArenaKind::Expr);
+}
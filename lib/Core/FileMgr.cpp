@@ -19,12 +19,15 @@
 #include "stone/Core/FileMgr.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
 #include <cstdint>
 #include <cstdlib>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallString.h"
@@ -54,6 +57,9 @@ FileMgr::FileMgr(const FileSystemOptions &FSO,
   // If the caller doesn't provide a virtual file system, just grab the real
   // file system.
   if (!this->FS) this->FS = llvm::vfs::getRealFileSystem();
+
+  if (!FileSystemOpts.StatCachePath.empty())
+    StatCache = PersistentStatCache::create(FileSystemOpts.StatCachePath);
 }
 
 FileMgr::~FileMgr() = default;
@@ -264,6 +270,90 @@ const SrcFile *FileMgr::getFile(StringRef Filename, bool openFile,
   return &UFE;
 }
 
+unsigned FileMgr::Prefetch(ArrayRef<StringRef> Filenames,
+                           unsigned NumThreads) {
+  // The names to fetch, with the directory that getFile() will look up for
+  // each. Files that were looked up already have nothing left to fetch.
+  struct Request {
+    StringRef Name;
+    StringRef DirName;
+    std::string Path;
+    std::string DirPath;
+    llvm::ErrorOr<llvm::vfs::Status> Status = std::error_code();
+    llvm::ErrorOr<llvm::vfs::Status> DirStatus = std::error_code();
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  };
+  std::vector<Request> Requests;
+  for (StringRef Name : Filenames) {
+    if (Name.empty() || llvm::sys::path::is_separator(Name.back()) ||
+        SeenFileEntries.count(Name))
+      continue;
+    Request R;
+    R.Name = Name;
+    R.DirName = llvm::sys::path::parent_path(Name);
+    if (R.DirName.empty()) R.DirName = ".";
+    SmallString<128> Path(Name);
+    FixupRelativePath(Path);
+    R.Path = Path.str().str();
+    SmallString<128> DirPath(R.DirName);
+    FixupRelativePath(DirPath);
+    R.DirPath = DirPath.str().str();
+    Requests.push_back(std::move(R));
+  }
+  if (Requests.empty()) return 0;
+
+  // Each thread takes the next file as it finishes one, as the lexer does.
+  if (NumThreads == 0) NumThreads = std::thread::hardware_concurrency();
+  NumThreads = std::max(1u, std::min<unsigned>(NumThreads, Requests.size()));
+
+  // Only the file system is touched here; the maps of the FileMgr are left to
+  // the loop below.
+  std::atomic<unsigned> NextRequest(0);
+  auto FetchFiles = [&]() {
+    for (unsigned i = NextRequest++; i < Requests.size(); i = NextRequest++) {
+      Request &R = Requests[i];
+      R.DirStatus = FS->status(R.DirPath);
+      if (!R.DirStatus || !R.DirStatus->isDirectory()) continue;
+      auto File = FS->openFileForRead(R.Path);
+      if (!File) continue;
+      R.Status = (*File)->status();
+      if (!R.Status || !R.Status->isRegularFile()) continue;
+      uint64_t Size = R.Status->getSize();
+      auto Buffer = (*File)->getBuffer(R.Path, Size,
+                                       /*RequiresNullTerminator=*/true,
+                                       Size < FileSystemOpts.MapThreshold);
+      if (Buffer) R.Buffer = std::move(*Buffer);
+    }
+  };
+
+  std::vector<std::thread> Threads;
+  for (unsigned t = 1; t < NumThreads; ++t) Threads.emplace_back(FetchFiles);
+  FetchFiles();
+  for (auto &Thread : Threads) Thread.join();
+
+  // Let getStatValue() answer the lookups from what was fetched.
+  for (Request &R : Requests) {
+    if (!R.DirStatus || !R.DirStatus->isDirectory()) continue;
+    PrefetchedStats.insert({R.DirName, *R.DirStatus});
+    if (R.Status && R.Status->isRegularFile())
+      PrefetchedStats.insert({R.Name, *R.Status});
+  }
+
+  unsigned NumFetched = 0;
+  for (Request &R : Requests) {
+    const SrcFile *File = getFile(R.Name);
+    if (!File || !R.Buffer || PrefetchedBuffers.count(File)) continue;
+    // A file first seen under another name keeps the size it had then; do not
+    // pair it with contents read since.
+    if (R.Buffer->getBufferSize() != uint64_t(File->getSize())) continue;
+    PrefetchedBuffers[File] = std::move(R.Buffer);
+    ++NumFetched;
+  }
+  // What was not used by now may be out of date by the next lookup.
+  PrefetchedStats.clear();
+  return NumFetched;
+}
+
 const SrcFile *FileMgr::getVirtualFile(StringRef Filename, off_t Size,
                                        time_t ModificationTime) {
   ++NumFileLookups;
@@ -361,17 +451,34 @@ void FileMgr::fillRealPathName(SrcFile *UFE, llvm::StringRef FileName) {
 
 llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> FileMgr::getBufferForFile(
     const SrcFile *Entry, bool isVolatile, bool ShouldCloseOpenFile) {
+  // Hand out the contents that Prefetch() read, unless the caller expects the
+  // file to have changed since.
+  auto Prefetched = PrefetchedBuffers.find(Entry);
+  if (Prefetched != PrefetchedBuffers.end()) {
+    std::unique_ptr<llvm::MemoryBuffer> Buffer = std::move(Prefetched->second);
+    PrefetchedBuffers.erase(Prefetched);
+    if (!isVolatile) {
+      if (ShouldCloseOpenFile) Entry->closeFile();
+      return Buffer;
+    }
+  }
+
   uint64_t FileSize = Entry->getSize();
   // If there's a high enough chance that the file have changed since we
   // got its size, force a stat before opening it.
   if (isVolatile) FileSize = -1;
 
+  // MemoryBuffer never maps a volatile file, so files below the map threshold
+  // are read by passing that on for them too.
+  bool NoMap =
+      isVolatile || uint64_t(Entry->getSize()) < FileSystemOpts.MapThreshold;
+
   StringRef Filename = Entry->getName();
   // If the file is already open, use the open file descriptor.
   if (Entry->File) {
     auto Result =
         Entry->File->getBuffer(Filename, FileSize,
-                               /*RequiresNullTerminator=*/true, isVolatile);
+                               /*RequiresNullTerminator=*/true, NoMap);
     // FIXME: we need a set of APIs that can make guarantees about whether a
     // SrcFile is open or not.
     if (ShouldCloseOpenFile) Entry->closeFile();
@@ -382,12 +489,12 @@ llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> FileMgr::getBufferForFile(
 
   if (FileSystemOpts.WorkingDir.empty())
     return FS->getBufferForFile(Filename, FileSize,
-                                /*RequiresNullTerminator=*/true, isVolatile);
+                                /*RequiresNullTerminator=*/true, NoMap);
 
   SmallString<128> FilePath(Entry->getName());
   FixupRelativePath(FilePath);
   return FS->getBufferForFile(FilePath, FileSize,
-                              /*RequiresNullTerminator=*/true, isVolatile);
+                              /*RequiresNullTerminator=*/true, NoMap);
 }
 
 llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> FileMgr::getBufferForFile(
@@ -407,6 +514,16 @@ llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> FileMgr::getBufferForFile(
 /// do directory look-up instead of file look-up.
 bool FileMgr::getStatValue(StringRef Path, llvm::vfs::Status &Status,
                            bool isFile, std::unique_ptr<llvm::vfs::File> *F) {
+  if (!PrefetchedStats.empty()) {
+    auto Prefetched = PrefetchedStats.find(Path);
+    if (Prefetched != PrefetchedStats.end() &&
+        Prefetched->second.isDirectory() != isFile) {
+      Status = Prefetched->second;
+      PrefetchedStats.erase(Prefetched);
+      return false;
+    }
+  }
+
   // FIXME: FileSystemOpts shouldn't be passed in here, all paths should be
   // absolute!
   if (FileSystemOpts.WorkingDir.empty())
@@ -434,6 +551,7 @@ void FileMgr::invalidateCache(const SrcFile *Entry) {
   assert(Entry && "Cannot invalidate a NULL SrcFile");
 
   SeenFileEntries.erase(Entry->getName());
+  PrefetchedBuffers.erase(Entry);
 
   // SrcFile invalidation should not block future optimizations in the file
   // caches. Possible alternatives are cache truncation (invalidate last N) or
@@ -12,12 +12,18 @@
 
 #include "stone/Core/FileSystemStatCache.h"
 
+#include <chrono>
+#include <cstring>
 #include <utility>
 
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/Support/Chrono.h"
 #include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 
 using namespace stone;
 
@@ -118,3 +124,336 @@ std::error_code MemorizeStatCalls::getStat(StringRef Path,
 
   return std::error_code();
 }
+
+//===----------------------------------------------------------------------===//
+// PersistentStatCache
+//===----------------------------------------------------------------------===//
+
+// The cache file is a header, the directory records, a hash table of paths
+// and the path strings, in host byte order. A file written on a host of the
+// other byte order fails the version check and is ignored.
+namespace {
+struct DiskHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t NumDirs;
+  uint32_t NumBuckets;
+  uint32_t StringsSize;
+};
+
+struct DiskDir {
+  int64_t MTime;
+  uint64_t Device;
+  uint64_t Inode;
+  uint64_t Size;
+  uint32_t Perms;
+  uint32_t PathOffset;
+  uint32_t PathLength;
+  uint32_t Padding;
+};
+
+/// A bucket is empty if PathLength is 0, since only absolute paths are
+/// cached.
+struct DiskBucket {
+  uint64_t Hash;
+  uint32_t PathOffset;
+  uint32_t PathLength;
+  /// The directory that contains the path.
+  uint32_t Parent;
+  /// The directory record of the path, or NoDir if it does not exist.
+  uint32_t Self;
+};
+}  // namespace
+
+static const char StatCacheMagic[8] = {'S', 'T', 'O', 'N', 'E', 'S', 'T', 'C'};
+static constexpr uint32_t StatCacheVersion = 1;
+static constexpr uint32_t NoDir = ~0u;
+
+/// A directory modified this recently is not recorded: a second change
+/// within the resolution of its mtime would go unnoticed.
+static constexpr std::chrono::seconds RacyMTimeWindow(2);
+
+static int64_t GetMTime(const llvm::vfs::Status &Status) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             Status.getLastModificationTime().time_since_epoch())
+      .count();
+}
+
+static PersistentStatCache::DirRecord MakeDirRecord(
+    const llvm::vfs::Status &Status) {
+  PersistentStatCache::DirRecord Dir;
+  Dir.MTime = GetMTime(Status);
+  Dir.Device = Status.getUniqueID().getDevice();
+  Dir.Inode = Status.getUniqueID().getFile();
+  Dir.Size = Status.getSize();
+  Dir.Perms = Status.getPermissions();
+  return Dir;
+}
+
+std::unique_ptr<PersistentStatCache> PersistentStatCache::create(
+    StringRef CachePath) {
+  std::unique_ptr<PersistentStatCache> Cache(
+      new PersistentStatCache(CachePath));
+  auto FileOrErr = llvm::vfs::getRealFileSystem()->getBufferForFile(
+      CachePath, /*FileSize=*/-1, /*RequiresNullTerminator=*/false);
+  if (!FileOrErr) return Cache;
+
+  // Only the sizes of the tables are checked here, so that opening the cache
+  // does not touch every page of it. Offsets into the strings are checked
+  // when they are used.
+  StringRef Data = (*FileOrErr)->getBuffer();
+  DiskHeader Header;
+  if (Data.size() < sizeof(Header)) return Cache;
+  std::memcpy(&Header, Data.data(), sizeof(Header));
+  uint64_t TablesSize = uint64_t(Header.NumDirs) * sizeof(DiskDir) +
+                        uint64_t(Header.NumBuckets) * sizeof(DiskBucket);
+  if (std::memcmp(Header.Magic, StatCacheMagic, sizeof(StatCacheMagic)) ||
+      Header.Version != StatCacheVersion ||
+      !llvm::isPowerOf2_32(Header.NumBuckets) ||
+      sizeof(Header) + TablesSize + Header.StringsSize != Data.size() ||
+      reinterpret_cast<uintptr_t>(Data.data()) % alignof(DiskDir) != 0)
+    return Cache;
+
+  Cache->File = std::move(*FileOrErr);
+  Cache->Dirs = Data.data() + sizeof(Header);
+  Cache->Buckets = Cache->Dirs + Header.NumDirs * sizeof(DiskDir);
+  Cache->Strings = Data.substr(sizeof(Header) + TablesSize);
+  Cache->NumDirs = Header.NumDirs;
+  Cache->NumBuckets = Header.NumBuckets;
+  Cache->DirStates.resize(Header.NumDirs, Unchecked);
+  return Cache;
+}
+
+PersistentStatCache::~PersistentStatCache() {
+  // The cache is only an optimization, so failing to write it is not an
+  // error.
+  if (isDirty()) (void)save();
+}
+
+StringRef PersistentStatCache::getString(uint32_t Offset,
+                                         uint32_t Length) const {
+  if (uint64_t(Offset) + Length > Strings.size()) return StringRef();
+  return Strings.substr(Offset, Length);
+}
+
+StringRef PersistentStatCache::getDirPath(uint32_t Index) const {
+  const auto *Dir = reinterpret_cast<const DiskDir *>(Dirs) + Index;
+  return getString(Dir->PathOffset, Dir->PathLength);
+}
+
+PersistentStatCache::DirRecord PersistentStatCache::getDir(
+    uint32_t Index) const {
+  const auto *Dir = reinterpret_cast<const DiskDir *>(Dirs) + Index;
+  return {Dir->MTime, Dir->Device, Dir->Inode, Dir->Size, Dir->Perms};
+}
+
+bool PersistentStatCache::isDirUnchanged(uint32_t Index,
+                                         llvm::vfs::FileSystem &FS) {
+  if (Index >= NumDirs) return false;
+  if (DirStates[Index] == Unchecked) {
+    DirRecord Dir = getDir(Index);
+    llvm::ErrorOr<llvm::vfs::Status> Status = FS.status(getDirPath(Index));
+    bool Same = Status && Status->isDirectory() &&
+                GetMTime(*Status) == Dir.MTime &&
+                Status->getUniqueID() ==
+                    llvm::sys::fs::UniqueID(Dir.Device, Dir.Inode);
+    DirStates[Index] = Same ? Unchanged : Changed;
+  }
+  return DirStates[Index] == Unchanged;
+}
+
+bool PersistentStatCache::lookup(StringRef Path, llvm::vfs::Status &Status,
+                                 bool &Missing, llvm::vfs::FileSystem &FS) {
+  if (NumBuckets == 0) return false;
+  uint64_t Hash = llvm::xxHash64(Path);
+  const auto *Table = reinterpret_cast<const DiskBucket *>(Buckets);
+  for (uint32_t I = Hash & (NumBuckets - 1), NumProbes = 0;
+       NumProbes != NumBuckets; I = (I + 1) & (NumBuckets - 1), ++NumProbes) {
+    const DiskBucket &Bucket = Table[I];
+    if (Bucket.PathLength == 0) return false;
+    if (Bucket.Hash != Hash ||
+        getString(Bucket.PathOffset, Bucket.PathLength) != Path)
+      continue;
+
+    if (!isDirUnchanged(Bucket.Parent, FS)) return false;
+    Missing = Bucket.Self == NoDir;
+    if (Missing) return true;
+    if (Bucket.Self >= NumDirs) return false;
+    DirRecord Dir = getDir(Bucket.Self);
+    Status = llvm::vfs::Status(
+        Path, llvm::sys::fs::UniqueID(Dir.Device, Dir.Inode),
+        llvm::sys::TimePoint<>(std::chrono::nanoseconds(Dir.MTime)),
+        /*User=*/0, /*Group=*/0, Dir.Size,
+        llvm::sys::fs::file_type::directory_file,
+        llvm::sys::fs::perms(Dir.Perms));
+    return true;
+  }
+  return false;
+}
+
+bool PersistentStatCache::recordDir(StringRef Path,
+                                    const llvm::vfs::Status &Status) {
+  if (!Status.isDirectory() ||
+      std::chrono::system_clock::now() - Status.getLastModificationTime() <
+          RacyMTimeWindow)
+    return false;
+  NewDirs[Path] = MakeDirRecord(Status);
+  return true;
+}
+
+void PersistentStatCache::record(StringRef Path,
+                                 const llvm::vfs::Status *Status,
+                                 llvm::vfs::FileSystem &FS) {
+  StringRef Parent = llvm::sys::path::parent_path(Path);
+  if (Parent.empty()) return;
+  if (!NewDirs.count(Parent)) {
+    llvm::ErrorOr<llvm::vfs::Status> ParentStatus = FS.status(Parent);
+    if (!ParentStatus || !recordDir(Parent, *ParentStatus)) return;
+  }
+  if (Status && !recordDir(Path, *Status)) return;
+  NewEntries[Path] = Status != nullptr;
+}
+
+std::error_code PersistentStatCache::getStat(
+    StringRef Path, llvm::vfs::Status &Status, bool isFile,
+    std::unique_ptr<llvm::vfs::File> *F, llvm::vfs::FileSystem &FS) {
+  if (!llvm::sys::path::is_absolute(Path))
+    return get(Path, Status, isFile, F, nullptr, FS);
+
+  bool Missing = false;
+  if (lookup(Path, Status, Missing, FS)) {
+    ++NumHits;
+    if (Missing)
+      return std::make_error_code(std::errc::no_such_file_or_directory);
+    return std::error_code();
+  }
+
+  ++NumMisses;
+  std::error_code EC = get(Path, Status, isFile, F, nullptr, FS);
+  if (EC == std::errc::no_such_file_or_directory)
+    record(Path, nullptr, FS);
+  else if ((!EC || EC == std::errc::is_a_directory) && Status.isDirectory())
+    record(Path, &Status, FS);
+  return EC;
+}
+
+void PersistentStatCache::addTree(StringRef Path, llvm::vfs::FileSystem &FS) {
+  llvm::vfs::Status Status;
+  if (getStat(Path, Status, /*isFile=*/false, nullptr, FS)) return;
+
+  std::error_code EC;
+  for (llvm::vfs::directory_iterator I = FS.dir_begin(Path, EC), E;
+       !EC && I != E; I.increment(EC)) {
+    if (I->type() == llvm::sys::fs::file_type::directory_file)
+      addTree(I->path(), FS);
+  }
+}
+
+bool PersistentStatCache::isDirty() const {
+  return !NewEntries.empty() || llvm::is_contained(DirStates, Changed);
+}
+
+std::error_code PersistentStatCache::save() {
+  // Gather the directories and entries of the file that are still valid,
+  // then the ones found by this process.
+  std::vector<std::pair<std::string, DirRecord>> AllDirs;
+  llvm::StringMap<uint32_t> DirIndexes;
+  auto AddDir = [&](StringRef Path, const DirRecord &Dir) {
+    auto Inserted = DirIndexes.try_emplace(Path, AllDirs.size());
+    if (Inserted.second) AllDirs.emplace_back(Path.str(), Dir);
+  };
+  for (uint32_t I = 0; I != NumDirs; ++I) {
+    if (DirStates[I] != Changed && !getDirPath(I).empty())
+      AddDir(getDirPath(I), getDir(I));
+  }
+  for (const auto &Dir : NewDirs) AddDir(Dir.getKey(), Dir.getValue());
+
+  llvm::StringMap<bool> AllEntries;
+  const auto *Table = reinterpret_cast<const DiskBucket *>(Buckets);
+  for (uint32_t I = 0; I != NumBuckets; ++I) {
+    const DiskBucket &Bucket = Table[I];
+    if (Bucket.PathLength == 0 || Bucket.Parent >= NumDirs ||
+        DirStates[Bucket.Parent] == Changed ||
+        (Bucket.Self != NoDir &&
+         (Bucket.Self >= NumDirs || DirStates[Bucket.Self] == Changed)))
+      continue;
+    StringRef Path = getString(Bucket.PathOffset, Bucket.PathLength);
+    if (!Path.empty()) AllEntries[Path] = Bucket.Self != NoDir;
+  }
+  for (const auto &Entry : NewEntries)
+    AllEntries[Entry.getKey()] = Entry.getValue();
+
+  // Lay out the strings and the hash table, which is at most half full.
+  std::string Strings;
+  auto AddString = [&](StringRef Str) {
+    uint32_t Offset = Strings.size();
+    Strings += Str;
+    return Offset;
+  };
+  std::vector<DiskDir> DiskDirs;
+  for (const auto &Dir : AllDirs) {
+    DiskDir D = {};
+    D.MTime = Dir.second.MTime;
+    D.Device = Dir.second.Device;
+    D.Inode = Dir.second.Inode;
+    D.Size = Dir.second.Size;
+    D.Perms = Dir.second.Perms;
+    D.PathLength = Dir.first.size();
+    D.PathOffset = AddString(Dir.first);
+    DiskDirs.push_back(D);
+  }
+  uint32_t NumBuckets = llvm::NextPowerOf2(AllEntries.size() * 2);
+  std::vector<DiskBucket> DiskBuckets(NumBuckets, DiskBucket());
+  for (const auto &Entry : AllEntries) {
+    StringRef Path = Entry.getKey();
+    auto Parent = DirIndexes.find(llvm::sys::path::parent_path(Path));
+    auto Self = DirIndexes.find(Path);
+    if (Parent == DirIndexes.end() ||
+        (Entry.getValue() && Self == DirIndexes.end()))
+      continue;
+    DiskBucket B;
+    B.Hash = llvm::xxHash64(Path);
+    B.PathLength = Path.size();
+    B.PathOffset = AddString(Path);
+    B.Parent = Parent->getValue();
+    B.Self = Entry.getValue() ? Self->getValue() : NoDir;
+    uint32_t I = B.Hash & (NumBuckets - 1);
+    while (DiskBuckets[I].PathLength != 0) I = (I + 1) & (NumBuckets - 1);
+    DiskBuckets[I] = B;
+  }
+
+  DiskHeader Header;
+  std::memcpy(Header.Magic, StatCacheMagic, sizeof(StatCacheMagic));
+  Header.Version = StatCacheVersion;
+  Header.NumDirs = DiskDirs.size();
+  Header.NumBuckets = NumBuckets;
+  Header.StringsSize = Strings.size();
+
+  // Write a temporary file next to the cache and rename it over the cache.
+  int FD;
+  llvm::SmallString<128> TempPath;
+  if (std::error_code EC = llvm::sys::fs::createUniqueFile(
+          CachePath + ".tmp-%%%%%%%%", FD, TempPath))
+    return EC;
+  {
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS.write(reinterpret_cast<const char *>(&Header), sizeof(Header));
+    OS.write(reinterpret_cast<const char *>(DiskDirs.data()),
+             DiskDirs.size() * sizeof(DiskDir));
+    OS.write(reinterpret_cast<const char *>(DiskBuckets.data()),
+             DiskBuckets.size() * sizeof(DiskBucket));
+    OS << Strings;
+    OS.close();
+    if (OS.has_error()) {
+      OS.clear_error();
+      llvm::sys::fs::remove(TempPath);
+      return std::make_error_code(std::errc::io_error);
+    }
+  }
+  if (std::error_code EC = llvm::sys::fs::rename(TempPath, CachePath)) {
+    llvm::sys::fs::remove(TempPath);
+    return EC;
+  }
+  return std::error_code();
+}
+
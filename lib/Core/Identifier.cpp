@@ -4,6 +4,7 @@
 #include "stone/Core/LangOptions.h"
 //#include "stone/Core/OperatorKinds.h"
 //#include "stone/Core/Specifiers.h"
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
@@ -16,6 +17,8 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Allocator.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include "stone/Core/TokenKind.h"
 
@@ -39,7 +42,7 @@ static KeywordStatus GetKeywordStatus(const LangOptions &langOpts,
 }
 /// Returns true if the identifier is a keyword
 bool Identifier::IsKeyword(const LangOptions &langOpts) const {
-  switch (kind) {
+  switch (getTokenKind()) {
 #define KEYWORD(NAME, FLAG) \
   case tk::kw_##NAME:       \
     return GetKeywordStatus(langOpts, FLAG) == KeywordStatus::On;
@@ -49,11 +52,119 @@ bool Identifier::IsKeyword(const LangOptions &langOpts) const {
   }
 }
 
+//===----------------------------------------------------------------------===//
+// IdentifierTable
+//===----------------------------------------------------------------------===//
+/// The number of buckets a shard starts with, enough for the keywords.
+static constexpr unsigned InitialNumBuckets = 32;
+
 IdentifierTable::IdentifierTable(const LangOptions &langOpts)
-    : langOpts(langOpts) {
+    : langOpts(langOpts), stats(*this) {
+  for (auto &shard : shards) {
+    shard.buckets.store(AllocateBuckets(shard.alloc, InitialNumBuckets),
+                        std::memory_order_release);
+  }
   AddKeywords(langOpts);
 }
 
+IdentifierTable::Buckets *IdentifierTable::AllocateBuckets(
+    Arena &alloc, unsigned numBuckets) {
+  assert(llvm::isPowerOf2_32(numBuckets) && "bucket count not a power of 2");
+  void *mem = alloc.Allocate(sizeof(Buckets) + numBuckets * sizeof(Slot),
+                             alignof(Buckets));
+  auto *buckets = new (mem) Buckets();
+  buckets->mask = numBuckets - 1;
+  Slot *slots = buckets->GetSlots();
+  for (unsigned i = 0; i != numBuckets; ++i) new (&slots[i]) Slot();
+  return buckets;
+}
+
+IdentifierTable::Buckets *IdentifierTable::Grow(Shard &shard) {
+  const Buckets *oldBuckets = shard.buckets.load(std::memory_order_relaxed);
+  Buckets *buckets =
+      AllocateBuckets(shard.alloc, oldBuckets->GetNumBuckets() * 2);
+  Slot *slots = buckets->GetSlots();
+
+  // The new array is not visible to other threads yet, so it can be filled
+  // with plain stores.
+  const Slot *oldSlots = oldBuckets->GetSlots();
+  for (unsigned i = 0, e = oldBuckets->GetNumBuckets(); i != e; ++i) {
+    Identifier *identifier =
+        oldSlots[i].identifier.load(std::memory_order_relaxed);
+    if (!identifier) continue;
+    unsigned hash = oldSlots[i].hash;
+    unsigned j = hash & buckets->mask;
+    while (slots[j].identifier.load(std::memory_order_relaxed))
+      j = (j + 1) & buckets->mask;
+    slots[j].hash = hash;
+    slots[j].identifier.store(identifier, std::memory_order_relaxed);
+  }
+  shard.buckets.store(buckets, std::memory_order_release);
+  return buckets;
+}
+
+Identifier &IdentifierTable::Insert(llvm::StringRef name, unsigned hash) {
+  Shard &shard = shards[GetShardIndex(hash)];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  // Another thread may have inserted the name since Find() missed it.
+  unsigned numProbes;
+  if (Identifier *identifier = Find(name, hash, numProbes)) return *identifier;
+
+  Buckets *buckets = shard.buckets.load(std::memory_order_relaxed);
+  unsigned numItems = shard.numItems.load(std::memory_order_relaxed) + 1;
+  if (numItems * 4 > buckets->GetNumBuckets() * 3) buckets = Grow(shard);
+
+  // The name is stored null-terminated right after the identifier.
+  assert(name.size() <= UINT32_MAX && "identifier too long");
+  void *mem = shard.alloc.Allocate(sizeof(Identifier) + name.size() + 1,
+                                   alignof(Identifier));
+  auto *identifier = new (mem) Identifier(name.size());
+  char *nameStart = reinterpret_cast<char *>(identifier + 1);
+  std::memcpy(nameStart, name.data(), name.size());
+  nameStart[name.size()] = '\0';
+
+  Slot *slots = buckets->GetSlots();
+  unsigned i = hash & buckets->mask;
+  while (slots[i].identifier.load(std::memory_order_relaxed))
+    i = (i + 1) & buckets->mask;
+  slots[i].hash = hash;
+  // Publish the identifier, its name and the slot hash to lock-free readers.
+  slots[i].identifier.store(identifier, std::memory_order_release);
+  shard.numItems.store(numItems, std::memory_order_relaxed);
+  return *identifier;
+}
+
+unsigned IdentifierTable::size() const {
+  unsigned numItems = 0;
+  for (const auto &shard : shards)
+    numItems += shard.numItems.load(std::memory_order_relaxed);
+  return numItems;
+}
+
+ArenaUsage IdentifierTable::GetArenaUsage() const {
+  ArenaUsage usage;
+  for (const auto &shard : shards) usage += shard.alloc.GetUsage();
+  return usage;
+}
+
+void IdentifierTable::iterator::SkipEmpty() {
+  for (; shard != NumShards; ++shard, slot = 0) {
+    const Buckets *buckets =
+        table->shards[shard].buckets.load(std::memory_order_acquire);
+    const Slot *slots = buckets->GetSlots();
+    for (; slot != buckets->GetNumBuckets(); ++slot) {
+      if (slots[slot].identifier.load(std::memory_order_relaxed)) return;
+    }
+  }
+}
+
+Identifier &IdentifierTable::iterator::operator*() const {
+  const Buckets *buckets =
+      table->shards[shard].buckets.load(std::memory_order_acquire);
+  return *buckets->GetSlots()[slot].identifier.load(std::memory_order_acquire);
+}
+
 static void AddKeyword(llvm::StringRef keyword, tk kind, unsigned flag,
                        const LangOptions &langOpts, IdentifierTable &table) {
   auto status = GetKeywordStatus(langOpts, flag);
@@ -76,35 +187,88 @@ void IdentifierTable::AddKeywords(const LangOptions &LangOpts) {
 //===----------------------------------------------------------------------===//
 // Stats
 //===----------------------------------------------------------------------===//
-/// PrintStats - Print statistics about how well the identifier table is doing
-/// at hashing identifiers.
-void IdentifierTableStats::Print() const {
-  unsigned numBuckets = table.entries.getNumBuckets();
-  unsigned numIdentifiers = table.entries.getNumItems();
-  unsigned numEmptyBuckets = numBuckets - numIdentifiers;
-  unsigned averageIdentifierSize = 0;
-  unsigned maxIdentifierLength = 0;
-
-  // TODO: Figure out maximum times an identifier had to probe for -stats.
-  for (llvm::StringMap<Identifier *, llvm::BumpPtrAllocator>::const_iterator
-           I = table.entries.begin(),
-           E = table.entries.end();
-       I != E; ++I) {
-    unsigned idLen = I->getKeyLength();
-    averageIdentifierSize += idLen;
-    if (maxIdentifierLength < idLen) maxIdentifierLength = idLen;
+void IdentifierTableStats::GetData(llvm::json::Object &data) const {
+  using Shard = IdentifierTable::Shard;
+  const unsigned MaxProbeLength = IdentifierTable::MaxProbeLength;
+
+  uint64_t numBuckets = 0;
+  uint64_t numRehashes = 0;
+  uint64_t arenaBytes = 0;
+  uint64_t totalLength = 0;
+  unsigned maxLength = 0;
+  unsigned maxProbeLength = 0;
+  // resident[n - 1] counts the identifiers that a lookup finds after probing
+  // n slots, which follows from where they sit in the table.
+  uint64_t resident[MaxProbeLength] = {};
+
+  for (const Shard &shard : table.shards) {
+    const IdentifierTable::Buckets *buckets =
+        shard.buckets.load(std::memory_order_acquire);
+    numBuckets += buckets->GetNumBuckets();
+    // Bucket arrays only ever double.
+    numRehashes += llvm::Log2_32(buckets->GetNumBuckets() / InitialNumBuckets);
+    arenaBytes += shard.alloc.GetTotalMemory();
+
+    const IdentifierTable::Slot *slots = buckets->GetSlots();
+    for (unsigned i = 0; i != buckets->GetNumBuckets(); ++i) {
+      Identifier *identifier =
+          slots[i].identifier.load(std::memory_order_acquire);
+      if (!identifier) continue;
+      totalLength += identifier->getLength();
+      maxLength = std::max(maxLength, identifier->getLength());
+      unsigned probeLength = ((i - slots[i].hash) & buckets->mask) + 1;
+      maxProbeLength = std::max(maxProbeLength, probeLength);
+      ++resident[std::min(probeLength, MaxProbeLength) - 1];
+    }
   }
 
-  os << "\n*** Identifier Table Stats: " << '\n';
+  uint64_t numIdentifiers = table.size();
+  auto perIdentifier = [&](uint64_t value) {
+    return numIdentifiers ? double(value) / numIdentifiers : 0.0;
+  };
+  auto toArray = [](const uint64_t *counts, unsigned size) {
+    llvm::json::Array array;
+    for (unsigned i = 0; i != size; ++i) array.push_back(int64_t(counts[i]));
+    return array;
+  };
+
+  data["identifiers"] = int64_t(numIdentifiers);
+  data["shards"] = int64_t(IdentifierTable::NumShards);
+  data["buckets"] = int64_t(numBuckets);
+  data["emptyBuckets"] = int64_t(numBuckets - numIdentifiers);
+  data["loadFactor"] = numBuckets ? double(numIdentifiers) / numBuckets : 0.0;
+  data["rehashes"] = int64_t(numRehashes);
+  data["averageLength"] = perIdentifier(totalLength);
+  data["maxLength"] = int64_t(maxLength);
+  data["arenaBytes"] = int64_t(arenaBytes);
+  data["arenaBytesPerIdentifier"] = perIdentifier(arenaBytes);
+  data["maxProbeLength"] = int64_t(maxProbeLength);
+  data["residentProbeLengths"] = toArray(resident, MaxProbeLength);
 
-  fprintf(stderr, "# Identifiers:   %d\n", numIdentifiers);
-  fprintf(stderr, "# Empty Buckets: %d\n", numEmptyBuckets);
-  fprintf(stderr, "Hash density (#identifiers per bucket): %f\n",
-          numIdentifiers / (double)numBuckets);
-  fprintf(stderr, "Ave identifier length: %f\n",
-          (averageIdentifierSize / (double)numIdentifiers));
-  fprintf(stderr, "Max identifier length: %d\n", maxIdentifierLength);
+#if STONE_IDENTIFIER_TABLE_STATS
+  uint64_t numHits = 0;
+  uint64_t numMisses = 0;
+  uint64_t lookups[MaxProbeLength] = {};
+  for (const Shard &shard : table.shards) {
+    numHits += shard.counters.numHits.load(std::memory_order_relaxed);
+    numMisses += shard.counters.numMisses.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i != MaxProbeLength; ++i) {
+      lookups[i] +=
+          shard.counters.probeLengths[i].load(std::memory_order_relaxed);
+    }
+  }
+  data["lookupHits"] = int64_t(numHits);
+  data["lookupMisses"] = int64_t(numMisses);
+  data["lookupProbeLengths"] = toArray(lookups, MaxProbeLength);
+#endif
+}
 
-  // Compute statistics about the memory allocated for identifiers.
-  table.entries.getAllocator().PrintStats();
+/// Print statistics about how well the identifier table is doing at hashing
+/// identifiers. Probe length lists count lengths 1, 2, ... in order, with
+/// the last entry counting all longer probes.
+void IdentifierTableStats::Print() const {
+  llvm::json::Object data;
+  GetData(data);
+  os << "\n*** Identifier Table Stats: " << '\n';
+  os << llvm::formatv("{0:2}", llvm::json::Value(std::move(data))) << '\n';
 }
@@ -21,6 +21,11 @@
 #include <utility>
 #include <vector>
 
+#include "llvm/Config/llvm-config.h"
+#if LLVM_ON_UNIX
+#include <sys/mman.h>
+#endif
+
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/None.h"
 #include "llvm/ADT/Optional.h"
@@ -36,7 +41,10 @@
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "stone/Core/CharScan.h"
 #include "stone/Core/FileMgr.h"
 #include "stone/Core/LLVM.h"
 #include "stone/Core/SrcLoc.h"
@@ -50,6 +58,150 @@ using llvm::MemoryBuffer;
 // SrcMgr Helper Classes
 //===----------------------------------------------------------------------===//
 
+void LineOffsetTable::assign(unsigned *Offsets, unsigned NumLines) {
+  Starts = Offsets;
+  Deltas = nullptr;
+  this->NumLines = NumLines;
+  Enc = Encoding::Offsets32;
+  Computed.store(true, std::memory_order_release);
+}
+
+void LineOffsetTable::share(const LineOffsetTable &Other) {
+  assert(Other.isComputed() && "sharing a table that is not computed");
+  Starts = Other.Starts;
+  Deltas = Other.Deltas;
+  NumLines = Other.NumLines;
+  Enc = Other.Enc;
+  Computed.store(true, std::memory_order_release);
+}
+
+template <typename DeltaT>
+static void *StoreDeltas(ArrayRef<unsigned> Offsets,
+                         llvm::BumpPtrAllocator &Alloc) {
+  DeltaT *Deltas = Alloc.Allocate<DeltaT>(Offsets.size());
+  Deltas[0] = 0;
+  for (size_t I = 1, E = Offsets.size(); I != E; ++I)
+    Deltas[I] = Offsets[I] - Offsets[I - 1];
+  return Deltas;
+}
+
+void LineOffsetTable::assignCompressed(ArrayRef<unsigned> Offsets,
+                                       llvm::BumpPtrAllocator &Alloc) {
+  NumLines = Offsets.size();
+
+  // The first line of a block has an absolute offset, so its distance from
+  // the line before does not have to fit.
+  unsigned MaxDelta = 0;
+  for (unsigned I = 1; I != NumLines; ++I) {
+    if (I % BlockSize != 0)
+      MaxDelta = std::max(MaxDelta, Offsets[I] - Offsets[I - 1]);
+  }
+  if (MaxDelta > UINT16_MAX) {
+    Starts = Alloc.Allocate<unsigned>(NumLines);
+    std::copy(Offsets.begin(), Offsets.end(), Starts);
+    Deltas = nullptr;
+    Enc = Encoding::Offsets32;
+    Computed.store(true, std::memory_order_release);
+    return;
+  }
+
+  unsigned NumBlocks = (NumLines + BlockSize - 1) >> BlockShift;
+  Starts = Alloc.Allocate<unsigned>(NumBlocks);
+  for (unsigned Block = 0; Block != NumBlocks; ++Block)
+    Starts[Block] = Offsets[Block << BlockShift];
+  if (MaxDelta <= UINT8_MAX) {
+    Deltas = StoreDeltas<uint8_t>(Offsets, Alloc);
+    Enc = Encoding::Deltas8;
+  } else {
+    Deltas = StoreDeltas<uint16_t>(Offsets, Alloc);
+    Enc = Encoding::Deltas16;
+  }
+  Computed.store(true, std::memory_order_release);
+}
+
+template <typename DeltaT>
+static unsigned SumDeltas(const void *Deltas, unsigned Begin, unsigned End) {
+  const DeltaT *D = static_cast<const DeltaT *>(Deltas);
+  unsigned Sum = 0;
+  for (unsigned I = Begin; I != End; ++I) Sum += D[I];
+  return Sum;
+}
+
+unsigned LineOffsetTable::getLineStart(unsigned Index) const {
+  assert(Index < NumLines && "line out of range");
+  if (Enc == Encoding::Offsets32) return Starts[Index];
+
+  unsigned BlockStart = Index & ~(BlockSize - 1);
+  unsigned Start = Starts[Index >> BlockShift];
+  if (Enc == Encoding::Deltas8)
+    return Start + SumDeltas<uint8_t>(Deltas, BlockStart + 1, Index + 1);
+  return Start + SumDeltas<uint16_t>(Deltas, BlockStart + 1, Index + 1);
+}
+
+/// Return the index of the last line in [Line, End) that starts at or before
+/// FilePos, given that line Line starts at Start <= FilePos.
+template <typename DeltaT>
+static unsigned ScanBlock(const void *Deltas, unsigned Line, unsigned End,
+                          unsigned Start, unsigned FilePos) {
+  const DeltaT *D = static_cast<const DeltaT *>(Deltas);
+  while (Line + 1 != End && Start + D[Line + 1] <= FilePos)
+    Start += D[++Line];
+  return Line;
+}
+
+unsigned LineOffsetTable::findLine(unsigned FilePos) const {
+  if (Enc == Encoding::Offsets32)
+    return std::upper_bound(Starts, Starts + NumLines, FilePos) - Starts;
+
+  // Line #1 starts at 0, so some block starts at or before FilePos.
+  unsigned NumBlocks = (NumLines + BlockSize - 1) >> BlockShift;
+  unsigned Block =
+      std::upper_bound(Starts, Starts + NumBlocks, FilePos) - Starts - 1;
+  unsigned Line = Block << BlockShift;
+  unsigned End = std::min(Line + BlockSize, NumLines);
+  if (Enc == Encoding::Deltas8)
+    return ScanBlock<uint8_t>(Deltas, Line, End, Starts[Block], FilePos) + 1;
+  return ScanBlock<uint16_t>(Deltas, Line, End, Starts[Block], FilePos) + 1;
+}
+
+size_t LineOffsetTable::getMemorySize() const {
+  switch (Enc) {
+    case Encoding::Offsets32:
+      return NumLines * sizeof(unsigned);
+    case Encoding::Deltas8:
+      return ((NumLines + BlockSize - 1) >> BlockShift) * sizeof(unsigned) +
+             NumLines * sizeof(uint8_t);
+    case Encoding::Deltas16:
+      return ((NumLines + BlockSize - 1) >> BlockShift) * sizeof(unsigned) +
+             NumLines * sizeof(uint16_t);
+  }
+  llvm_unreachable("bad line table encoding");
+}
+
+SLocEntryTable::~SLocEntryTable() {
+  for (SLocEntry *Segment : Segments) free(Segment);
+}
+
+void SLocEntryTable::push_back(const SLocEntry &Entry) {
+  unsigned Index = Size.load(std::memory_order_relaxed);
+  unsigned Segment = getSegment(Index);
+  assert(Segment < NumSegments && "too many SLocEntries");
+  if (!Segments[Segment])
+    Segments[Segment] = static_cast<SLocEntry *>(llvm::safe_malloc(
+        (size_t(1) << (FirstSegmentShift + Segment)) * sizeof(SLocEntry)));
+  new (&Segments[Segment][Index - getSegmentBegin(Segment)]) SLocEntry(Entry);
+  Size.store(Index + 1, std::memory_order_release);
+}
+
+size_t SLocEntryTable::getMemorySize() const {
+  size_t Bytes = 0;
+  for (unsigned Segment = 0; Segment != NumSegments; ++Segment) {
+    if (Segments[Segment])
+      Bytes += (size_t(1) << (FirstSegmentShift + Segment)) * sizeof(SLocEntry);
+  }
+  return Bytes;
+}
+
 ContentCache::~ContentCache() {
   if (shouldFreeBuffer()) delete Buffer.getPointer();
 }
@@ -91,19 +243,61 @@ void ContentCache::replaceBuffer(const llvm::MemoryBuffer *B, bool DoNotFree) {
   if (shouldFreeBuffer()) delete Buffer.getPointer();
   Buffer.setPointer(B);
   Buffer.setInt((B && DoNotFree) ? DoNotFreeFlag : 0);
+  SharedContents = nullptr;
+  BufferLoaded.store(B != nullptr, std::memory_order_release);
+}
+
+/// Pass \p Access on to madvise() for the pages of \p Buf if it is mapped.
+/// The pages of a buffer on the heap are left alone: dropping them would
+/// lose its contents.
+static void AdviseBuffer(const llvm::MemoryBuffer *Buf, BufferAccess Access) {
+#if LLVM_ON_UNIX
+  if (!Buf || Buf->getBufferKind() != llvm::MemoryBuffer::MemoryBuffer_MMap)
+    return;
+  int Advice = MADV_NORMAL;
+  switch (Access) {
+    case BufferAccess::Sequential:
+      Advice = MADV_SEQUENTIAL;
+      break;
+    case BufferAccess::Random:
+      Advice = MADV_RANDOM;
+      break;
+    case BufferAccess::NotNeeded:
+      Advice = MADV_DONTNEED;
+      break;
+  }
+  // The mapping starts at a page boundary at or before the buffer.
+  uintptr_t PageSize = llvm::sys::Process::getPageSizeEstimate();
+  uintptr_t Start = uintptr_t(Buf->getBufferStart()) & ~(PageSize - 1);
+  uintptr_t End = uintptr_t(Buf->getBufferEnd());
+  ::madvise(reinterpret_cast<void *>(Start), End - Start, Advice);
+#else
+  (void)Buf;
+  (void)Access;
+#endif
 }
 
 const llvm::MemoryBuffer *ContentCache::getBuffer(DiagnosticEngine &de,
                                                   const SrcMgr &SM, SrcLoc Loc,
                                                   bool *Invalid) const {
   // Lazily create the Buffer for ContentCaches that wrap files.  If we already
-  // computed it, just return what we have.
-  if (Buffer.getPointer() || !ContentsEntry) {
-    if (Invalid) *Invalid = isBufferInvalid();
-
-    return Buffer.getPointer();
+  // computed it, just return what we have. In concurrent mode the first
+  // thread to take the lock reads the file and the others wait for it.
+  if (ContentsEntry && !BufferLoaded.load(std::memory_order_acquire)) {
+    std::unique_lock<std::mutex> Lock;
+    if (SM.isConcurrent()) Lock = std::unique_lock<std::mutex>(SM.ContentMutex);
+    if (!BufferLoaded.load(std::memory_order_relaxed)) {
+      loadBuffer(de, SM, Loc);
+      BufferLoaded.store(true, std::memory_order_release);
+    }
   }
 
+  if (Invalid) *Invalid = isBufferInvalid();
+  return Buffer.getPointer();
+}
+
+void ContentCache::loadBuffer(DiagnosticEngine &de, const SrcMgr &SM,
+                              SrcLoc Loc) const {
   // Check that the file's size fits in an 'unsigned' (with room for a
   // past-the-end value). This is deeply regrettable, but various parts of
   // Clang (including elsewhere in this file!) use 'unsigned' to represent file
@@ -129,8 +323,7 @@ de.Report(Loc, diag::err_file_too_large)
     */
 
     Buffer.setInt(Buffer.getInt() | InvalidFlag);
-    if (Invalid) *Invalid = true;
-    return Buffer.getPointer();
+    return;
   }
 
   bool isVolatile = SM.userFilesAreVolatile() && !IsSystemFile;
@@ -168,8 +361,7 @@ de.Report(Loc, diag::err_cannot_open_file)
 
     Buffer.setInt(Buffer.getInt() | InvalidFlag);
 
-    if (Invalid) *Invalid = true;
-    return Buffer.getPointer();
+    return;
   }
 
   Buffer.setPointer(BufferOrError->release());
@@ -187,8 +379,7 @@ de.Report(Loc, diag::err_file_modified)
     */
 
     Buffer.setInt(Buffer.getInt() | InvalidFlag);
-    if (Invalid) *Invalid = true;
-    return Buffer.getPointer();
+    return;
   }
 
   // If the buffer is valid, check to see if it has a UTF Byte Order Mark
@@ -220,9 +411,35 @@ de.Report(Loc, diag::err_file_modified)
     Buffer.setInt(Buffer.getInt() | InvalidFlag);
   }
 
-  if (Invalid) *Invalid = isBufferInvalid();
+  if (isBufferInvalid()) return;
+  shareIdenticalContents(SM);
 
-  return Buffer.getPointer();
+  // The buffer is most likely being loaded for the lexer.
+  AdviseBuffer(Buffer.getPointer(), BufferAccess::Sequential);
+}
+
+void ContentCache::shareIdenticalContents(const SrcMgr &SM) const {
+  // In concurrent mode the caller holds the SrcMgr's ContentMutex.
+  StringRef Contents = Buffer.getPointer()->getBuffer();
+  auto Inserted = SM.ContentsByHash.insert({llvm::xxHash64(Contents), this});
+  if (Inserted.second) return;
+
+  // The hash only finds the candidate; a collision keeps its own buffer.
+  const ContentCache *Same = Inserted.first->second;
+  const llvm::MemoryBuffer *SameBuffer = Same->getRawBuffer();
+  if (!SameBuffer || SameBuffer->getBuffer() != Contents) return;
+
+  // Same owns the buffer for as long as the SrcMgr lives; see
+  // SrcMgr::unshareContents().
+  if (shouldFreeBuffer()) delete Buffer.getPointer();
+  Buffer.setPointer(SameBuffer);
+  Buffer.setInt(DoNotFreeFlag);
+  SharedContents = Same;
+}
+
+void ContentCache::adviseAccess(BufferAccess Access) const {
+  if (BufferLoaded.load(std::memory_order_acquire))
+    AdviseBuffer(Buffer.getPointer(), Access);
 }
 
 unsigned SrcLineTable::getLineTableFilenameID(StringRef Name) {
@@ -336,9 +553,16 @@ SrcLineTable &SrcMgr::getLineTable() {
 // Private 'Create' methods.
 //===----------------------------------------------------------------------===//
 
+/// The InstanceID of the next SrcMgr. IDs start at 1, so that 0 marks an
+/// unused per-thread lookup cache.
+static std::atomic<uint64_t> NextInstanceID{1};
+
 SrcMgr::SrcMgr(DiagnosticEngine &de, FileMgr &fileMgr,
                bool UserFilesAreVolatile)
-    : de(de), fileMgr(fileMgr), UserFilesAreVolatile(UserFilesAreVolatile) {
+    : de(de),
+      fileMgr(fileMgr),
+      UserFilesAreVolatile(UserFilesAreVolatile),
+      InstanceID(NextInstanceID.fetch_add(1, std::memory_order_relaxed)) {
   clearIDTables();
   // TODO: de.setSrcMgr(this);
 }
@@ -369,9 +593,8 @@ void SrcMgr::clearIDTables() {
   LocalSrcLocTable.clear();
   LoadedSrcLocTable.clear();
   SLocEntryLoaded.clear();
-  LastLineNoSrcIDQuery = SrcID();
-  LastLineNoContentCache = nullptr;
-  LastSrcIDLookup = SrcID();
+  Lookups = LookupCache();
+  LookupGeneration.fetch_add(1, std::memory_order_relaxed);
 
   if (LineTable) LineTable->clear();
 
@@ -418,7 +641,7 @@ const ContentCache *SrcMgr::getOrCreateContentCache(const SrcFile *FileEnt,
   if (Entry) return Entry;
 
   // Nope, create a new Cache entry.
-  Entry = ContentCacheAlloc.Allocate<ContentCache>();
+  Entry = allocateContentCache();
 
   if (OverriddenFilesInfo) {
     // If the file contents are overridden with contents from another file,
@@ -441,12 +664,50 @@ const ContentCache *SrcMgr::getOrCreateContentCache(const SrcFile *FileEnt,
   return Entry;
 }
 
+/// The number of SrcMgrs whose lookup caches a thread keeps at once.
+static constexpr unsigned NumThreadLookupCaches = 4;
+
+SrcMgr::LookupCache &SrcMgr::getThreadLookupCache() const {
+  struct Slot {
+    uint64_t OwnerID = 0;
+    unsigned Generation = 0;
+    std::unique_ptr<LookupCache> Cache;
+  };
+  static thread_local Slot Slots[NumThreadLookupCaches];
+  static thread_local unsigned NextVictim = 0;
+
+  unsigned Generation = LookupGeneration.load(std::memory_order_relaxed);
+  for (Slot &S : Slots) {
+    if (S.OwnerID != InstanceID) continue;
+    if (S.Generation != Generation) {
+      *S.Cache = LookupCache();
+      S.Generation = Generation;
+    }
+    return *S.Cache;
+  }
+
+  // Otherwise reuse the slots in turn.
+  Slot &S = Slots[NextVictim++ % NumThreadLookupCaches];
+  S.OwnerID = InstanceID;
+  S.Generation = Generation;
+  S.Cache = llvm::make_unique<LookupCache>();
+  return *S.Cache;
+}
+
+/// In concurrent mode, line tables are allocated from ContentCacheAlloc by the
+/// threads that query them, so allocating a ContentCache takes the lock too.
+ContentCache *SrcMgr::allocateContentCache() {
+  std::unique_lock<std::mutex> Lock;
+  if (Concurrent) Lock = std::unique_lock<std::mutex>(ContentMutex);
+  return ContentCacheAlloc.Allocate<ContentCache>();
+}
+
 /// Create a new ContentCache for the specified memory buffer.
 /// This does no caching.
 const ContentCache *SrcMgr::createMemBufferContentCache(
     const llvm::MemoryBuffer *Buffer, bool DoNotFree) {
   // Add a new ContentCache to the MemBufferInfos list and return it.
-  ContentCache *Entry = ContentCacheAlloc.Allocate<ContentCache>();
+  ContentCache *Entry = allocateContentCache();
   new (Entry) ContentCache();
   MemBufferInfos.push_back(Entry);
   Entry->replaceBuffer(Buffer, DoNotFree);
@@ -569,7 +830,7 @@ SrcID SrcMgr::CreateSrcID(const ContentCache *File, SrcLoc IncludePos,
   // Set LastSrcIDLookup to the newly created file.  The next getSrcID call is
   // almost guaranteed to be from that file.
   SrcID FID = SrcID::get(LocalSrcLocTable.size() - 1);
-  return LastSrcIDLookup = FID;
+  return getLookupCache().LastSrcIDLookup = FID;
 }
 
 SrcLoc SrcMgr::createMacroArgExpansionLoc(SrcLoc SpellingLoc,
@@ -626,11 +887,45 @@ const llvm::MemoryBuffer *SrcMgr::getMemoryBufferForFile(const SrcFile *File,
   return IR->getBuffer(de, *this, SrcLoc(), Invalid);
 }
 
+void SrcMgr::unshareContents(ContentCache *CC) {
+  const llvm::MemoryBuffer *Buffer = CC->getRawBuffer();
+  if (!Buffer || CC->SharedContents) return;
+  uint64_t Hash = llvm::xxHash64(Buffer->getBuffer());
+  auto Found = ContentsByHash.find(Hash);
+  if (Found == ContentsByHash.end() || Found->second != CC) return;
+  ContentsByHash.erase(Found);
+
+  // The files that share CC's contents keep the old buffer. The first of
+  // them takes over as the owner of those contents, and the others share
+  // with it from now on.
+  ContentCache *NewOwner = nullptr;
+  auto Repoint = [&](ContentCache *Other) {
+    if (Other->SharedContents != CC) return;
+    if (!NewOwner) {
+      NewOwner = Other;
+      Other->SharedContents = nullptr;
+      ContentsByHash[Hash] = Other;
+    } else {
+      Other->SharedContents = NewOwner;
+    }
+  };
+  for (const auto &FileInfo : FileInfos) Repoint(FileInfo.second);
+  for (ContentCache *Other : MemBufferInfos) Repoint(Other);
+
+  // Files loaded before may still use the buffer, so it is kept until the
+  // SrcMgr goes away.
+  if (CC->shouldFreeBuffer()) {
+    OrphanedBuffers.emplace_back(Buffer);
+    CC->disownBuffer();
+  }
+}
+
 void SrcMgr::overrideFileContents(const SrcFile *SourceFile,
                                   llvm::MemoryBuffer *Buffer, bool DoNotFree) {
   const src::ContentCache *IR = getOrCreateContentCache(SourceFile);
   assert(IR && "getOrCreateContentCache() cannot return NULL");
 
+  unshareContents(const_cast<src::ContentCache *>(IR));
   const_cast<src::ContentCache *>(IR)->replaceBuffer(Buffer, DoNotFree);
   const_cast<src::ContentCache *>(IR)->BufferOverridden = true;
 
@@ -652,6 +947,7 @@ void SrcMgr::disableFileContentsOverride(const SrcFile *File) {
   if (!isFileOverridden(File)) return;
 
   const src::ContentCache *IR = getOrCreateContentCache(File);
+  unshareContents(const_cast<src::ContentCache *>(IR));
   const_cast<src::ContentCache *>(IR)->replaceBuffer(nullptr);
   const_cast<src::ContentCache *>(IR)->ContentsEntry = IR->OrigEntry;
 
@@ -666,6 +962,8 @@ void SrcMgr::setFileIsTransient(const SrcFile *File) {
 }
 
 StringRef SrcMgr::getBufferData(SrcID FID, bool *Invalid) const {
+  std::unique_lock<std::mutex> Lock;
+  if (!Concurrent) Lock = std::unique_lock<std::mutex>(BufferDataMutex);
   bool MyInvalid = false;
   const SLocEntry &SLoc = getSLocEntry(FID, &MyInvalid);
   if (!SLoc.isFile() || MyInvalid) {
@@ -686,6 +984,14 @@ StringRef SrcMgr::getBufferData(SrcID FID, bool *Invalid) const {
 // SrcLoc manipulation methods.
 //===----------------------------------------------------------------------===//
 
+void SrcMgr::adviseBufferAccess(SrcID FID, BufferAccess Access) const {
+  bool Invalid = false;
+  const SLocEntry &Entry = getSLocEntry(FID, &Invalid);
+  if (Invalid || !Entry.isFile()) return;
+  if (const ContentCache *Content = Entry.getFile().getContentCache())
+    Content->adviseAccess(Access);
+}
+
 /// Return the SrcID for a SrcLoc.
 ///
 /// This is the cache-miss path of getSrcID. Not as hot as that function, but
@@ -718,37 +1024,39 @@ SrcID SrcMgr::getSrcIDLocal(unsigned SLocOffset) const {
 
   // See if this is near the file point - worst case we start scanning from the
   // most newly created SrcID.
-  const src::SLocEntry *I;
+  LookupCache &Cache = getLookupCache();
+  SrcID &LastSrcIDLookup = Cache.LastSrcIDLookup;
+  unsigned I;
 
   if (LastSrcIDLookup.ID < 0 ||
       LocalSrcLocTable[LastSrcIDLookup.ID].getOffset() < SLocOffset) {
     // Neither loc prunes our search.
-    I = LocalSrcLocTable.end();
+    I = LocalSrcLocTable.size();
   } else {
     // Perhaps it is near the file point.
-    I = LocalSrcLocTable.begin() + LastSrcIDLookup.ID;
+    I = LastSrcIDLookup.ID;
   }
 
-  // Find the SrcID that contains this.  "I" is an iterator that points to a
-  // SrcID whose offset is known to be larger than SLocOffset.
+  // Find the SrcID that contains this.  "I" is the index of a SrcID whose
+  // offset is known to be larger than SLocOffset.
   unsigned NumProbes = 0;
   while (true) {
-    --I;
-    if (I->getOffset() <= SLocOffset) {
-      SrcID Res = SrcID::get(int(I - LocalSrcLocTable.begin()));
+    const src::SLocEntry &E = LocalSrcLocTable[--I];
+    if (E.getOffset() <= SLocOffset) {
+      SrcID Res = SrcID::get(int(I));
 
       // If this isn't an expansion, remember it.  We have good locality across
       // SrcID lookups.
-      if (!I->isExpansion()) LastSrcIDLookup = Res;
-      NumLinearScans += NumProbes + 1;
+      if (!E.isExpansion()) LastSrcIDLookup = Res;
+      Cache.NumLinearScans += NumProbes + 1;
       return Res;
     }
     if (++NumProbes == 8) break;
   }
 
-  // Convert "I" back into an index.  We know that it is an entry whose index is
-  // larger than the offset we are looking for.
-  unsigned GreaterIndex = I - LocalSrcLocTable.begin();
+  // We know that "I" is an entry whose index is larger than the offset we are
+  // looking for.
+  unsigned GreaterIndex = I;
   // LessIndex - This is the lower bound of the range that we're searching.
   // We know that the offset corresponding to the SrcID is is less than
   // SLocOffset.
@@ -778,7 +1086,7 @@ SrcID SrcMgr::getSrcIDLocal(unsigned SLocOffset) const {
       // If this isn't a macro expansion, remember it.  We have good locality
       // across SrcID lookups.
       if (!LocalSrcLocTable[MiddleIndex].isExpansion()) LastSrcIDLookup = Res;
-      NumBinaryProbes += NumProbes;
+      Cache.NumBinaryProbes += NumProbes;
       return Res;
     }
 
@@ -802,6 +1110,8 @@ SrcID SrcMgr::getSrcIDLoaded(unsigned SLocOffset) const {
   // in the other direction.
 
   // First do a linear scan from the last lookup position, if possible.
+  LookupCache &Cache = getLookupCache();
+  SrcID &LastSrcIDLookup = Cache.LastSrcIDLookup;
   unsigned I;
   int LastID = LastSrcIDLookup.ID;
   if (LastID >= 0 || getLoadedSLocEntryByID(LastID).getOffset() < SLocOffset)
@@ -817,7 +1127,7 @@ SrcID SrcMgr::getSrcIDLoaded(unsigned SLocOffset) const {
       SrcID Res = SrcID::get(-int(I) - 2);
 
       if (!E.isExpansion()) LastSrcIDLookup = Res;
-      NumLinearScans += NumProbes + 1;
+      Cache.NumLinearScans += NumProbes + 1;
       return Res;
     }
   }
@@ -849,7 +1159,7 @@ SrcID SrcMgr::getSrcIDLoaded(unsigned SLocOffset) const {
     if (isOffsetInSrcID(SrcID::get(-int(MiddleIndex) - 2), SLocOffset)) {
       SrcID Res = SrcID::get(-int(MiddleIndex) - 2);
       if (!E.isExpansion()) LastSrcIDLookup = Res;
-      NumBinaryProbes += NumProbes;
+      Cache.NumBinaryProbes += NumProbes;
       return Res;
     }
 
@@ -1101,12 +1411,16 @@ unsigned SrcMgr::GetColNumber(SrcID FID, unsigned FilePos,
   const char *Buf = MemBuf->getBufferStart();
   // See if we just calculated the line number for this FilePos and can use
   // that to lookup the start of the line instead of searching for it.
-  if (LastLineNoSrcIDQuery == FID &&
-      LastLineNoContentCache->SourceLineCache != nullptr &&
-      LastLineNoResult < LastLineNoContentCache->NumLines) {
-    unsigned *SourceLineCache = LastLineNoContentCache->SourceLineCache;
-    unsigned LineStart = SourceLineCache[LastLineNoResult - 1];
-    unsigned LineEnd = SourceLineCache[LastLineNoResult];
+  const LookupCache &Cache = getLookupCache();
+  if (Cache.LastLineNoSrcIDQuery == FID &&
+      Cache.LastLineNoContentCache->SourceLineCache.isComputed() &&
+      Cache.LastLineNoResult <
+          Cache.LastLineNoContentCache->SourceLineCache.size()) {
+    const LineOffsetTable &SourceLineCache =
+        Cache.LastLineNoContentCache->SourceLineCache;
+    unsigned LineStart =
+        SourceLineCache.getLineStart(Cache.LastLineNoResult - 1);
+    unsigned LineEnd = SourceLineCache.getLineStart(Cache.LastLineNoResult);
     if (FilePos >= LineStart && FilePos < LineEnd) {
       // LineEnd is the LineStart of the next line.
       // A line ends with separator LF or CR+LF on Windows.
@@ -1152,10 +1466,6 @@ unsigned SrcMgr::getPresumedColumnNumber(SrcLoc Loc, bool *Invalid) const {
   return PLoc.getColumn();
 }
 
-#ifdef __SSE2__
-#include <emmintrin.h>
-#endif
-
 static LLVM_ATTRIBUTE_NOINLINE void ComputeLineNumbers(
     DiagnosticEngine &de, ContentCache *FI, llvm::BumpPtrAllocator &Alloc,
     const SrcMgr &SM, bool &Invalid);
@@ -1168,34 +1478,58 @@ static void ComputeLineNumbers(DiagnosticEngine &de, ContentCache *FI,
 
   // Find the file offsets of all of the *physical* source lines.  This does
   // not look at trigraphs, escaped newlines, or anything else tricky.
-  SmallVector<unsigned, 256> LineOffsets;
-
-  // Line #1 starts at char 0.
-  LineOffsets.push_back(0);
+  //
+  // Line #1 starts at char 0 and every line break starts another line. The
+  // breaks are counted first, so that the offsets can be written straight
+  // into a table of the right size.
+  const char *Buf = Buffer->getBufferStart();
+  const char *End = Buffer->getBufferEnd();
+  unsigned NumLines = ch::CountLineBreaks(Buf, End) + 1;
+  auto FindLineOffsets = [&](unsigned *LineOffsets) {
+    LineOffsets[0] = 0;
+    unsigned *LineOffsetsEnd = ch::FindLineStarts(Buf, End, LineOffsets + 1);
+    assert(LineOffsetsEnd == LineOffsets + NumLines && "line count mismatch");
+    (void)LineOffsetsEnd;
+  };
 
-  const unsigned char *Buf = (const unsigned char *)Buffer->getBufferStart();
-  const unsigned char *End = (const unsigned char *)Buffer->getBufferEnd();
-  unsigned I = 0;
-  while (true) {
-    // Skip over the contents of the line.
-    while (Buf[I] != '\n' && Buf[I] != '\r' && Buf[I] != '\0') ++I;
-
-    if (Buf[I] == '\n' || Buf[I] == '\r') {
-      // If this is \r\n, skip both characters.
-      if (Buf[I] == '\r' && Buf[I + 1] == '\n') ++I;
-      ++I;
-      LineOffsets.push_back(I);
-    } else {
-      // Otherwise, this is a NUL. If end of file, exit.
-      if (Buf + I == End) break;
-      ++I;
-    }
+  if (Buffer->getBufferSize() < LineOffsetTable::CompressionThreshold) {
+    unsigned *LineOffsets = Alloc.Allocate<unsigned>(NumLines);
+    FindLineOffsets(LineOffsets);
+    FI->SourceLineCache.assign(LineOffsets, NumLines);
+    return;
   }
+  // Large buffers get a compressed table, built from a temporary one.
+  std::unique_ptr<unsigned[]> LineOffsets(new unsigned[NumLines]);
+  FindLineOffsets(LineOffsets.get());
+  FI->SourceLineCache.assignCompressed(
+      llvm::makeArrayRef(LineOffsets.get(), NumLines), Alloc);
+}
+
+/// Compute the line table of \p FI unless it has been computed already. In
+/// concurrent mode \p Mutex is the SrcMgr's ContentMutex; the first thread to
+/// take it computes the table and the others wait for it.
+static void EnsureLineNumbers(DiagnosticEngine &de, ContentCache *FI,
+                              llvm::BumpPtrAllocator &Alloc, const SrcMgr &SM,
+                              std::mutex *Mutex, bool &Invalid) {
+  // getBuffer() takes the lock itself if it has to read the file.
+  FI->getBuffer(de, SM, SrcLoc(), &Invalid);
+  if (Invalid) return;
 
-  // Copy the offsets into the FileInfo structure.
-  FI->NumLines = LineOffsets.size();
-  FI->SourceLineCache = Alloc.Allocate<unsigned>(LineOffsets.size());
-  std::copy(LineOffsets.begin(), LineOffsets.end(), FI->SourceLineCache);
+  std::unique_lock<std::mutex> Lock;
+  if (Mutex) Lock = std::unique_lock<std::mutex>(*Mutex);
+  if (FI->SourceLineCache.isComputed()) return;
+
+  // Identical contents have identical lines, so they share one table.
+  // A cache whose owner has since been given other contents computes its
+  // own table.
+  auto *Same = const_cast<ContentCache *>(FI->SharedContents);
+  if (Same && Same->getRawBuffer() == FI->getRawBuffer()) {
+    if (!Same->SourceLineCache.isComputed())
+      ComputeLineNumbers(de, Same, Alloc, SM, Invalid);
+    if (!Invalid) FI->SourceLineCache.share(Same->SourceLineCache);
+    return;
+  }
+  ComputeLineNumbers(de, FI, Alloc, SM, Invalid);
 }
 
 /// GetLineNumber - Given a SrcLoc, return the spelling line number
@@ -1209,6 +1543,12 @@ unsigned SrcMgr::GetLineNumber(SrcID FID, unsigned FilePos,
     return 1;
   }
 
+  LookupCache &Cache = getLookupCache();
+  SrcID &LastLineNoSrcIDQuery = Cache.LastLineNoSrcIDQuery;
+  ContentCache *&LastLineNoContentCache = Cache.LastLineNoContentCache;
+  unsigned &LastLineNoFilePos = Cache.LastLineNoFilePos;
+  unsigned &LastLineNoResult = Cache.LastLineNoResult;
+
   ContentCache *Content;
   if (LastLineNoSrcIDQuery == FID)
     Content = LastLineNoContentCache;
@@ -1225,19 +1565,31 @@ unsigned SrcMgr::GetLineNumber(SrcID FID, unsigned FilePos,
 
   // If this is the first use of line information for this buffer, compute the
   /// SourceLineCache for it on demand.
-  if (!Content->SourceLineCache) {
+  if (!Content->SourceLineCache.isComputed()) {
     bool MyInvalid = false;
-    ComputeLineNumbers(de, Content, ContentCacheAlloc, *this, MyInvalid);
+    EnsureLineNumbers(de, Content, ContentCacheAlloc, *this,
+                      Concurrent ? &ContentMutex : nullptr, MyInvalid);
     if (Invalid) *Invalid = MyInvalid;
     if (MyInvalid) return 1;
   } else if (Invalid)
     *Invalid = false;
 
+  // A compressed table finds the line with a search over its blocks.
+  const unsigned *SourceLineCache = Content->SourceLineCache.getOffsets();
+  if (!SourceLineCache) {
+    unsigned LineNo = Content->SourceLineCache.findLine(FilePos);
+    LastLineNoSrcIDQuery = FID;
+    LastLineNoContentCache = Content;
+    LastLineNoFilePos = FilePos + 1;
+    LastLineNoResult = LineNo;
+    return LineNo;
+  }
+
   // Okay, we know we have a line number table.  Do a binary search to find the
   // line number that this character position lands on.
-  unsigned *SourceLineCache = Content->SourceLineCache;
-  unsigned *SourceLineCacheStart = SourceLineCache;
-  unsigned *SourceLineCacheEnd = SourceLineCache + Content->NumLines;
+  const unsigned *SourceLineCacheStart = SourceLineCache;
+  const unsigned *SourceLineCacheEnd =
+      SourceLineCache + Content->SourceLineCache.size();
 
   unsigned QueriedFilePos = FilePos + 1;
 
@@ -1276,12 +1628,12 @@ unsigned SrcMgr::GetLineNumber(SrcID FID, unsigned FilePos,
         }
       }
     } else {
-      if (LastLineNoResult < Content->NumLines)
+      if (LastLineNoResult < Content->SourceLineCache.size())
         SourceLineCacheEnd = SourceLineCache + LastLineNoResult + 1;
     }
   }
 
-  unsigned *Pos =
+  const unsigned *Pos =
       std::lower_bound(SourceLineCache, SourceLineCacheEnd, QueriedFilePos);
   unsigned LineNo = Pos - SourceLineCacheStart;
 
@@ -1633,20 +1985,21 @@ SrcLoc SrcMgr::translateLineCol(SrcID FID, unsigned Line, unsigned Col) const {
 
   // If this is the first use of line information for this buffer, compute the
   // SourceLineCache for it on demand.
-  if (!Content->SourceLineCache) {
+  if (!Content->SourceLineCache.isComputed()) {
     bool MyInvalid = false;
-    ComputeLineNumbers(de, Content, ContentCacheAlloc, *this, MyInvalid);
+    EnsureLineNumbers(de, Content, ContentCacheAlloc, *this,
+                      Concurrent ? &ContentMutex : nullptr, MyInvalid);
     if (MyInvalid) return SrcLoc();
   }
 
-  if (Line > Content->NumLines) {
+  if (Line > Content->SourceLineCache.size()) {
     unsigned Size = Content->getBuffer(de, *this)->getBufferSize();
     if (Size > 0) --Size;
     return FileLoc.getLocWithOffset(Size);
   }
 
   const llvm::MemoryBuffer *Buffer = Content->getBuffer(de, *this);
-  unsigned FilePos = Content->SourceLineCache[Line - 1];
+  unsigned FilePos = Content->SourceLineCache.getLineStart(Line - 1);
   const char *Buf = Buffer->getBufferStart() + FilePos;
   unsigned BufLength = Buffer->getBufferSize() - FilePos;
   if (BufLength == 0) return FileLoc.getLocWithOffset(FilePos);
@@ -1808,7 +2161,8 @@ SrcLoc SrcMgr::getMacroArgExpandedLocation(SrcLoc Loc) const {
   std::tie(FID, Offset) = getDecomposedLoc(Loc);
   if (FID.isInvalid()) return Loc;
 
-  std::unique_ptr<MacroArgsMap> &MacroArgsCache = MacroArgsCacheMap[FID];
+  std::unique_ptr<MacroArgsMap> &MacroArgsCache =
+      getLookupCache().MacroArgsCacheMap[FID];
   if (!MacroArgsCache) {
     MacroArgsCache = llvm::make_unique<MacroArgsMap>();
     computeMacroArgsCache(*MacroArgsCache, FID);
@@ -1832,7 +2186,7 @@ std::pair<SrcID, unsigned> SrcMgr::getDecomposedIncludedLoc(SrcID FID) const {
   // Uses IncludedLocMap to retrieve/cache the decomposed loc.
 
   using DecompTy = std::pair<SrcID, unsigned>;
-  auto InsertOp = IncludedLocMap.try_emplace(FID);
+  auto InsertOp = getLookupCache().IncludedLocMap.try_emplace(FID);
   DecompTy &DecompLoc = InsertOp.first->second;
   if (!InsertOp.second) return DecompLoc;  // already in map.
 
@@ -1878,14 +2232,15 @@ InBeforeInTUCacheEntry &SrcMgr::getInBeforeInTUCache(SrcID LFID,
   // construct an entry.  We can then return it to the caller for direct
   // use.  When they update the value, the cache will get automatically
   // updated as well.
-  if (IBTUCache.size() < MagicCacheSize) return IBTUCache[Key];
+  LookupCache &Cache = getLookupCache();
+  if (Cache.IBTUCache.size() < MagicCacheSize) return Cache.IBTUCache[Key];
 
   // Otherwise, do a lookup that will not construct a new value.
-  InBeforeInTUCache::iterator I = IBTUCache.find(Key);
-  if (I != IBTUCache.end()) return I->second;
+  InBeforeInTUCache::iterator I = Cache.IBTUCache.find(Key);
+  if (I != Cache.IBTUCache.end()) return I->second;
 
   // Fall back to the overflow value.
-  return IBTUCacheOverflow;
+  return Cache.IBTUCacheOverflow;
 }
 
 /// Determines the order of 2 source locations in the translation unit.
@@ -1997,8 +2352,8 @@ void SrcMgr::PrintStats() const {
   llvm::errs() << FileInfos.size() << " files mapped, " << MemBufferInfos.size()
                << " mem buffers mapped.\n";
   llvm::errs() << LocalSrcLocTable.size() << " local SLocEntry's allocated ("
-               << llvm::capacity_in_bytes(LocalSrcLocTable)
-               << " bytes of capacity), " << NextLocalOffset
+               << LocalSrcLocTable.getMemorySize()
+               << " bytes of capacity), " << getNextLocalOffset()
                << "B of Sloc address space used.\n";
   llvm::errs() << LoadedSrcLocTable.size() << " loaded SLocEntries allocated, "
                << MaxLoadedOffset - CurrentLoadedOffset
@@ -2008,16 +2363,47 @@ void SrcMgr::PrintStats() const {
   unsigned NumFileBytesMapped = 0;
   for (fileinfo_iterator I = fileinfo_begin(), E = fileinfo_end(); I != E;
        ++I) {
-    NumLineNumsComputed += I->second->SourceLineCache != nullptr;
+    NumLineNumsComputed += I->second->SourceLineCache.isComputed();
     NumFileBytesMapped += I->second->getSizeBytesMapped();
   }
-  unsigned NumMacroArgsComputed = MacroArgsCacheMap.size();
+  // In concurrent mode these are the caches of the calling thread.
+  const LookupCache &Cache = getLookupCache();
+  unsigned NumMacroArgsComputed = Cache.MacroArgsCacheMap.size();
 
   llvm::errs() << NumFileBytesMapped << " bytes of files mapped, "
                << NumLineNumsComputed << " files with line #'s computed, "
                << NumMacroArgsComputed << " files with macro args computed.\n";
-  llvm::errs() << "SrcID scans: " << NumLinearScans << " linear, "
-               << NumBinaryProbes << " binary.\n";
+  llvm::errs() << "SrcID scans: " << Cache.NumLinearScans << " linear, "
+               << Cache.NumBinaryProbes << " binary.\n";
+  llvm::errs() << getLineTableBytesSaved()
+               << " bytes saved by compressing line tables.\n";
+  auto Shared = getSharedContentsStats();
+  llvm::errs() << Shared.first << " files share the contents of another ("
+               << Shared.second << " bytes).\n";
+}
+
+std::pair<unsigned, size_t> SrcMgr::getSharedContentsStats() const {
+  unsigned NumShared = 0;
+  size_t BytesShared = 0;
+  for (const auto &FileInfo : FileInfos) {
+    if (!FileInfo.second->SharedContents) continue;
+    ++NumShared;
+    BytesShared += FileInfo.second->getSizeBytesMapped();
+  }
+  return {NumShared, BytesShared};
+}
+
+size_t SrcMgr::getLineTableBytesSaved() const {
+  size_t Saved = 0;
+  auto Count = [&](const ContentCache *CC) {
+    // A shared table is counted once, for the cache that computed it.
+    if (CC->SharedContents) return;
+    const LineOffsetTable &Lines = CC->SourceLineCache;
+    Saved += Lines.getUncompressedSize() - Lines.getMemorySize();
+  };
+  for (const auto &FileInfo : FileInfos) Count(FileInfo.second);
+  for (const ContentCache *CC : MemBufferInfos) Count(CC);
+  return Saved;
 }
 
 LLVM_DUMP_METHOD void SrcMgr::dump() const {
@@ -2061,7 +2447,7 @@ LLVM_DUMP_METHOD void SrcMgr::dump() const {
   // Dump local SLocEntries.
   for (unsigned ID = 0, NumIDs = LocalSrcLocTable.size(); ID != NumIDs; ++ID) {
     DumpSLocEntry(ID, LocalSrcLocTable[ID],
-                  ID == NumIDs - 1 ? NextLocalOffset
+                  ID == NumIDs - 1 ? getNextLocalOffset()
                                    : LocalSrcLocTable[ID + 1].getOffset());
   }
   // Dump loaded SLocEntries.
@@ -2101,7 +2487,7 @@ SrcMgr::MemoryBufferSizes SrcMgr::getMemoryBufferSizes() const {
 
 size_t SrcMgr::getDataStructureSizes() const {
   size_t size = llvm::capacity_in_bytes(MemBufferInfos) +
-                llvm::capacity_in_bytes(LocalSrcLocTable) +
+                LocalSrcLocTable.getMemorySize() +
                 llvm::capacity_in_bytes(LoadedSrcLocTable) +
                 llvm::capacity_in_bytes(SLocEntryLoaded) +
                 llvm::capacity_in_bytes(FileInfos);
@@ -1,13 +1,33 @@
 #include "stone/Core/Stats.h"
 
+#include <algorithm>
+
 using namespace stone;
 
 StatEngine::StatEngine() {}
 
-void StatEngine::Print() {}
-/*
-void StatEngine::AddStatus() {
+void StatEngine::AddStats(std::unique_ptr<Stats> stats) {
+  entries.push_back(stats.get());
+  ownedStats.push_back(std::move(stats));
+}
+
+void StatEngine::AddStats(const Stats &stats) { entries.push_back(&stats); }
 
+void StatEngine::RemoveStats(const Stats &stats) {
+  entries.erase(std::remove(entries.begin(), entries.end(), &stats),
+                entries.end());
+}
+
+llvm::json::Object StatEngine::GetData() const {
+  llvm::json::Object data;
+  for (const Stats *stats : entries) {
+    llvm::json::Object group;
+    stats->GetData(group);
+    data[stats->GetName().str()] = std::move(group);
+  }
+  return data;
+}
 
+void StatEngine::Print() {
+  for (const Stats *stats : entries) stats->Print();
 }
-*/
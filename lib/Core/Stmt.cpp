@@ -1 +1,11 @@
 #include "stone/Core/Stmt.h"
+
+#include "stone/Core/ASTContext.h"
+
+using namespace stone;
+using namespace stone::syntax;
+
+void *Stmt::operator new(std::size_t bytes, const ASTContext &astCtx,
+                         unsigned alignment) {
+  return astCtx.Allocate(bytes, alignment, ArenaKind::Stmt);
+}
@@ -1,33 +1,46 @@
-#include "stone/Analysis/Lexer.h"
-#include "stone/Core/LangOptions.h"
-#include "stone/Core/Mem.h"
+#include "stone/Compile/Frontend.h"
+#include "stone/Compile/Lexer.h"
+#include "stone/Compile/TokenBuffer.h"
+#include "stone/Core/ASTContext.h"
+#include "stone/Core/Char.h"
+#include "stone/Core/Context.h"
+#include "stone/Core/FileMgr.h"
 #include "stone/Core/SrcMgr.h"
 
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "gtest/gtest.h"
 
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
 using namespace stone;
+using namespace stone::analysis;
 
 class LexerTest : public ::testing::Test {
 protected:
-  DiagnosticEngine de;
-  DiagnosticOptions diagOpts;
+  Context ctx;
   FileSystemOptions fmOpts;
-  LangOptions langOpts;
   FileMgr fm;
   SrcMgr sm;
 
 protected:
-  LexerTest() : de(diagOpts, nullptr, false), fm(fmOpts), sm(de, fm) {}
+  LexerTest() : fm(fmOpts), sm(ctx.GetDiagEngine(), fm) {}
 
 protected:
-  std::unique_ptr<Lexer> CreateLexer(llvm::StringRef srcBuffer) {
+  std::unique_ptr<Lexer>
+  CreateLexer(llvm::StringRef srcBuffer,
+              TriviaRetentionMode retention = TriviaRetentionMode::Without) {
 
-    auto memBuffer = llvm::MemoryBuffer::getMemBuffer(srcBuffer);
+    auto memBuffer = llvm::MemoryBuffer::getMemBufferCopy(srcBuffer);
     auto mainSrcID = sm.CreateSrcID(std::move(memBuffer));
 
     sm.SetMainSrcID(mainSrcID);
-    auto lexer = llvm::make_unique<Lexer>(mainSrcID, sm, langOpts /*de*/);
-    return lexer;
+    return llvm::make_unique<Lexer>(mainSrcID, sm, ctx, nullptr, retention);
   }
   std::vector<Token> Lex(llvm::StringRef srcBuffer) {
 
@@ -37,10 +50,9 @@ protected:
       Token token;
       lexer->Lex(token);
       tokens.push_back(token);
-      break;
-      // if(token.GetKind() == tk::eof) {
-      //	break;
-      //}
+      if (token.GetKind() == tk::eof) {
+        break;
+      }
     }
     return tokens;
   }
@@ -53,3 +65,560 @@ TEST_F(LexerTest, GetNextToken) {
 
   ASSERT_EQ(tk::kw_fun, tokens[0].GetKind());
 }
+
+TEST_F(LexerTest, SkipTrivia) {
+  llvm::StringRef srcBuffer = "fun  main /* a */ // b\n"
+                              "    /* c\n d */ x\t/* /* e */ */ y\r\n"
+                              "z";
+  auto tokens = Lex(srcBuffer);
+
+  ASSERT_EQ(6U, tokens.size());
+  EXPECT_EQ("fun", tokens[0].GetText());
+  EXPECT_EQ("main", tokens[1].GetText());
+  EXPECT_FALSE(tokens[1].IsAtStartOfLine());
+  EXPECT_EQ("x", tokens[2].GetText());
+  EXPECT_TRUE(tokens[2].IsAtStartOfLine());
+  EXPECT_EQ("y", tokens[3].GetText());
+  EXPECT_FALSE(tokens[3].IsAtStartOfLine());
+  EXPECT_EQ("z", tokens[4].GetText());
+  EXPECT_TRUE(tokens[4].IsAtStartOfLine());
+  EXPECT_EQ(tk::eof, tokens[5].GetKind());
+}
+
+TEST_F(LexerTest, LexIdentifiers) {
+  auto tokens = Lex("a_very_long_identifier_name_0123456789$ fun\n"
+                    "na\xC3\xAFve \xE6\x97\xA5\xE6\x9C\xAC_x");
+
+  ASSERT_EQ(5U, tokens.size());
+  EXPECT_EQ(tk::identifier, tokens[0].GetKind());
+  EXPECT_EQ("a_very_long_identifier_name_0123456789$", tokens[0].GetText());
+  EXPECT_EQ(tk::kw_fun, tokens[1].GetKind());
+  EXPECT_EQ(tk::identifier, tokens[2].GetKind());
+  EXPECT_EQ("na\xC3\xAFve", tokens[2].GetText());
+  EXPECT_EQ(tk::identifier, tokens[3].GetKind());
+  EXPECT_EQ("\xE6\x97\xA5\xE6\x9C\xAC_x", tokens[3].GetText());
+  EXPECT_EQ(tk::eof, tokens[4].GetKind());
+}
+
+TEST_F(LexerTest, RetainTrivia) {
+  auto lexer = CreateLexer("a \t/* x */ // y\n  /* z\n */b",
+                           TriviaRetentionMode::With);
+  Token token;
+  Trivia leading, trailing;
+
+  lexer->Lex(token, leading, trailing);
+  EXPECT_EQ("a", token.GetText());
+  EXPECT_TRUE(leading.empty());
+  ASSERT_EQ(5U, trailing.size());
+  EXPECT_EQ(TriviaPiece(TriviaKind::Space, 1), trailing.pieces[0]);
+  EXPECT_EQ(TriviaPiece(TriviaKind::Tab, 1), trailing.pieces[1]);
+  EXPECT_EQ(TriviaPiece(TriviaKind::BlockComment, 7), trailing.pieces[2]);
+  EXPECT_EQ(TriviaPiece(TriviaKind::Space, 1), trailing.pieces[3]);
+  EXPECT_EQ(TriviaPiece(TriviaKind::LineComment, 4), trailing.pieces[4]);
+
+  lexer->Lex(token, leading, trailing);
+  EXPECT_EQ("b", token.GetText());
+  EXPECT_TRUE(token.IsAtStartOfLine());
+  ASSERT_EQ(3U, leading.size());
+  EXPECT_EQ(TriviaPiece(TriviaKind::Newline, 1), leading.pieces[0]);
+  EXPECT_EQ(TriviaPiece(TriviaKind::Space, 2), leading.pieces[1]);
+  EXPECT_EQ(TriviaPiece(TriviaKind::BlockComment, 8), leading.pieces[2]);
+  EXPECT_TRUE(trailing.empty());
+}
+
+/// The keyword chain that GetKeywordKind replaced; kept as the reference
+/// for the tests and the benchmark below.
+static tk GetKeywordKindByChain(llvm::StringRef text) {
+#define KEYWORD(kw, S)  \
+  if (text == #kw)      \
+    return (S & TOKON) ? tk::kw_##kw : tk::identifier;
+#include "stone/Core/TokenKind.def"
+  return tk::identifier;
+}
+
+TEST_F(LexerTest, LexIntoTokenBuffer) {
+  // Enough tokens to span several chunks of the buffer.
+  std::string src;
+  for (unsigned i = 0; i < 5000; ++i)
+    src += i % 7 ? "fun x_" + std::to_string(i) + " ( ) " : "\n  { } ;";
+  auto expected = Lex(src);
+
+  auto lexer = CreateLexer(src);
+  llvm::BumpPtrAllocator alloc;
+  TokenBuffer tokens(sm.getBufferData(lexer->GetSrcID()), alloc);
+  lexer->Lex(tokens);
+
+  ASSERT_EQ(expected.size(), tokens.size());
+  for (unsigned i = 0; i < tokens.size(); ++i) {
+    Token tok = tokens.GetToken(i);
+    EXPECT_EQ(expected[i].GetKind(), tok.GetKind()) << i;
+    EXPECT_EQ(expected[i].GetRawText(), tok.GetRawText()) << i;
+    EXPECT_EQ(tok.GetRawText().data(),
+              tokens.GetBuffer().data() + tokens.GetOffset(i))
+        << i;
+    EXPECT_EQ(expected[i].IsAtStartOfLine(), tokens.IsAtStartOfLine(i)) << i;
+  }
+}
+
+TEST_F(LexerTest, TokenCursor) {
+  auto lexer = CreateLexer("fun main ( )");
+  llvm::BumpPtrAllocator alloc;
+  TokenBuffer tokens(sm.getBufferData(lexer->GetSrcID()), alloc);
+  lexer->Lex(tokens);
+  ASSERT_EQ(5U, tokens.size());
+
+  TokenCursor cursor(tokens);
+  EXPECT_TRUE(cursor.Is(tk::kw_fun));
+  EXPECT_EQ(tk::l_paren, cursor.GetKind(2));
+  EXPECT_EQ(tk::eof, cursor.GetKind(100));
+
+  TokenCursor saved = cursor;
+  cursor.Consume();
+  EXPECT_EQ("main", cursor.Peek().GetText());
+  cursor.Consume();
+  cursor.Consume();
+  cursor.Consume();
+  EXPECT_TRUE(cursor.Is(tk::eof));
+  cursor.Consume();
+  EXPECT_TRUE(cursor.Is(tk::eof));
+
+  cursor = saved;
+  EXPECT_TRUE(cursor.Is(tk::kw_fun));
+}
+
+TEST_F(LexerTest, LexFilesInParallel) {
+  std::vector<SrcID> srcIDs;
+  for (unsigned i = 0; i < 32; ++i) {
+    std::string src;
+    for (unsigned j = 0; j < i * 100; ++j)
+      src += "fun f" + std::to_string(j) + "() {}\n";
+    srcIDs.push_back(
+        sm.CreateSrcID(llvm::MemoryBuffer::getMemBufferCopy(src)));
+  }
+
+  auto lexedFiles = stone::analysis::Lex(srcIDs, sm, ctx, /*numThreads=*/4);
+
+  ASSERT_EQ(srcIDs.size(), lexedFiles.size());
+  for (unsigned i = 0; i < srcIDs.size(); ++i) {
+    const TokenBuffer &tokens = lexedFiles[i]->tokens;
+    EXPECT_EQ(sm.getBufferData(srcIDs[i]).data(), tokens.GetBuffer().data());
+    ASSERT_EQ(i * 100 * 6 + 1, tokens.size()) << i;
+    EXPECT_TRUE(tokens.Is(tokens.size() - 1, tk::eof));
+  }
+
+  // A buffer is lexed once, however many times it is listed.
+  auto twice = stone::analysis::Lex({srcIDs[1], srcIDs[1]}, sm, ctx, 2);
+  EXPECT_EQ(twice[0], twice[1]);
+}
+
+TEST_F(LexerTest, RelexMatchesFullLex) {
+  const char *pieces[] = {"fun ", "x1",  " ",       "{",       "}\n",
+                          "(",    ")",   ";",       "/* c */", "// l\n",
+                          "\n  ", "/",   "*",       "a",       "\t",
+                          "7",    "\"q\"", "\""};
+  const unsigned numPieces = sizeof(pieces) / sizeof(pieces[0]);
+  std::mt19937 rng(42);
+
+  std::string text;
+  for (unsigned i = 0; i < 400; ++i) text += pieces[rng() % numPieces];
+  SrcID srcID = sm.CreateSrcID(llvm::MemoryBuffer::getMemBufferCopy(text));
+  auto lexed = llvm::make_unique<LexedFile>(sm.getBufferData(srcID));
+  Lexer(srcID, sm, ctx).Lex(lexed->tokens);
+
+  for (unsigned i = 0; i < 300; ++i) {
+    unsigned offset = rng() % (text.size() + 1);
+    unsigned removedLength =
+        std::min<unsigned>(rng() % 6, text.size() - offset);
+    std::string inserted = rng() % 4 ? pieces[rng() % numPieces] : "";
+    text.replace(offset, removedLength, inserted);
+
+    SrcID newSrcID =
+        sm.CreateSrcID(llvm::MemoryBuffer::getMemBufferCopy(text));
+    auto relexed = llvm::make_unique<LexedFile>(sm.getBufferData(newSrcID));
+    Relex(lexed->tokens, {offset, removedLength, inserted}, newSrcID, sm, ctx,
+          relexed->tokens);
+
+    LexedFile expected(sm.getBufferData(newSrcID));
+    Lexer(newSrcID, sm, ctx).Lex(expected.tokens);
+
+    const TokenBuffer &tokens = relexed->tokens;
+    ASSERT_EQ(expected.tokens.size(), tokens.size()) << i;
+    for (unsigned j = 0; j < tokens.size(); ++j) {
+      ASSERT_EQ(expected.tokens.GetKind(j), tokens.GetKind(j)) << i << " " << j;
+      ASSERT_EQ(expected.tokens.GetOffset(j), tokens.GetOffset(j)) << i;
+      ASSERT_EQ(expected.tokens.GetLength(j), tokens.GetLength(j)) << i;
+      ASSERT_EQ(expected.tokens.GetFlags(j), tokens.GetFlags(j)) << i;
+      ASSERT_EQ(expected.tokens.GetIntegerValue(j), tokens.GetIntegerValue(j))
+          << i;
+    }
+    lexed = std::move(relexed);
+  }
+}
+
+TEST_F(LexerTest, RelexOnlyNearEdit) {
+  std::string text;
+  for (unsigned i = 0; i < 20000; ++i)
+    text += "fun f" + std::to_string(i) + "() { x }\n";
+  SrcID srcID = sm.CreateSrcID(llvm::MemoryBuffer::getMemBufferCopy(text));
+  LexedFile lexed(sm.getBufferData(srcID));
+  Lexer(srcID, sm, ctx).Lex(lexed.tokens);
+
+  // Rename an identifier in the middle of the file.
+  unsigned offset = text.find("f10000");
+  text.replace(offset, 6, "renamed");
+  SrcID newSrcID = sm.CreateSrcID(llvm::MemoryBuffer::getMemBufferCopy(text));
+  LexedFile relexed(sm.getBufferData(newSrcID));
+  unsigned numLexed = Relex(lexed.tokens, {offset, 6, "renamed"}, newSrcID,
+                            sm, ctx, relexed.tokens);
+
+  EXPECT_GE(5U, numLexed);
+  ASSERT_EQ(lexed.tokens.size(), relexed.tokens.size());
+  unsigned index = relexed.tokens.LowerBound(offset);
+  EXPECT_EQ("renamed", relexed.tokens.GetRawText(index));
+  EXPECT_EQ(lexed.tokens.GetOffset(index + 1) + 1,
+            relexed.tokens.GetOffset(index + 1));
+}
+
+TEST_F(LexerTest, RestoreState) {
+  llvm::StringRef srcBuffer = "fun main(a: Accelerator<T>) /* c */\n"
+                              "  {  x // y\n"
+                              "}";
+  auto lexer = CreateLexer(srcBuffer, TriviaRetentionMode::With);
+
+  Token tok;
+  Trivia leading, trailing;
+  lexer->Lex(tok, leading, trailing);
+  lexer->Lex(tok, leading, trailing);
+  LexerState state = lexer->GetState();
+
+  std::vector<Token> tokens;
+  std::vector<Trivia> trivia;
+  do {
+    lexer->Lex(tok, leading, trailing);
+    tokens.push_back(tok);
+    trivia.push_back(leading);
+    trivia.push_back(trailing);
+  } while (tok.IsNot(tk::eof));
+
+  // Lexing again from the restored state gives the same tokens and trivia.
+  for (unsigned round = 0; round < 2; ++round) {
+    lexer->RestoreState(state);
+    for (unsigned i = 0; i < tokens.size(); ++i) {
+      lexer->Lex(tok, leading, trailing);
+      EXPECT_EQ(tokens[i].GetKind(), tok.GetKind()) << i;
+      EXPECT_EQ(tokens[i].GetRawText().data(), tok.GetRawText().data()) << i;
+      EXPECT_EQ(tokens[i].IsAtStartOfLine(), tok.IsAtStartOfLine()) << i;
+      EXPECT_EQ(trivia[2 * i], leading) << i;
+      EXPECT_EQ(trivia[2 * i + 1], trailing) << i;
+    }
+  }
+}
+
+TEST_F(LexerTest, LexNumbers) {
+  struct {
+    const char *text;
+    tk kind;
+    bool hasValue;
+    uint64_t value;
+  } cases[] = {
+      {"0", tk::integer_literal, true, 0},
+      {"7", tk::integer_literal, true, 7},
+      {"1_000_000", tk::integer_literal, true, 1000000},
+      {"12345678", tk::integer_literal, true, 12345678},
+      {"1234567890123456789", tk::integer_literal, true, 1234567890123456789},
+      {"18446744073709551615", tk::integer_literal, true, UINT64_MAX},
+      {"18446744073709551616", tk::integer_literal, false, 0},
+      {"99999999999999999999999", tk::integer_literal, false, 0},
+      {"0x_Ff", tk::unk, false, 0},
+      {"0xFf_ff", tk::integer_literal, true, 0xffff},
+      {"0xffffffffffffffff", tk::integer_literal, true, UINT64_MAX},
+      {"0x1_0000_0000_0000_0000", tk::integer_literal, false, 0},
+      {"0o17", tk::integer_literal, true, 017},
+      {"0b1011", tk::integer_literal, true, 11},
+      {"0b", tk::unk, false, 0},
+      {"0b12", tk::unk, false, 0},
+      {"0o8", tk::unk, false, 0},
+      {"12abc", tk::unk, false, 0},
+      {"1.5", tk::floating_literal, false, 0},
+      {"1_0.2_5e-1_0", tk::floating_literal, false, 0},
+      {"1e10", tk::floating_literal, false, 0},
+      {"1E+3", tk::floating_literal, false, 0},
+      {"1e", tk::unk, false, 0},
+      {"0x1p4", tk::floating_literal, false, 0},
+      {"0x1.8p-1", tk::floating_literal, false, 0},
+      {"0x1.8", tk::unk, false, 0},
+  };
+  for (const auto &c : cases) {
+    auto lexer = CreateLexer(c.text);
+    llvm::BumpPtrAllocator alloc;
+    TokenBuffer tokens(sm.getBufferData(lexer->GetSrcID()), alloc);
+    lexer->Lex(tokens);
+    ASSERT_EQ(2U, tokens.size()) << c.text;
+    EXPECT_EQ(c.kind, tokens.GetKind(0)) << c.text;
+    EXPECT_EQ(c.text, tokens.GetRawText(0)) << c.text;
+    auto value = tokens.GetIntegerValue(0);
+    EXPECT_EQ(c.hasValue, value.hasValue()) << c.text;
+    if (c.hasValue && value) {
+      EXPECT_EQ(c.value, *value) << c.text;
+    }
+  }
+
+  // A '.' not followed by a digit ends the number.
+  auto tokens = Lex("1.description 0xff.description 0x1.x");
+  ASSERT_EQ(10U, tokens.size());
+  EXPECT_EQ("1", tokens[0].GetText());
+  EXPECT_EQ("description", tokens[2].GetText());
+  EXPECT_EQ("0xff", tokens[3].GetText());
+  EXPECT_EQ(tk::integer_literal, tokens[3].GetKind());
+  EXPECT_EQ("0x1", tokens[6].GetText());
+}
+
+TEST_F(LexerTest, LexStrings) {
+  auto tokens = Lex(R"("abc" "a\"b\\" #"a\"b"# ##"x"#y"## """
+  a "quoted" line
+  """ "")");
+  ASSERT_EQ(7U, tokens.size());
+  for (unsigned i = 0; i < 6; ++i)
+    EXPECT_EQ(tk::string_literal, tokens[i].GetKind()) << i;
+
+  EXPECT_EQ(R"("abc")", tokens[0].GetText());
+  EXPECT_FALSE(tokens[0].HasEscapes());
+  EXPECT_EQ(R"("a\"b\\")", tokens[1].GetText());
+  EXPECT_TRUE(tokens[1].HasEscapes());
+  EXPECT_EQ(R"(#"a\"b"#)", tokens[2].GetText());
+  EXPECT_EQ(1U, tokens[2].GetCustomDelimiterLen());
+  EXPECT_FALSE(tokens[2].HasEscapes());
+  EXPECT_EQ(R"(##"x"#y"##)", tokens[3].GetText());
+  EXPECT_EQ(2U, tokens[3].GetCustomDelimiterLen());
+  EXPECT_TRUE(tokens[4].IsMultilineString());
+  EXPECT_EQ(R"("")", tokens[5].GetText());
+
+  // Unterminated literals end at the line break.
+  tokens = Lex("\"abc\nx \"a\\\"");
+  ASSERT_EQ(4U, tokens.size());
+  EXPECT_EQ(tk::unk, tokens[0].GetKind());
+  EXPECT_EQ("\"abc", tokens[0].GetText());
+  EXPECT_EQ("x", tokens[1].GetText());
+  EXPECT_EQ(tk::unk, tokens[2].GetKind());
+}
+
+TEST_F(LexerTest, StringLiteralValues) {
+  SearchPathOptions spOpts;
+  syntax::ASTContext ac(ctx, spOpts, sm);
+  struct {
+    const char *text;
+    StringRef value;
+  } cases[] = {
+      {R"("abc")", "abc"},
+      {R"("a\tb\n\\\"\'\0")", StringRef("a\tb\n\\\"'\0", 8)},
+      {R"("\u{41}\u{e9}\u{1F600}")", "A\xC3\xA9\xF0\x9F\x98\x80"},
+      {R"("\u{zz}")", "u{zz}"},
+      {R"(#"a\nb\#tc"#)", "a\\nb\tc"},
+      {"\"\"\"\n    one\n      two\\t\n    \"\"\"", "one\n  two\t"},
+      {"\"\"\"\r\n  a \\\n  b\r\n  \"\"\"", "a b"},
+  };
+  for (const auto &c : cases) {
+    auto tokens = Lex(c.text);
+    ASSERT_EQ(tk::string_literal, tokens[0].GetKind()) << c.text;
+    EXPECT_EQ(c.value, GetStringLiteralValue(tokens[0], ac)) << c.text;
+  }
+
+  // Literals without escapes are not copied.
+  auto tokens = Lex(R"("abc")");
+  EXPECT_EQ(tokens[0].GetText().data() + 1,
+            GetStringLiteralValue(tokens[0], ac).data());
+}
+
+TEST_F(LexerTest, IdentifierHash) {
+  SearchPathOptions spOpts;
+  syntax::ASTContext ac(ctx, spOpts, sm);
+  auto tokens = Lex(
+      "fun x na\xC3\xAFve\xE6\x97\xA5_y 42 a_very_long_name "
+      "a_much_longer_name_with_\xC3\xAF_after_the_first_sixteen_bytes");
+
+  ASSERT_EQ(7U, tokens.size());
+  for (unsigned i : {0, 1, 2, 4, 5}) {
+    StringRef text = tokens[i].GetText();
+    EXPECT_EQ(syntax::IdentifierTable::HashName(text),
+              tokens[i].GetIdentifierHash())
+        << text.str();
+    EXPECT_EQ(&ac.GetIdentifier(text),
+              &ac.GetIdentifier(text, tokens[i].GetIdentifierHash()));
+  }
+  EXPECT_EQ(0U, tokens[3].GetIdentifierHash());
+
+  // The hash survives a round trip through a TokenBuffer.
+  auto lexer = CreateLexer("fun x 42 y");
+  llvm::BumpPtrAllocator alloc;
+  TokenBuffer buffer(sm.getBufferData(lexer->GetSrcID()), alloc);
+  lexer->Lex(buffer);
+  EXPECT_EQ(syntax::IdentifierTable::HashName("fun"),
+            buffer.GetToken(0).GetIdentifierHash());
+  EXPECT_EQ(syntax::IdentifierTable::HashName("x"),
+            buffer.GetToken(1).GetIdentifierHash());
+  EXPECT_EQ(0U, buffer.GetToken(2).GetIdentifierHash());
+  EXPECT_EQ(syntax::IdentifierTable::HashName("y"),
+            buffer.GetToken(3).GetIdentifierHash());
+}
+
+TEST(KeywordTest, MatchesTokenKindDef) {
+#define KEYWORD(kw, S) \
+  EXPECT_EQ(GetKeywordKindByChain(#kw), analysis::GetKeywordKind(#kw)) << #kw;
+#include "stone/Core/TokenKind.def"
+
+  EXPECT_EQ(tk::kw_fun, analysis::GetKeywordKind("fun"));
+  EXPECT_EQ(tk::kw__, analysis::GetKeywordKind("_"));
+  // Reserved keywords are still identifiers.
+  EXPECT_EQ(tk::identifier, analysis::GetKeywordKind("internal"));
+  EXPECT_EQ(tk::identifier, analysis::GetKeywordKind("own"));
+  // Same length and first character as a keyword.
+  EXPECT_EQ(tk::kw_true, analysis::GetKeywordKind("true"));
+  EXPECT_EQ(tk::kw_type, analysis::GetKeywordKind("type"));
+  EXPECT_EQ(tk::identifier, analysis::GetKeywordKind("tyre"));
+  EXPECT_EQ(tk::identifier, analysis::GetKeywordKind("i9"));
+  EXPECT_EQ(tk::identifier, analysis::GetKeywordKind("__"));
+  EXPECT_EQ(tk::identifier, analysis::GetKeywordKind("Fun"));
+  EXPECT_EQ(tk::identifier, analysis::GetKeywordKind("continues"));
+}
+
+/// Run with --gtest_also_run_disabled_tests
+/// --gtest_filter=KeywordTest.DISABLED_Benchmark
+TEST(KeywordTest, DISABLED_Benchmark) {
+  // Classify every identifier and keyword of the sources in tests/syntax.
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> files;
+  std::vector<llvm::StringRef> words;
+  std::error_code ec;
+  for (llvm::sys::fs::directory_iterator it(STONE_TESTS_DIR "/syntax", ec), end;
+       it != end && !ec; it.increment(ec)) {
+    if (llvm::sys::path::extension(it->path()) != ".stone") continue;
+    auto file = llvm::MemoryBuffer::getFile(it->path());
+    ASSERT_TRUE(bool(file)) << it->path();
+    llvm::StringRef text = (*file)->getBuffer();
+    for (size_t i = 0; i < text.size();) {
+      if (!stone::isIdentifierHead(text[i], /*AllowDollar=*/true)) {
+        ++i;
+        continue;
+      }
+      size_t start = i;
+      while (i < text.size() &&
+             stone::isIdentifierBody(text[i], /*AllowDollar=*/true))
+        ++i;
+      words.push_back(text.slice(start, i));
+    }
+    files.push_back(std::move(*file));
+  }
+  ASSERT_FALSE(words.empty());
+  const unsigned NumRounds = 40000000 / words.size() + 1;
+
+  auto Time = [&](tk (*classify)(llvm::StringRef)) {
+    unsigned keywords = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < NumRounds; ++i)
+      for (auto word : words)
+        keywords += classify(word) != tk::identifier;
+    auto end = std::chrono::steady_clock::now();
+    EXPECT_NE(0U, keywords);
+    return std::chrono::duration<double, std::milli>(end - start).count();
+  };
+  double chainMs = Time(GetKeywordKindByChain);
+  double mapMs = Time(analysis::GetKeywordKind);
+  std::printf("%zu words from tests/syntax; keyword chain: %.1f ms, "
+              "keyword map: %.1f ms\n",
+              words.size(), chainMs, mapMs);
+}
+
+/// The range chains that the UnicodeCharSet tables replaced; kept as the
+/// reference for the tests and the benchmark below.
+static bool IsValidIdentifierContinuationCodePointByChain(uint32_t c) {
+  if (c < 0x80) return stone::isIdentifierBody(c, /*dollar*/ true);
+
+  // N1518: Recommendations for extended identifier characters for C and C++
+  // Proposed Annex X.1: Ranges of characters allowed
+  return c == 0x00A8 || c == 0x00AA || c == 0x00AD || c == 0x00AF ||
+         (c >= 0x00B2 && c <= 0x00B5) || (c >= 0x00B7 && c <= 0x00BA) ||
+         (c >= 0x00BC && c <= 0x00BE) || (c >= 0x00C0 && c <= 0x00D6) ||
+         (c >= 0x00D8 && c <= 0x00F6) || (c >= 0x00F8 && c <= 0x00FF)
+
+         || (c >= 0x0100 && c <= 0x167F) || (c >= 0x1681 && c <= 0x180D) ||
+         (c >= 0x180F && c <= 0x1FFF)
+
+         || (c >= 0x200B && c <= 0x200D) || (c >= 0x202A && c <= 0x202E) ||
+         (c >= 0x203F && c <= 0x2040) || c == 0x2054 ||
+         (c >= 0x2060 && c <= 0x206F)
+
+         || (c >= 0x2070 && c <= 0x218F) || (c >= 0x2460 && c <= 0x24FF) ||
+         (c >= 0x2776 && c <= 0x2793) || (c >= 0x2C00 && c <= 0x2DFF) ||
+         (c >= 0x2E80 && c <= 0x2FFF)
+
+         || (c >= 0x3004 && c <= 0x3007) || (c >= 0x3021 && c <= 0x302F) ||
+         (c >= 0x3031 && c <= 0x303F)
+
+         || (c >= 0x3040 && c <= 0xD7FF)
+
+         || (c >= 0xF900 && c <= 0xFD3D) || (c >= 0xFD40 && c <= 0xFDCF) ||
+         (c >= 0xFDF0 && c <= 0xFE44) || (c >= 0xFE47 && c <= 0xFFF8)
+
+         || (c >= 0x10000 && c <= 0x1FFFD) || (c >= 0x20000 && c <= 0x2FFFD) ||
+         (c >= 0x30000 && c <= 0x3FFFD) || (c >= 0x40000 && c <= 0x4FFFD) ||
+         (c >= 0x50000 && c <= 0x5FFFD) || (c >= 0x60000 && c <= 0x6FFFD) ||
+         (c >= 0x70000 && c <= 0x7FFFD) || (c >= 0x80000 && c <= 0x8FFFD) ||
+         (c >= 0x90000 && c <= 0x9FFFD) || (c >= 0xA0000 && c <= 0xAFFFD) ||
+         (c >= 0xB0000 && c <= 0xBFFFD) || (c >= 0xC0000 && c <= 0xCFFFD) ||
+         (c >= 0xD0000 && c <= 0xDFFFD) || (c >= 0xE0000 && c <= 0xEFFFD);
+}
+
+static bool IsValidIdentifierStartCodePointByChain(uint32_t c) {
+  if (!IsValidIdentifierContinuationCodePointByChain(c)) return false;
+
+  if (c < 0x80 && (stone::isDigit(c) || c == '$')) return false;
+
+  // N1518: Recommendations for extended identifier characters for C and C++
+  // Proposed Annex X.2: Ranges of characters disallowed initially
+  if ((c >= 0x0300 && c <= 0x036F) || (c >= 0x1DC0 && c <= 0x1DFF) ||
+      (c >= 0x20D0 && c <= 0x20FF) || (c >= 0xFE20 && c <= 0xFE2F))
+    return false;
+
+  return true;
+}
+
+TEST(UnicodeIdentifierTest, MatchesRangeChain) {
+  for (uint32_t c = 0; c <= 0x10FFFF; ++c) {
+    ASSERT_EQ(IsValidIdentifierContinuationCodePointByChain(c),
+              IsValidIdentifierContinuationCodePoint(c))
+        << c;
+    ASSERT_EQ(IsValidIdentifierStartCodePointByChain(c),
+              IsValidIdentifierStartCodePoint(c))
+        << c;
+  }
+}
+
+/// Run with --gtest_also_run_disabled_tests
+/// --gtest_filter=UnicodeIdentifierTest.DISABLED_Benchmark
+TEST(UnicodeIdentifierTest, DISABLED_Benchmark) {
+  // Code points of identifiers in localized sources: CJK ideographs with
+  // kana, and Cyrillic.
+  std::vector<uint32_t> cjk, cyrillic;
+  for (uint32_t i = 0; i < 4096; ++i) {
+    cjk.push_back(i % 5 ? 0x4E00 + (i * 37) % 0x5200 : 0x3041 + i % 0x56);
+    cyrillic.push_back(0x0410 + (i * 7) % 0x40);
+  }
+  constexpr unsigned NumRounds = 5000;
+
+  auto Time = [&](const std::vector<uint32_t> &corpus,
+                  bool (*isContinuation)(uint32_t)) {
+    unsigned count = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < NumRounds; ++i)
+      for (auto c : corpus) count += isContinuation(c);
+    auto end = std::chrono::steady_clock::now();
+    EXPECT_EQ(NumRounds * corpus.size(), count);
+    return std::chrono::duration<double, std::milli>(end - start).count();
+  };
+  for (auto corpus : {&cjk, &cyrillic}) {
+    double chainMs =
+        Time(*corpus, IsValidIdentifierContinuationCodePointByChain);
+    double setMs = Time(*corpus, IsValidIdentifierContinuationCodePoint);
+    std::printf("%s: range chain: %.1f ms, UnicodeCharSet: %.1f ms\n",
+                corpus == &cjk ? "CJK" : "Cyrillic", chainMs, setMs);
+  }
+}
@@ -0,0 +1,172 @@
+#include "stone/Core/ASTContext.h"
+#include "stone/Core/Context.h"
+#include "stone/Core/Decl.h"
+#include "stone/Core/FileMgr.h"
+#include "stone/Core/FileSystemOptions.h"
+#include "stone/Core/NodeRef.h"
+#include "stone/Core/SearchPathOptions.h"
+#include "stone/Core/SrcMgr.h"
+
+#include "llvm/Support/JSON.h"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace stone;
+using namespace stone::syntax;
+
+class ASTContextTest : public ::testing::Test {
+protected:
+  Context ctx;
+  SearchPathOptions spOpts;
+  FileSystemOptions fmOpts;
+  FileMgr fm;
+  SrcMgr sm;
+  ASTContext ac;
+
+protected:
+  ASTContextTest()
+      : fm(fmOpts), sm(ctx.GetDiagEngine(), fm), ac(ctx, spOpts, sm) {}
+};
+
+TEST_F(ASTContextTest, ArenaUsage) {
+  ac.GetStats().Sample("start");
+  for (unsigned i = 0; i != 1000; ++i) ac.Allocate(48, 8, ArenaKind::Decl);
+  ac.Allocate(16, 8, ArenaKind::Expr);
+  llvm::StringRef copy = ac.CopyString("hello");
+  EXPECT_EQ("hello", copy);
+  ac.GetStats().Sample("end");
+
+  ArenaUsage decls = ac.GetArenaUsage(ArenaKind::Decl);
+  EXPECT_EQ(48000U, decls.bytesAllocated);
+  EXPECT_GE(decls.totalMemory, decls.bytesAllocated);
+  EXPECT_GE(decls.numSlabs, 1U);
+  EXPECT_EQ(decls.totalMemory - decls.bytesAllocated, decls.GetWastedBytes());
+  EXPECT_EQ(decls.totalMemory, decls.peakMemory);
+  EXPECT_EQ(16U, ac.GetArenaUsage(ArenaKind::Expr).bytesAllocated);
+  EXPECT_EQ(5U, ac.GetArenaUsage(ArenaKind::String).bytesAllocated);
+  EXPECT_EQ(0U, ac.GetArenaUsage(ArenaKind::Type).numSlabs);
+  // The keywords are in the identifier table from the start.
+  EXPECT_GT(ac.GetIdentifierArenaUsage().bytesAllocated, 0U);
+
+  llvm::json::Object data;
+  ac.GetStats().GetData(data);
+  const llvm::json::Object *arenas = data.getObject("arenas");
+  ASSERT_TRUE(arenas);
+  EXPECT_EQ(int64_t(decls.bytesAllocated),
+            *arenas->getObject("decls")->getInteger("bytesAllocated"));
+  EXPECT_TRUE(arenas->getObject("identifiers"));
+
+  const llvm::json::Array *samples = data.getArray("samples");
+  ASSERT_TRUE(samples);
+  ASSERT_EQ(2U, samples->size());
+  auto getDeclMemory = [](const llvm::json::Value &sample) {
+    return *sample.getAsObject()->getObject("totalMemory")->getInteger("decls");
+  };
+  EXPECT_EQ(0, getDeclMemory((*samples)[0]));
+  EXPECT_EQ(int64_t(decls.totalMemory), getDeclMemory((*samples)[1]));
+}
+
+TEST_F(ASTContextTest, ThreadArenas) {
+  const unsigned NumThreads = 4, NumNodes = 10000;
+  ac.Allocate(48, 8, ArenaKind::Decl);
+
+  // Each thread allocates from arenas of its own, and writes its nodes to
+  // see that no two threads were handed the same memory.
+  std::vector<std::vector<char *>> nodes(NumThreads);
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t != NumThreads; ++t) {
+    threads.emplace_back([&, t] {
+      for (unsigned i = 0; i != NumNodes; ++i) {
+        auto *node = static_cast<char *>(ac.Allocate(48, 8, ArenaKind::Decl));
+        std::fill(node, node + 48, char(t));
+        nodes[t].push_back(node);
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  for (unsigned t = 0; t != NumThreads; ++t) {
+    for (char *node : nodes[t]) ASSERT_EQ(char(t), node[47]);
+  }
+  EXPECT_EQ(NumThreads + 1, ac.GetNumThreadArenas());
+  EXPECT_EQ(48U * (NumThreads * NumNodes + 1),
+            ac.GetArenaUsage(ArenaKind::Decl).bytesAllocated);
+  EXPECT_GE(ac.GetSizeOfMemUsed(), 48U * NumThreads * NumNodes);
+}
+
+TEST_F(ASTContextTest, ThreadArenasAfterEviction) {
+  // More contexts than a thread has slots for, visited in turn, so that
+  // each visit finds its slot taken by another context.
+  const unsigned NumContexts = 6, NumRounds = 10;
+  std::vector<std::unique_ptr<ASTContext>> contexts;
+  for (unsigned i = 0; i != NumContexts; ++i)
+    contexts.emplace_back(new ASTContext(ctx, spOpts, sm));
+  for (unsigned round = 0; round != NumRounds; ++round) {
+    for (auto &context : contexts) context->Allocate(48, 8, ArenaKind::Decl);
+  }
+
+  for (auto &context : contexts) {
+    EXPECT_EQ(1U, context->GetNumThreadArenas());
+    EXPECT_EQ(1U, context->GetArenaUsage(ArenaKind::Decl).numSlabs);
+    EXPECT_EQ(48U * NumRounds,
+              context->GetArenaUsage(ArenaKind::Decl).bytesAllocated);
+  }
+}
+
+TEST_F(ASTContextTest, NodeRefs) {
+  // Enough decls to fill a few slabs, and an expr too large for one slab.
+  std::vector<char *> nodes;
+  for (unsigned i = 0; i != 100000; ++i)
+    nodes.push_back(static_cast<char *>(ac.Allocate(48, 8, ArenaKind::Decl)));
+  const size_t LargeSize = 3 * SlabTable::SlabSize;
+  nodes.push_back(
+      static_cast<char *>(ac.Allocate(LargeSize, 8, ArenaKind::Expr)));
+  nodes.push_back(static_cast<char *>(ac.Allocate(48, 8, ArenaKind::Stmt)));
+  EXPECT_GT(ac.GetNodeSlabs().GetNumSlabs(), 5U);
+
+  std::vector<uint32_t> values;
+  for (char *node : nodes) {
+    NodeRef<char> ref(node);
+    ASSERT_TRUE(ref);
+    ASSERT_EQ(node, ref.Get(ac.GetNodeSlabs()));
+    // Any node of the context finds the table.
+    ASSERT_EQ(node, ref.Get(nodes.front()));
+    values.push_back(ref.GetOpaqueValue());
+  }
+  std::sort(values.begin(), values.end());
+  EXPECT_EQ(values.end(), std::unique(values.begin(), values.end()));
+
+  NodeRef<char> null(nullptr);
+  EXPECT_TRUE(null.IsNull());
+  EXPECT_EQ(nullptr, null.Get(nodes.front()));
+  EXPECT_GE(ac.GetArenaUsage(ArenaKind::Expr).totalMemory, LargeSize);
+}
+
+TEST_F(ASTContextTest, DeclLinks) {
+  EXPECT_EQ(24U, sizeof(Decl));
+
+  SpaceDecl *outer = SpaceDecl::Create(ac, nullptr, SrcLoc(), DeclName());
+  SpaceDecl *first = SpaceDecl::Create(ac, outer, SrcLoc(), DeclName());
+  SpaceDecl *second = SpaceDecl::Create(ac, outer, SrcLoc(), DeclName());
+  EXPECT_EQ(nullptr, outer->GetDeclContext());
+  EXPECT_EQ(outer, first->GetDeclContext());
+  EXPECT_EQ(outer, first->GetLexicalDeclContext());
+
+  EXPECT_EQ(nullptr, outer->GetFirstDecl());
+  outer->AddDecl(first);
+  outer->AddDecl(second);
+  EXPECT_EQ(first, outer->GetFirstDecl());
+  EXPECT_EQ(second, outer->GetLastDecl());
+  EXPECT_EQ(second, first->GetNextDeclInContext());
+  EXPECT_EQ(nullptr, second->GetNextDeclInContext());
+
+  second->SetLexicalDeclContext(first);
+  EXPECT_EQ(outer, second->GetDeclContext());
+  EXPECT_EQ(first, second->GetLexicalDeclContext());
+  second->SetLexicalDeclContext(outer);
+  EXPECT_EQ(outer, second->GetLexicalDeclContext());
+}
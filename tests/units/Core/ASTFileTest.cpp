@@ -0,0 +1,155 @@
+#include "stone/Core/ASTFile.h"
+#include "stone/Core/ASTContext.h"
+#include "stone/Core/Context.h"
+#include "stone/Core/Decl.h"
+#include "stone/Core/FileMgr.h"
+#include "stone/Core/FileSystemOptions.h"
+#include "stone/Core/SearchPathOptions.h"
+#include "stone/Core/SrcMgr.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "gtest/gtest.h"
+
+#include <string>
+
+using namespace stone;
+using namespace stone::syntax;
+
+class ASTFileTest : public ::testing::Test {
+protected:
+  Context ctx;
+  SearchPathOptions spOpts;
+  FileSystemOptions fmOpts;
+  FileMgr fm;
+  SrcMgr sm;
+  ASTContext ac;
+  /// The context that the files are read into.
+  ASTContext readerAC;
+
+protected:
+  ASTFileTest()
+      : fm(fmOpts), sm(ctx.GetDiagEngine(), fm), ac(ctx, spOpts, sm),
+        readerAC(ctx, spOpts, sm) {}
+
+  SpaceDecl *AddSpace(DeclContext *dc, llvm::StringRef name,
+                      SrcLoc loc = SrcLoc()) {
+    SpaceDecl *space = SpaceDecl::Create(ac, dc, loc, &ac.GetIdentifier(name));
+    dc->AddDecl(space);
+    return space;
+  }
+
+  std::unique_ptr<ASTFile> Read(const DeclContext &module) {
+    std::string image;
+    llvm::raw_string_ostream os(image);
+    ASTFile::Write(module, "Math", ac, os);
+    auto file = ASTFile::Create(
+        llvm::MemoryBuffer::getMemBufferCopy(os.str()), readerAC);
+    EXPECT_TRUE(bool(file));
+    return file ? std::move(*file) : nullptr;
+  }
+};
+
+TEST_F(ASTFileTest, LazyLookup) {
+  SpaceDecl *module = SpaceDecl::Create(ac, nullptr, SrcLoc(), DeclName());
+  AddSpace(module, "sqrt");
+  SpaceDecl *vec = AddSpace(module, "Vec");
+  AddSpace(vec, "dot");
+  AddSpace(vec, "sqrt");
+  for (unsigned i = 0; i != 100; ++i)
+    AddSpace(module, "unused" + std::to_string(i));
+
+  std::unique_ptr<ASTFile> file = Read(*module);
+  ASSERT_TRUE(file);
+  EXPECT_EQ("Math", file->GetModuleName());
+  EXPECT_EQ(104U, file->GetNumDecls());
+  EXPECT_EQ(0U, file->GetNumMaterializedDecls());
+
+  llvm::SmallVector<Decl *, 2> results;
+  file->Lookup("sqrt", results);
+  ASSERT_EQ(1U, results.size());
+  EXPECT_EQ("sqrt", static_cast<SpaceDecl *>(results[0])->GetName());
+  EXPECT_EQ(nullptr, results[0]->GetDeclContext());
+  EXPECT_EQ(1U, file->GetNumMaterializedDecls());
+
+  // A member of a nested space brings in the spaces it is in.
+  auto moduleMembers = file->GetMemberIDs();
+  EXPECT_EQ(102U, moduleMembers.second);
+  ASTFile::DeclID vecID = moduleMembers.first + 1;
+  EXPECT_EQ(2U, file->GetMemberIDs(vecID).second);
+  results.clear();
+  file->Lookup("dot", results, vecID);
+  ASSERT_EQ(1U, results.size());
+  Decl *readVec = file->GetDecl(vecID);
+  EXPECT_EQ(readVec->GetAsDeclContext(), results[0]->GetDeclContext());
+  EXPECT_EQ(3U, file->GetNumMaterializedDecls());
+
+  // Looking up again hands out the same decl.
+  results.clear();
+  file->Lookup("dot", results, vecID);
+  ASSERT_EQ(1U, results.size());
+  EXPECT_EQ(3U, file->GetNumMaterializedDecls());
+
+  results.clear();
+  file->Lookup("dot", results);
+  file->Lookup("cbrt", results);
+  EXPECT_TRUE(results.empty());
+  EXPECT_EQ(nullptr, file->GetDecl(file->GetNumDecls() + 1));
+}
+
+TEST_F(ASTFileTest, Locations) {
+  llvm::SmallString<128> sourcePath, astPath;
+  int fd;
+  ASSERT_FALSE(
+      llvm::sys::fs::createTemporaryFile("astfile", "stone", fd, sourcePath));
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    os << "space Vec {}\n";
+  }
+  const SrcFile *source = fm.getFile(sourcePath);
+  ASSERT_TRUE(source);
+  SrcID srcID = sm.CreateSrcID(source, SrcLoc(), src::C_User);
+  SrcLoc loc = sm.getLocForStartOfFile(srcID).getLocWithOffset(6);
+
+  SpaceDecl *module = SpaceDecl::Create(ac, nullptr, SrcLoc(), DeclName());
+  AddSpace(module, "Vec", loc);
+  ASSERT_FALSE(
+      llvm::sys::fs::createTemporaryFile("astfile", "stoneast", fd, astPath));
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    ASTFile::Write(*module, "Math", ac, os);
+  }
+
+  auto file = ASTFile::Load(astPath, readerAC);
+  ASSERT_TRUE(bool(file));
+  llvm::SmallVector<Decl *, 1> results;
+  (*file)->Lookup("Vec", results);
+  ASSERT_EQ(1U, results.size());
+  EXPECT_EQ(loc, results[0]->GetLoc());
+
+  llvm::sys::fs::remove(sourcePath);
+  llvm::sys::fs::remove(astPath);
+}
+
+TEST_F(ASTFileTest, RejectBadImages) {
+  SpaceDecl *module = SpaceDecl::Create(ac, nullptr, SrcLoc(), DeclName());
+  AddSpace(module, "sqrt");
+  std::string image;
+  llvm::raw_string_ostream os(image);
+  ASTFile::Write(*module, "Math", ac, os);
+  os.flush();
+
+  EXPECT_FALSE(bool(ASTFile::Create(
+      llvm::MemoryBuffer::getMemBufferCopy(image.substr(0, 16)), readerAC)));
+  std::string badMagic = image;
+  badMagic[0] = 'X';
+  EXPECT_FALSE(bool(ASTFile::Create(
+      llvm::MemoryBuffer::getMemBufferCopy(badMagic), readerAC)));
+  EXPECT_FALSE(bool(ASTFile::Create(
+      llvm::MemoryBuffer::getMemBufferCopy(image.substr(0, image.size() - 1)),
+      readerAC)));
+  EXPECT_TRUE(bool(
+      ASTFile::Create(llvm::MemoryBuffer::getMemBufferCopy(image), readerAC)));
+}
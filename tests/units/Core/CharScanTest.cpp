@@ -0,0 +1,112 @@
+#include "stone/Core/CharScan.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using namespace stone;
+using namespace stone::ch;
+
+class CharScanTest : public ::testing::TestWithParam<SIMDLevel> {
+ protected:
+  SIMDLevel savedLevel;
+
+  void SetUp() override {
+    savedLevel = GetSIMDLevel();
+    SetSIMDLevel(GetParam());
+  }
+  void TearDown() override { SetSIMDLevel(savedLevel); }
+};
+
+TEST_P(CharScanTest, SkipHorizontalWhitespace) {
+  // Cover the scalar tail and both vector widths at every offset.
+  for (unsigned len = 0; len < 80; ++len) {
+    std::string text = std::string(len, ' ') + "x" + std::string(40, ' ');
+    for (unsigned i = 0; i < len; ++i) text[i] = " \t\f\v"[i % 4];
+    const char *begin = text.data();
+    const char *end = begin + text.size();
+    EXPECT_EQ(begin + len, SkipHorizontalWhitespace(begin, end)) << len;
+    EXPECT_EQ(begin + len, SkipHorizontalWhitespace(begin, begin + len));
+  }
+  std::string newline = "    \n";
+  EXPECT_EQ(newline.data() + 4,
+            SkipHorizontalWhitespace(newline.data(),
+                                     newline.data() + newline.size()));
+}
+
+TEST_P(CharScanTest, SkipIdentifierBody) {
+  const char body[] = "abcxyzABCXYZ0189_$";
+  for (unsigned len = 0; len < 80; ++len) {
+    for (const char *stop : {" ", "@", "[", "`", "{", "/", ":", "\xC3"}) {
+      std::string text;
+      for (unsigned i = 0; i < len; ++i) text += body[i % (sizeof(body) - 1)];
+      text += stop;
+      text += std::string(40, 'a');
+      const char *begin = text.data();
+      EXPECT_EQ(begin + len,
+                SkipIdentifierBody(begin, begin + text.size()))
+          << len << " " << stop;
+    }
+  }
+}
+
+TEST_P(CharScanTest, FindFirstOf) {
+  for (unsigned len = 0; len < 80; ++len) {
+    std::string text = std::string(len, 'a') + "*/" + std::string(40, 'a');
+    const char *begin = text.data();
+    const char *end = begin + text.size();
+    EXPECT_EQ(begin + len, FindFirstOf(begin, end, '*', '/', '\n', '\r'));
+    EXPECT_EQ(begin + len + 1, FindFirstOf(begin, end, '/', '/', '/', '/'));
+    EXPECT_EQ(end, FindFirstOf(begin, end, '"', '"', '"', '"'));
+    EXPECT_EQ(begin + len, FindNewLine(begin, begin + len));
+  }
+  std::string crlf = "// comment\r\n";
+  EXPECT_EQ(crlf.data() + 10,
+            FindNewLine(crlf.data(), crlf.data() + crlf.size()));
+}
+
+TEST_P(CharScanTest, LineStarts) {
+  // Line breaks at every offset, including "\r\n" split across vectors.
+  std::mt19937 rng(42);
+  const char alphabet[] = {'a', '\n', '\r', '\0', ' '};
+  for (unsigned len = 0; len < 200; ++len) {
+    std::string text(len, 'a');
+    for (char &c : text) c = alphabet[rng() % sizeof(alphabet)];
+    const char *begin = text.data();
+    const char *end = begin + text.size();
+
+    std::vector<unsigned> expected;
+    for (unsigned i = 0; i < len; ++i) {
+      if (text[i] == '\n' || (text[i] == '\r' && text[i + 1] != '\n'))
+        expected.push_back(i + 1);
+    }
+    ASSERT_EQ(expected.size(), CountLineBreaks(begin, end)) << len;
+    std::vector<unsigned> starts(expected.size());
+    EXPECT_EQ(starts.data() + starts.size(),
+              FindLineStarts(begin, end, starts.data()));
+    EXPECT_EQ(expected, starts) << len;
+  }
+}
+
+TEST(DigitScanTest, EightDigits) {
+  for (uint32_t value : {0u, 1u, 12345678u, 87654321u, 99999999u, 10000000u}) {
+    char text[9];
+    snprintf(text, sizeof(text), "%08u", value);
+    EXPECT_TRUE(AreEightDigits(text)) << text;
+    EXPECT_EQ(value, ParseEightDigits(text)) << text;
+  }
+  for (unsigned c = 0; c < 256; ++c) {
+    for (unsigned i = 0; i < 8; ++i) {
+      char text[9] = "12345678";
+      text[i] = char(c);
+      EXPECT_EQ(c >= '0' && c <= '9', AreEightDigits(text)) << c << " " << i;
+    }
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(AllLevels, CharScanTest,
+                        ::testing::Values(SIMDLevel::Scalar, SIMDLevel::SSE2,
+                                          SIMDLevel::AVX2));
@@ -1,8 +1,124 @@
+#include "stone/Core/FileMgr.h"
 #include "stone/Core/Diagnostics.h"
+#include "stone/Core/FileSystemOptions.h"
+#include "stone/Core/FileSystemStatCache.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
 #include "gtest/gtest.h"
 
+#include <chrono>
+#include <string>
+#include <vector>
+
 using namespace stone;
 
 class FileMgrTest : public ::testing::Test {
-public:
+protected:
+  llvm::SmallString<128> TestDir;
+
+  void SetUp() override {
+    ASSERT_FALSE(
+        llvm::sys::fs::createUniqueDirectory("stone-filemgr", TestDir));
+  }
+  void TearDown() override { llvm::sys::fs::remove_directories(TestDir); }
+
+  std::string GetPath(llvm::StringRef Name) const {
+    llvm::SmallString<128> Path(TestDir);
+    llvm::sys::path::append(Path, Name);
+    return Path.str().str();
+  }
+
+  /// Move the mtime of \p Dir back, so that the stat cache trusts it.
+  static void Age(llvm::StringRef Dir) {
+    int FD;
+    ASSERT_FALSE(llvm::sys::fs::openFileForRead(Dir, FD));
+    auto Past = std::chrono::system_clock::to_time_t(
+        std::chrono::system_clock::now() - std::chrono::hours(1));
+    ASSERT_FALSE(llvm::sys::fs::setLastAccessAndModificationTime(
+        FD, llvm::sys::toTimePoint(Past)));
+    llvm::sys::fs::closeFile(FD);
+  }
 };
+
+TEST_F(FileMgrTest, PersistentStatCache) {
+  auto FS = llvm::vfs::getRealFileSystem();
+  std::string CacheDir = GetPath("cache");
+  std::string CachePath = GetPath("cache/stat");
+  std::string SubDir = GetPath("include");
+  std::string Missing = GetPath("include/missing.h");
+  ASSERT_FALSE(llvm::sys::fs::create_directory(CacheDir));
+  ASSERT_FALSE(llvm::sys::fs::create_directory(SubDir));
+  Age(SubDir);
+  Age(TestDir);
+
+  llvm::vfs::Status Status;
+  {
+    auto Cache = PersistentStatCache::create(CachePath);
+    EXPECT_TRUE(bool(FileSystemStatCache::get(Missing, Status, true, nullptr,
+                                              Cache.get(), *FS)));
+    EXPECT_FALSE(FileSystemStatCache::get(SubDir, Status, false, nullptr,
+                                          Cache.get(), *FS));
+    EXPECT_EQ(0U, Cache->getNumHits());
+    EXPECT_EQ(2U, Cache->getNumMisses());
+    EXPECT_TRUE(Cache->isDirty());
+  }
+  {
+    auto Cache = PersistentStatCache::create(CachePath);
+    EXPECT_TRUE(bool(FileSystemStatCache::get(Missing, Status, true, nullptr,
+                                              Cache.get(), *FS)));
+    EXPECT_FALSE(FileSystemStatCache::get(SubDir, Status, false, nullptr,
+                                          Cache.get(), *FS));
+    EXPECT_TRUE(Status.isDirectory());
+    EXPECT_EQ(2U, Cache->getNumHits());
+    EXPECT_EQ(0U, Cache->getNumMisses());
+    EXPECT_FALSE(Cache->isDirty());
+  }
+
+  // Creating the file changes its directory, so the cache stops claiming
+  // that it is missing.
+  {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Missing, EC);
+    OS << "x";
+  }
+  {
+    auto Cache = PersistentStatCache::create(CachePath);
+    EXPECT_FALSE(FileSystemStatCache::get(Missing, Status, true, nullptr,
+                                          Cache.get(), *FS));
+    EXPECT_EQ(1U, Status.getSize());
+    EXPECT_EQ(0U, Cache->getNumHits());
+  }
+}
+
+TEST_F(FileMgrTest, Prefetch) {
+  std::vector<std::string> Paths;
+  for (unsigned i = 0; i != 8; ++i) {
+    Paths.push_back(GetPath("file" + std::to_string(i) + ".stone"));
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Paths.back(), EC);
+    ASSERT_FALSE(EC);
+    OS << "fun F" << i << "() {}\n";
+  }
+  Paths.push_back(GetPath("missing.stone"));
+
+  FileSystemOptions FSOpts;
+  FileMgr FM(FSOpts);
+  std::vector<llvm::StringRef> Names(Paths.begin(), Paths.end());
+  EXPECT_EQ(8U, FM.Prefetch(Names, 4));
+  // Every file was looked up already, so there is nothing left to fetch.
+  EXPECT_EQ(0U, FM.Prefetch(Names, 4));
+
+  for (unsigned i = 0; i != 8; ++i) {
+    const SrcFile *File = FM.getFile(Paths[i]);
+    ASSERT_NE(nullptr, File);
+    auto Buffer = FM.getBufferForFile(File);
+    ASSERT_TRUE(bool(Buffer));
+    EXPECT_EQ("fun F" + std::to_string(i) + "() {}\n",
+              (*Buffer)->getBuffer());
+  }
+  EXPECT_EQ(nullptr, FM.getFile(Paths.back()));
+}
@@ -0,0 +1,136 @@
+#include "stone/Core/Identifier.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "stone/Core/LangOptions.h"
+#include "stone/Core/Stats.h"
+
+using namespace stone;
+using namespace stone::syntax;
+
+TEST(IdentifierTableTest, GetIsUnique) {
+  LangOptions langOpts;
+  IdentifierTable table(langOpts);
+  unsigned numKeywords = table.size();
+
+  // Enough names to grow every shard several times.
+  std::vector<Identifier *> identifiers;
+  for (unsigned i = 0; i != 5000; ++i) {
+    std::string name = "name" + std::to_string(i);
+    Identifier &identifier = table.Get(name);
+    EXPECT_EQ(name, identifier.GetName());
+    EXPECT_EQ('\0', identifier.getNameStart()[name.size()]);
+    identifiers.push_back(&identifier);
+  }
+  EXPECT_EQ(numKeywords + 5000, table.size());
+
+  for (unsigned i = 0; i != 5000; ++i)
+    EXPECT_EQ(identifiers[i], &table.Get("name" + std::to_string(i)));
+  EXPECT_EQ(numKeywords + 5000, table.size());
+
+  unsigned numVisited = 0;
+  for (Identifier &identifier : table) {
+    EXPECT_EQ(&identifier, &table.Get(identifier.GetName()));
+    ++numVisited;
+  }
+  EXPECT_EQ(table.size(), numVisited);
+}
+
+TEST(IdentifierTableTest, Keywords) {
+  LangOptions langOpts;
+  IdentifierTable table(langOpts);
+  EXPECT_EQ(tk::identifier, table.Get("notAKeyword").getTokenKind());
+  EXPECT_NE(tk::identifier, table.Get("if").getTokenKind());
+}
+
+TEST(IdentifierTableTest, ShortNamesSpreadOverShards) {
+  // The commonest names are the shortest, so they must not pile up on a few
+  // shard locks.
+  std::string heads = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+  std::string bodies = heads + "0123456789";
+  std::vector<unsigned> oneChar(IdentifierTable::NumShards);
+  std::vector<unsigned> twoChars(IdentifierTable::NumShards);
+  for (char head : heads) {
+    std::string name(1, head);
+    ++oneChar[IdentifierTable::GetShardIndex(IdentifierTable::HashName(name))];
+    for (char body : bodies) {
+      name = {head, body};
+      ++twoChars[IdentifierTable::GetShardIndex(
+          IdentifierTable::HashName(name))];
+    }
+  }
+  unsigned fairShare =
+      heads.size() * bodies.size() / IdentifierTable::NumShards;
+  for (unsigned shard = 0; shard != IdentifierTable::NumShards; ++shard) {
+    EXPECT_NE(0U, oneChar[shard]) << shard;
+    EXPECT_GT(fairShare * 5 / 4, twoChars[shard]) << shard;
+    EXPECT_LT(fairShare * 3 / 4, twoChars[shard]) << shard;
+  }
+}
+
+TEST(IdentifierTableTest, GetFromManyThreads) {
+  LangOptions langOpts;
+  IdentifierTable table(langOpts);
+  unsigned numKeywords = table.size();
+
+  // Every thread interns the same names, starting at different points, so
+  // that most names are first looked up by several threads at once.
+  const unsigned numThreads = 8;
+  const unsigned numNames = 20000;
+  std::vector<std::vector<Identifier *>> results(numThreads);
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t != numThreads; ++t) {
+    threads.emplace_back([&, t] {
+      results[t].resize(numNames);
+      for (unsigned n = 0; n != numNames; ++n) {
+        unsigned i = (n + t * numNames / numThreads) % numNames;
+        results[t][i] = &table.Get("id" + std::to_string(i));
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  EXPECT_EQ(numKeywords + numNames, table.size());
+  for (unsigned i = 0; i != numNames; ++i) {
+    EXPECT_EQ("id" + std::to_string(i), results[0][i]->GetName());
+    for (unsigned t = 1; t != numThreads; ++t)
+      EXPECT_EQ(results[0][i], results[t][i]) << i;
+  }
+}
+
+TEST(IdentifierTableTest, Stats) {
+  LangOptions langOpts;
+  IdentifierTable table(langOpts);
+  for (unsigned i = 0; i != 1000; ++i) table.Get("name" + std::to_string(i));
+  for (unsigned i = 0; i != 1000; ++i) table.Get("name" + std::to_string(i));
+
+  StatEngine engine;
+  engine.AddStats(table.GetStats());
+  llvm::json::Object data = engine.GetData();
+  llvm::json::Object *stats = data.getObject("IdentifierTable");
+  ASSERT_TRUE(stats);
+
+  EXPECT_EQ(int64_t(table.size()), stats->getInteger("identifiers"));
+  EXPECT_LT(0, *stats->getInteger("rehashes"));
+  EXPECT_LE(1, *stats->getInteger("maxProbeLength"));
+  EXPECT_LT(0.0, *stats->getNumber("arenaBytesPerIdentifier"));
+
+  // Every identifier sits at some probe length.
+  int64_t numResident = 0;
+  for (const auto &count : *stats->getArray("residentProbeLengths"))
+    numResident += *count.getAsInteger();
+  EXPECT_EQ(int64_t(table.size()), numResident);
+
+#if STONE_IDENTIFIER_TABLE_STATS
+  EXPECT_EQ(1000, *stats->getInteger("lookupHits"));
+  EXPECT_LE(1000, *stats->getInteger("lookupMisses"));
+#else
+  EXPECT_FALSE(stats->get("lookupHits"));
+#endif
+
+  engine.RemoveStats(table.GetStats());
+  EXPECT_TRUE(engine.GetData().empty());
+}
@@ -6,10 +6,15 @@
 
 #include "llvm/ADT/SmallString.h"
 #include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Process.h"
 #include "gtest/gtest.h"
 
 #include <cstddef>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace stone;
 
@@ -73,3 +78,226 @@ TEST_F(SrcMgrTest, GetColNumber) {
   // Test with no invalid flag.
   EXPECT_EQ(1U, sm.GetColNumber(MainSrcID, 0, nullptr));
 }
+
+TEST_F(SrcMgrTest, GetLineNumber) {
+  // "\r\n" is one line break, a lone '\r' is one and '\0' is not one.
+  llvm::StringRef Source("a\nb\r\nc\rd\0e\n\n", 12);
+  auto memBuffer = llvm::MemoryBuffer::getMemBuffer(Source, "", false);
+  auto MainSrcID = sm.CreateSrcID(std::move(memBuffer));
+
+  unsigned Expected[] = {1, 1, 2, 2, 2, 3, 3, 4, 4, 4, 4, 5, 6};
+  for (unsigned Offset = 0; Offset <= Source.size(); ++Offset) {
+    bool Invalid = true;
+    EXPECT_EQ(Expected[Offset], sm.GetLineNumber(MainSrcID, Offset, &Invalid))
+        << Offset;
+    EXPECT_FALSE(Invalid);
+  }
+}
+
+TEST(LineOffsetTableTest, Compress) {
+  std::mt19937 Rng(7);
+  // The longest line of each table picks its encoding.
+  struct {
+    unsigned MaxLength;
+    src::LineOffsetTable::Encoding Enc;
+  } Cases[] = {
+      {200, src::LineOffsetTable::Encoding::Deltas8},
+      {60000, src::LineOffsetTable::Encoding::Deltas16},
+      {70000, src::LineOffsetTable::Encoding::Offsets32},
+  };
+  for (const auto &C : Cases) {
+    std::vector<unsigned> Offsets = {0};
+    for (unsigned I = 1; I != 1000; ++I)
+      Offsets.push_back(Offsets.back() + 1 + Rng() % 40);
+    Offsets[500] = Offsets[499] + C.MaxLength;
+    for (unsigned I = 501; I != 1000; ++I)
+      Offsets[I] = Offsets[I - 1] + 1 + Rng() % 40;
+
+    llvm::BumpPtrAllocator Alloc;
+    src::LineOffsetTable Lines;
+    Lines.assignCompressed(Offsets, Alloc);
+    EXPECT_EQ(C.Enc, Lines.getEncoding());
+    ASSERT_EQ(Offsets.size(), Lines.size());
+    for (unsigned I = 0; I != Offsets.size(); ++I)
+      EXPECT_EQ(Offsets[I], Lines.getLineStart(I)) << I;
+    for (unsigned Pos = 0; Pos <= Offsets.back() + 5; ++Pos) {
+      unsigned Expected =
+          std::upper_bound(Offsets.begin(), Offsets.end(), Pos) -
+          Offsets.begin();
+      ASSERT_EQ(Expected, Lines.findLine(Pos)) << Pos;
+    }
+  }
+}
+
+TEST_F(SrcMgrTest, CompressedLineTable) {
+  // Large enough to be compressed, with "\r\n" and '\r' line breaks.
+  std::string Source;
+  std::vector<unsigned> LineStarts = {0};
+  const unsigned Threshold = src::LineOffsetTable::CompressionThreshold;
+  for (unsigned I = 0; Source.size() < Threshold; ++I) {
+    Source += std::string(I % 50, 'x');
+    Source += I % 3 == 0 ? "\r\n" : I % 3 == 1 ? "\n" : "\r";
+    LineStarts.push_back(Source.size());
+  }
+  auto MainSrcID = sm.CreateSrcID(llvm::MemoryBuffer::getMemBuffer(Source));
+
+  for (unsigned Line = 1; Line <= LineStarts.size(); Line += 97) {
+    unsigned Start = LineStarts[Line - 1];
+    EXPECT_EQ(Line, sm.GetLineNumber(MainSrcID, Start));
+    EXPECT_EQ(1U, sm.GetColNumber(MainSrcID, Start));
+    EXPECT_EQ(sm.getLocForStartOfFile(MainSrcID).getLocWithOffset(Start),
+              sm.translateLineCol(MainSrcID, Line, 1));
+  }
+  // Short lines take one byte each instead of four.
+  EXPECT_LT(2 * LineStarts.size(), sm.getLineTableBytesSaved());
+}
+
+TEST_F(SrcMgrTest, ConcurrentLookups) {
+  sm.setConcurrent();
+
+  // Each file has a different number of lines of different lengths, so that
+  // a location resolved against the wrong file or line is noticed.
+  const unsigned NumFiles = 8;
+  std::vector<std::string> Sources(NumFiles);
+  std::vector<SrcID> IDs;
+  for (unsigned F = 0; F != NumFiles; ++F) {
+    for (unsigned Line = 0; Line != 200 + F * 10; ++Line)
+      Sources[F] += std::string((Line + F) % 30, 'x') + "\n";
+    IDs.push_back(
+        sm.CreateSrcID(llvm::MemoryBuffer::getMemBuffer(Sources[F])));
+  }
+
+  // Every thread walks every file; the first queries of each file compute
+  // its line table while other threads read it.
+  std::vector<std::thread> Threads;
+  std::vector<unsigned> NumErrors(NumFiles);
+  for (unsigned T = 0; T != NumFiles; ++T) {
+    Threads.emplace_back([&, T] {
+      for (unsigned I = 0; I != NumFiles; ++I) {
+        unsigned F = (T + I) % NumFiles;
+        SrcLoc Start = sm.getLocForStartOfFile(IDs[F]);
+        unsigned Line = 1, Col = 1;
+        for (unsigned Pos = 0; Pos != Sources[F].size(); ++Pos) {
+          SrcLoc Loc = Start.getLocWithOffset(Pos);
+          if (sm.getSrcID(Loc) != IDs[F] ||
+              sm.GetLineNumber(IDs[F], Pos) != Line ||
+              sm.GetColNumber(IDs[F], Pos) != Col)
+            ++NumErrors[T];
+          if (Sources[F][Pos] == '\n') {
+            ++Line;
+            Col = 1;
+          } else {
+            ++Col;
+          }
+        }
+      }
+    });
+  }
+
+  // Creating SrcIDs may overlap with lookups. Enough are created for the
+  // SLocEntry table to grow while the threads are reading it.
+  for (unsigned I = 0; I != 1000; ++I)
+    sm.CreateSrcID(llvm::MemoryBuffer::getMemBuffer(Sources[I % NumFiles]));
+
+  for (std::thread &Thread : Threads) Thread.join();
+  for (unsigned T = 0; T != NumFiles; ++T) EXPECT_EQ(0U, NumErrors[T]);
+}
+
+TEST_F(SrcMgrTest, MapLargeFiles) {
+  // One file below the map threshold and one above it.
+  const unsigned Threshold = fm.getFileSystemOpts().MapThreshold;
+  std::string Small(Threshold / 2, 'x'), Large(Threshold * 2, 'y');
+  Small += "\n";
+  Large += "\n";
+  std::vector<SrcID> IDs;
+  std::vector<llvm::SmallString<128>> Paths(2);
+  for (unsigned I = 0; I != 2; ++I) {
+    int FD;
+    ASSERT_FALSE(
+        llvm::sys::fs::createTemporaryFile("srcmgr", "stone", FD, Paths[I]));
+    {
+      llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << (I == 0 ? Small : Large);
+    }
+    const SrcFile *File = fm.getFile(Paths[I]);
+    ASSERT_TRUE(File);
+    IDs.push_back(sm.CreateSrcID(File, SrcLoc(), src::C_User));
+  }
+
+  EXPECT_EQ(Small, sm.getBufferData(IDs[0]));
+  EXPECT_EQ(Large, sm.getBufferData(IDs[1]));
+  EXPECT_EQ(llvm::MemoryBuffer::MemoryBuffer_Malloc,
+            sm.getBuffer(IDs[0])->getBufferKind());
+#if LLVM_ON_UNIX
+  EXPECT_EQ(llvm::MemoryBuffer::MemoryBuffer_MMap,
+            sm.getBuffer(IDs[1])->getBufferKind());
+#endif
+
+  // Dropping the pages of either buffer keeps its contents.
+  for (SrcID ID : IDs) {
+    sm.adviseBufferAccess(ID, src::BufferAccess::Random);
+    sm.adviseBufferAccess(ID, src::BufferAccess::NotNeeded);
+  }
+  EXPECT_EQ(Small, sm.getBufferData(IDs[0]));
+  EXPECT_EQ(Large, sm.getBufferData(IDs[1]));
+  EXPECT_EQ(2U, sm.GetLineNumber(IDs[1], Large.size()));
+
+  for (const auto &Path : Paths) llvm::sys::fs::remove(Path);
+}
+
+TEST_F(SrcMgrTest, ShareIdenticalContents) {
+  // Two copies of one file and a file that differs from them.
+  const char *Contents[] = {"fun F() {}\nfun G() {}\n",
+                            "fun F() {}\nfun G() {}\n",
+                            "fun F() {}\nfun H() {}\n"};
+  std::vector<SrcID> IDs;
+  std::vector<const SrcFile *> Files;
+  std::vector<llvm::SmallString<128>> Paths(3);
+  for (unsigned I = 0; I != 3; ++I) {
+    int FD;
+    ASSERT_FALSE(
+        llvm::sys::fs::createTemporaryFile("srcmgr", "stone", FD, Paths[I]));
+    {
+      llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Contents[I];
+    }
+    const SrcFile *File = fm.getFile(Paths[I]);
+    ASSERT_TRUE(File);
+    Files.push_back(File);
+    IDs.push_back(sm.CreateSrcID(File, SrcLoc(), src::C_User));
+  }
+
+  for (unsigned I = 0; I != 3; ++I)
+    EXPECT_EQ(Contents[I], sm.getBufferData(IDs[I]));
+  EXPECT_EQ(sm.getBufferData(IDs[0]).data(), sm.getBufferData(IDs[1]).data());
+  EXPECT_NE(sm.getBufferData(IDs[0]).data(), sm.getBufferData(IDs[2]).data());
+  EXPECT_EQ(1U, sm.getSharedContentsStats().first);
+
+  // The copies keep their own names and share one line table.
+  EXPECT_EQ(Paths[1], sm.getFilename(sm.getLocForStartOfFile(IDs[1])));
+  EXPECT_EQ(2U, sm.GetLineNumber(IDs[1], 12));
+  EXPECT_EQ(2U, sm.GetLineNumber(IDs[0], 12));
+
+  // A copy whose owner is given other contents before the copy has line
+  // numbers keeps its own contents and lines.
+  llvm::SmallString<128> CopyPath;
+  int FD;
+  ASSERT_FALSE(
+      llvm::sys::fs::createTemporaryFile("srcmgr", "stone", FD, CopyPath));
+  {
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS << Contents[2];
+  }
+  const SrcFile *CopyFile = fm.getFile(CopyPath);
+  ASSERT_TRUE(CopyFile);
+  SrcID CopyID = sm.CreateSrcID(CopyFile, SrcLoc(), src::C_User);
+  EXPECT_EQ(sm.getBufferData(IDs[2]).data(), sm.getBufferData(CopyID).data());
+  sm.overrideFileContents(
+      Files[2], llvm::MemoryBuffer::getMemBufferCopy(std::string(13, '\n')));
+  EXPECT_EQ(13U, sm.GetLineNumber(IDs[2], 12));
+  EXPECT_EQ(Contents[2], sm.getBufferData(CopyID));
+  EXPECT_EQ(2U, sm.GetLineNumber(CopyID, 12));
+
+  Paths.push_back(CopyPath);
+  for (const auto &Path : Paths) llvm::sys::fs::remove(Path);
+}
@@ -7,12 +7,38 @@
 #include "llvm/Support/StringSaver.h"
 #include "llvm/Support/TargetSelect.h"
 #include "stone/Compile/Compile.h"
+#include "stone/Core/FileSystemStatCache.h"
 #include "stone/Core/Ret.h"
 #include "stone/Driver/Run.h"
 #include "stone/Session/ExecutablePath.h"
 
 using namespace stone;
 
+/// stone -prime-stat-cache <cache> <dir>...
+///
+/// Record every directory below the given ones in the persistent stat cache,
+/// e.g. the search paths, before the first compile that uses the cache
+/// through -stat-cache <cache>.
+static int PrimeStatCache(llvm::ArrayRef<const char *> args) {
+  if (args.empty()) {
+    llvm::errs() << "usage: stone -prime-stat-cache <cache> <dir>...\n";
+    return ret::err;
+  }
+  auto fs = llvm::vfs::getRealFileSystem();
+  auto cache = PersistentStatCache::create(args[0]);
+  for (const char *path : args.drop_front()) {
+    llvm::SmallString<128> absPath(path);
+    llvm::sys::fs::make_absolute(absPath);
+    cache->addTree(absPath, *fs);
+  }
+  if (std::error_code ec = cache->save()) {
+    llvm::errs() << "error: cannot write '" << args[0] << "': " << ec.message()
+                 << "\n";
+    return ret::err;
+  }
+  return ret::ok;
+}
+
 int main(int argc, const char **args) {
   llvm::InitLLVM initLLVM(argc, args);
   if (llvm::sys::Process::FixupStandardFileDescriptors()) {
@@ -41,6 +67,8 @@ int main(int argc, const char **args) {
                              expandedArgs.data() + expandedArgs.size()),
           expandedArgs[0], (void *)(intptr_t)stone::GetExecutablePath, nullptr);
     }
+    if (firstArg == "-prime-stat-cache")
+      return PrimeStatCache(expandedArgs.drop_front(2));
   }
 
   return stone::Run(